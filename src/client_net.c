@@ -3,7 +3,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "timeutil.h"
+#include "shm.h"
+#include "udp.h"
 
 #ifdef _WIN32
 #define strcasecmp _stricmp
@@ -11,7 +14,15 @@
 #include <strings.h>
 #endif
 
-static net_socket_t g_sock = -1;
+static net_socket_t g_sock = -1; // the control socket for a shared-memory session
+// udp:host[:port] sessions: the reliable channel and the newest snapshot tick seen (see poll_udp)
+static int g_udp_on = 0;
+static UdpChannel g_udp;
+static uint32_t g_udp_tick;
+static int g_udp_have_tick = 0;
+#ifdef SHM_TRANSPORT
+static ShmSession g_shm = { -1, NULL, -1, -1 }; // link is set while connected with shm:PATH
+#endif
 static char g_recv_buf[8192];
 static int g_recv_len = 0;
 static double g_last_ping_ms = 0.0;
@@ -20,6 +31,23 @@ extern int g_net_ping_ms; // from mp.c
 extern int g_mp_joined;   // from mp.c
 static int g_ready_received = 0;
 
+// Movement inputs sent with a sequence number but not yet acknowledged (ACK). Our own player is
+// drawn at the last server position with these replayed on top, using the server's move rules.
+#define MAX_PENDING_INPUTS 32
+#define PENDING_INPUT_TIMEOUT_MS 1000.0 // the server dropped it (rate limit or full queue)
+typedef struct { uint32_t seq; int dx, dy; double sentMs; } PendingInput;
+static PendingInput g_pending[MAX_PENDING_INPUTS];
+static int g_pending_count = 0;
+static uint32_t g_input_seq = 0;
+static int g_server_wx, g_server_wy, g_server_x, g_server_y; // last authoritative own position
+static int g_last_tick = -1; // newest TICK received, reported with INPUT for lag-compensated shots
+// Mirror of the server's INPUT token bucket (burst 10, max 20, +1 per 2 ticks), so inputs the
+// server would drop are neither sent nor predicted
+#define INPUT_TOKENS_MAX 20
+#define INPUT_TOKEN_MS 100.0
+static int g_input_tokens = 10;
+static double g_input_tokens_ms = 0.0;
+
 static void parse_host_port(const char *in, char *host, size_t hostcap, char *port, size_t portcap) {
     const char *colon = strrchr(in, ':');
     if (colon) {
@@ -35,51 +63,192 @@ static void parse_host_port(const char *in, char *host, size_t hostcap, char *po
     }
 }
 
+static void udp_send(void *ctx, const char *pkt, int len) {
+    (void)ctx;
+    net_send_all(g_sock, pkt, len);
+}
+
+// Everything to and from the server goes through these, over the socket, the rings or UDP (on
+// its reliable channel; conn_send_unreliable is for INPUT and PING, which a newer one replaces)
+static int conn_send(const char *data, int len) {
+    if (g_udp_on) {
+        if (!udp_queue(&g_udp, data, len)) return -1;
+        udp_pump(&g_udp, now_ms(), udp_send, NULL);
+        return len;
+    }
+#ifdef SHM_TRANSPORT
+    if (g_shm.link) return shm_session_send(&g_shm, data, len);
+#endif
+    return net_send_all(g_sock, data, len);
+}
+
+static int conn_send_unreliable(const char *data, int len) {
+    if (!g_udp_on) return conn_send(data, len);
+    udp_send_unreliable(&g_udp, 0, data, len, udp_send, NULL);
+    return len;
+}
+
+// CONNECT until CHALLENGE, then CONNECT <token> until WELCOME; a quarter second per try, about
+// two seconds in all, like a TCP connect that gets no answer
+static int udp_handshake(void) {
+    unsigned long long token = 0;
+    char pkt[UDP_MTU + 1];
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        char req[UDP_CONNECT_LEN + 1];
+        int rn = token ? snprintf(req, sizeof(req), "CONNECT %llu", token) : snprintf(req, sizeof(req), "CONNECT");
+        memset(req + rn, ' ', (size_t)(UDP_CONNECT_LEN - rn)); // padded: see UDP_CONNECT_LEN
+        net_send_all(g_sock, req, UDP_CONNECT_LEN);
+        double until = now_ms() + 250.0;
+        for (double left = 250.0; left > 0; left = until - now_ms()) {
+            if (net_wait_readable(g_sock, (int)left + 1) <= 0) break;
+            int n = net_recv_nonblocking(g_sock, pkt, UDP_MTU);
+            if (n <= 0) continue;
+            pkt[n] = '\0';
+            unsigned ref;
+            if (sscanf(pkt, "CHALLENGE %llu", &token) == 1) break; // answer right away
+            if (sscanf(pkt, "WELCOME %u", &ref) == 1) {
+                udp_channel_init(&g_udp, ref);
+                g_udp_have_tick = 0;
+                g_udp_on = 1;
+                return 0;
+            }
+            if (strncmp(pkt, "FULL", 4) == 0) return -1;
+        }
+    }
+    return -1;
+}
+
+static int conn_recv(char *buf, int cap) {
+#ifdef SHM_TRANSPORT
+    if (g_shm.link) return shm_session_recv(&g_shm, buf, cap);
+#endif
+    return net_recv_nonblocking(g_sock, buf, cap);
+}
+
 int client_connect(const char *addr_input) {
     if (net_init() != 0) return -1;
-    char host[256], port[32]; parse_host_port(addr_input, host, sizeof(host), port, sizeof(port));
-    g_sock = net_connect_hostport(host, port);
-    if (g_sock < 0) return -1;
-    net_set_nonblocking(g_sock);
-    net_set_tcp_nodelay_keepalive(g_sock);
-    // Simple hello
-    const char *hello = "HELLO\n"; net_send_all(g_sock, hello, (int)strlen(hello));
+    char addr[256]; strncpy(addr, addr_input, sizeof(addr) - 1); addr[sizeof(addr) - 1] = '\0';
+    char *lobby;
+    if (strncmp(addr, "shm:", 4) == 0) {
+        // A server on this host: shm:PATH[#lobby], PATH being its --shm socket
+        lobby = strchr(addr, '#');
+        if (lobby) *lobby++ = '\0';
+#ifdef SHM_TRANSPORT
+        if (shm_connect(addr + 4, &g_shm) != 0) return -1;
+        g_sock = g_shm.sock;
+#else
+        return -1;
+#endif
+    } else {
+        // Optional lobby after a slash: host[:port]/lobby, over TCP or (udp:host[:port]) UDP
+        int udp = strncmp(addr, "udp:", 4) == 0;
+        lobby = strchr(addr, '/');
+        if (lobby) *lobby++ = '\0';
+        char host[256], port[32]; parse_host_port(addr + (udp ? 4 : 0), host, sizeof(host), port, sizeof(port));
+        g_sock = udp ? net_udp_connect_hostport(host, port) : net_connect_hostport(host, port);
+        if (g_sock < 0) return -1;
+        net_set_nonblocking(g_sock);
+        if (udp && udp_handshake() != 0) { net_close(g_sock); g_sock = -1; return -1; }
+        if (!udp) net_set_tcp_nodelay_keepalive(g_sock);
+    }
+    g_input_tokens = 10; g_input_tokens_ms = now_ms();
+    // Simple hello, naming the lobby to join if one was given
+    char hello[96];
+    int hn = (lobby && *lobby) ? snprintf(hello, sizeof(hello), "HELLO %s\n", lobby) : snprintf(hello, sizeof(hello), "HELLO\n");
+    conn_send(hello, hn);
     return 0;
 }
 
 void client_disconnect(void) {
+    if (g_udp_on) { udp_channel_free(&g_udp); g_udp_on = 0; }
+#ifdef SHM_TRANSPORT
+    if (g_shm.link) { shm_session_close(&g_shm); g_sock = -1; }
+#endif
     if (g_sock >= 0) { net_close(g_sock); g_sock = -1; }
     net_cleanup();
     g_recv_len = 0;
+    g_pending_count = 0;
+    g_last_tick = -1;
+}
+
+// Same step as the server's INPUT handling: at most one tile; leaving the map keeps the other
+// coordinate and needs an open entry tile; a horizontal crossing wins on diagonals
+static void predict_step(RemotePlayer *me, int dx, int dy) {
+    int wx = me->worldX, wy = me->worldY, x = me->pos.x, y = me->pos.y;
+    int nwx = wx, nwy = wy, nx = x + dx, ny = y + dy, crossedX = 0;
+    if (nx < 0) {
+        if (game_mp_is_open_world(wx - 1, wy, MAP_WIDTH - 1, y)) { nwx--; nx = MAP_WIDTH - 1; ny = y; crossedX = 1; }
+    } else if (nx >= MAP_WIDTH) {
+        if (game_mp_is_open_world(wx + 1, wy, 0, y)) { nwx++; nx = 0; ny = y; crossedX = 1; }
+    }
+    if (!crossedX) {
+        if (ny < 0) {
+            if (game_mp_is_open_world(nwx, wy - 1, x, MAP_HEIGHT - 1)) { nwy--; ny = MAP_HEIGHT - 1; nx = x; }
+        } else if (ny >= MAP_HEIGHT) {
+            if (game_mp_is_open_world(nwx, wy + 1, x, 0)) { nwy++; ny = 0; nx = x; }
+        }
+    }
+    if (!game_mp_is_open_world(nwx, nwy, nx, ny)) return;
+    for (int i = 0; i < MAX_REMOTE_PLAYERS; ++i) {
+        if (i == g_my_player_id || !g_remote_players[i].active) continue;
+        if (g_remote_players[i].worldX == nwx && g_remote_players[i].worldY == nwy && g_remote_players[i].pos.x == nx && g_remote_players[i].pos.y == ny) return;
+    }
+    me->worldX = nwx; me->worldY = nwy; me->pos.x = nx; me->pos.y = ny;
+}
+
+// Place our player at the last server position and replay the pending inputs
+static void rebase_self(void) {
+    if (g_my_player_id < 0 || g_my_player_id >= MAX_REMOTE_PLAYERS) return;
+    RemotePlayer *me = &g_remote_players[g_my_player_id];
+    me->lastWorldX = me->worldX; me->lastWorldY = me->worldY; me->lastPos = me->pos;
+    me->worldX = g_server_wx; me->worldY = g_server_wy; me->pos.x = g_server_x; me->pos.y = g_server_y;
+    for (int k = 0; k < g_pending_count; ++k) predict_step(me, g_pending[k].dx, g_pending[k].dy);
+    extern int game_tick_count; me->lastUpdateTick = game_tick_count;
+    game_mp_set_self(me->worldX, me->worldY, me->pos.x, me->pos.y);
+}
+
+static int take_input_token(void) {
+    int refill = (int)((now_ms() - g_input_tokens_ms) / INPUT_TOKEN_MS);
+    if (refill > 0) {
+        g_input_tokens = g_input_tokens + refill > INPUT_TOKENS_MAX ? INPUT_TOKENS_MAX : g_input_tokens + refill;
+        g_input_tokens_ms += refill * INPUT_TOKEN_MS;
+    }
+    if (g_input_tokens <= 0) return 0;
+    g_input_tokens--;
+    return 1;
 }
 
 void client_send_input(int dx, int dy, int shoot) {
     if (g_sock < 0) return;
+    if (!take_input_token()) return;
     char buf[64];
-    int n = snprintf(buf, sizeof(buf), "INPUT %d %d %d\n", dx, dy, shoot);
-    net_send_all(g_sock, buf, n);
+    int n;
+    RemotePlayer *me = (g_my_player_id >= 0 && g_my_player_id < MAX_REMOTE_PLAYERS) ? &g_remote_players[g_my_player_id] : NULL;
+    if ((dx != 0 || dy != 0) && me && me->active && g_pending_count < MAX_PENDING_INPUTS) {
+        // Movement is predicted right away and confirmed by ACK
+        PendingInput *pi = &g_pending[g_pending_count++];
+        pi->seq = ++g_input_seq; pi->dx = dx; pi->dy = dy; pi->sentMs = now_ms();
+        n = snprintf(buf, sizeof(buf), "INPUT %d %d %d %u %d\n", dx, dy, shoot, (unsigned)pi->seq, g_last_tick);
+        me->lastWorldX = me->worldX; me->lastWorldY = me->worldY; me->lastPos = me->pos;
+        predict_step(me, dx, dy);
+        extern int game_tick_count; me->lastUpdateTick = game_tick_count;
+        game_mp_set_self(me->worldX, me->worldY, me->pos.x, me->pos.y);
+    } else {
+        n = snprintf(buf, sizeof(buf), "INPUT %d %d %d 0 %d\n", dx, dy, shoot, g_last_tick);
+    }
+    conn_send_unreliable(buf, n);
 }
 
 void client_send_raw(const char *s) {
     if (g_sock < 0) return;
     if (!s) return;
-    net_send_all(g_sock, s, (int)strlen(s));
+    conn_send(s, (int)strlen(s));
 }
 
-int client_poll_messages(void) {
+// Append received bytes to the rolling buffer and handle every complete line. Returns 1 if a
+// redraw is warranted.
+static int handle_received(const char *tmp, int n) {
     int changed = 0;
-    if (g_sock < 0) return 0;
-    // Periodic ping (1 Hz)
-    double now = now_ms();
-    if (now - g_last_ping_ms >= 1000.0) {
-        char pbuf[64];
-        int pn = snprintf(pbuf, sizeof(pbuf), "PING %.3f\n", now);
-        net_send_all(g_sock, pbuf, pn);
-        g_last_ping_ms = now;
-    }
-    char tmp[2048];
-    int n = net_recv_nonblocking(g_sock, tmp, sizeof(tmp));
-    if (n <= 0) return 0;
     // Do not reset snapshots on arbitrary chunks; wait for TICK boundary
     // Append to rolling buffer, clamp if necessary (drop oldest on overflow)
     int cap = (int)sizeof(g_recv_buf) - 1;
@@ -121,12 +290,26 @@ int client_poll_messages(void) {
         // Parse one line
         if (line[0] == '\0') continue;
         if (strncmp(line, "YOU ", 4) == 0) {
+            // Also sent when a region server hands us to its neighbor: ids and ticks start over
+            for (int i = 0; i < MAX_REMOTE_PLAYERS; ++i) g_remote_players[i].active = 0;
+            g_last_tick = -1;
             g_my_player_id = atoi(line + 4);
             changed = 1;
+        } else if (strncmp(line, "WORLD ", 6) == 0) {
+            int w = 0, h = 0;
+            if (sscanf(line + 6, "%d %d", &w, &h) == 2) game_mp_set_world(w, h);
+            changed = 1;
         } else if (strncmp(line, "TICK", 4) == 0) {
+            int tick = atoi(line + 4);
+            if (tick > g_last_tick) g_last_tick = tick;
             // Snapshot boundary: clear transient objects and prepare for fresh state
             for (int i = 0; i < MAX_REMOTE_BULLETS; ++i) g_remote_bullets[i].active = 0;
             for (int i = 0; i < MAX_REMOTE_ENEMIES; ++i) g_remote_enemies[i].active = 0;
+            // TICK n ALL: the PLAYER lines that follow are everyone; our own line is among them
+            if (strstr(line + 4, "ALL")) {
+                for (int i = 0; i < MAX_REMOTE_PLAYERS; ++i)
+                    if (i != g_my_player_id) g_remote_players[i].active = 0;
+            }
             changed = 1;
         } else if (strcmp(line, "READY") == 0) {
             g_ready_received = 1;
@@ -138,22 +321,28 @@ int client_poll_messages(void) {
                 if (id >= 0 && id < MAX_REMOTE_PLAYERS) {
                     g_remote_players[id].active = active;
                     if (active) {
-                        // store last for interpolation
-                        g_remote_players[id].lastWorldX = g_remote_players[id].worldX;
-                        g_remote_players[id].lastWorldY = g_remote_players[id].worldY;
-                        g_remote_players[id].lastPos = g_remote_players[id].pos;
-                        g_remote_players[id].worldX = wx;
-                        g_remote_players[id].worldY = wy;
-                        g_remote_players[id].pos.x = x;
-                        g_remote_players[id].pos.y = y;
-                        extern int game_tick_count; g_remote_players[id].lastUpdateTick = game_tick_count;
+                        if (id == g_my_player_id) {
+                            g_server_wx = wx; g_server_wy = wy; g_server_x = x; g_server_y = y;
+                        }
+                        // Own position stays predicted while inputs are pending; ACK rebases it
+                        if (id != g_my_player_id || g_pending_count == 0) {
+                            // store last for interpolation
+                            g_remote_players[id].lastWorldX = g_remote_players[id].worldX;
+                            g_remote_players[id].lastWorldY = g_remote_players[id].worldY;
+                            g_remote_players[id].lastPos = g_remote_players[id].pos;
+                            g_remote_players[id].worldX = wx;
+                            g_remote_players[id].worldY = wy;
+                            g_remote_players[id].pos.x = x;
+                            g_remote_players[id].pos.y = y;
+                            extern int game_tick_count; g_remote_players[id].lastUpdateTick = game_tick_count;
+                        }
                         g_remote_players[id].colorIndex = color;
                         if (parsed >= 8) g_remote_players[id].hp = hp; else g_remote_players[id].hp = 3;
                         if (parsed >= 9) g_remote_players[id].invincibleTicks = inv; else g_remote_players[id].invincibleTicks = 0;
                         if (parsed >= 10) g_remote_players[id].superTicks = sup; else g_remote_players[id].superTicks = 0;
                         if (parsed >= 11) g_remote_players[id].score = score; else g_remote_players[id].score = 0;
                         if (id == g_my_player_id) {
-                            game_mp_set_self(wx, wy, x, y);
+                            game_mp_set_self(g_remote_players[id].worldX, g_remote_players[id].worldY, g_remote_players[id].pos.x, g_remote_players[id].pos.y);
                             // Set joined only when READY already received to ensure tiles are drawn
                             if (g_ready_received) { g_mp_joined = 1; }
                         }
@@ -227,6 +416,18 @@ int client_poll_messages(void) {
                     changed = 1;
                 }
             }
+        } else if (strncmp(line, "ACK ", 4) == 0) {
+            // ACK seq wx wy x y: inputs up to seq are applied and left us at (wx,wy,x,y)
+            unsigned seq; int wx, wy, x, y;
+            if (sscanf(line + 4, "%u %d %d %d %d", &seq, &wx, &wy, &x, &y) == 5) {
+                int k = 0;
+                while (k < g_pending_count && (int32_t)(g_pending[k].seq - (uint32_t)seq) <= 0) k++;
+                memmove(g_pending, g_pending + k, (size_t)(g_pending_count - k) * sizeof(g_pending[0]));
+                g_pending_count -= k;
+                g_server_wx = wx; g_server_wy = wy; g_server_x = x; g_server_y = y;
+                rebase_self();
+                changed = 1;
+            }
         } else if (strncmp(line, "PONG ", 5) == 0) {
             double sentMs = 0.0;
             if (sscanf(line + 5, "%lf", &sentMs) == 1) {
@@ -240,10 +441,62 @@ int client_poll_messages(void) {
     return changed;
 }
 
+// Every waiting datagram: acks, reliable packets in order, and snapshots unless a newer tick has
+// already arrived (parts of an older one that show up late are dropped). Then retransmits.
+static int poll_udp(void) {
+    int changed = 0;
+    char pkt[UDP_MTU + 1];
+    double now = now_ms();
+    int n;
+    while ((n = net_recv_nonblocking(g_sock, pkt, UDP_MTU)) > 0) {
+        uint32_t num, ref; int off;
+        char type = udp_parse_header(pkt, n, &num, &ref, &off);
+        if (type == 'A') {
+            udp_on_ack(&g_udp, num, now);
+        } else if (type == 'R') {
+            int fresh = udp_accept(&g_udp, num);
+            udp_send_ack(&g_udp, udp_send, NULL);
+            if (fresh) changed |= handle_received(pkt + off, n - off);
+        } else if (type == 'U' && (!g_udp_have_tick || (int32_t)(num - g_udp_tick) >= 0)) {
+            g_udp_tick = num; g_udp_have_tick = 1;
+            changed |= handle_received(pkt + off, n - off);
+        }
+    }
+    udp_pump(&g_udp, now, udp_send, NULL);
+    return changed;
+}
+
+int client_poll_messages(void) {
+    int changed = 0;
+    if (g_sock < 0) return 0;
+    // Periodic ping (1 Hz)
+    double now = now_ms();
+    if (now - g_last_ping_ms >= 1000.0) {
+        char pbuf[64];
+        int pn = snprintf(pbuf, sizeof(pbuf), "PING %.3f\n", now);
+        conn_send_unreliable(pbuf, pn);
+        g_last_ping_ms = now;
+    }
+    // Forget inputs the server never applied and fall back to its position
+    if (g_pending_count > 0 && now - g_pending[0].sentMs > PENDING_INPUT_TIMEOUT_MS) {
+        int k = 0;
+        while (k < g_pending_count && now - g_pending[k].sentMs > PENDING_INPUT_TIMEOUT_MS) k++;
+        memmove(g_pending, g_pending + k, (size_t)(g_pending_count - k) * sizeof(g_pending[0]));
+        g_pending_count -= k;
+        rebase_self();
+        changed = 1;
+    }
+    if (g_udp_on) return poll_udp() | changed;
+    char tmp[2048];
+    int n = conn_recv(tmp, sizeof(tmp));
+    if (n <= 0) return changed;
+    return handle_received(tmp, n) | changed;
+}
+
 void client_send_bye(void) {
     if (g_sock < 0) return;
     const char *bye = "BYE\n";
-    net_send_all(g_sock, bye, (int)strlen(bye));
+    conn_send(bye, (int)strlen(bye));
 }
 
 
@@ -13,6 +13,9 @@
 #include "types.h"
 #include "term.h"
 #include "mp.h"
+#include "rng.h"
+#include "mappack.h"
+#include "mapgen.h"
 
 static Vec2 playerPos;
 static Direction playerFacing = DIR_RIGHT;
@@ -21,9 +24,11 @@ static Projectile projectiles[MAX_PROJECTILES];
 typedef struct { int active; int wx, wy; Vec2 pos; Vec2 lastPos; int lastTick; int dx, dy; double spawnedAtMs; } PredBullet;
 static PredBullet predictedBullets[32];
 
-// World configuration (3x3 grid: x0-y0 to x2-y2)
-#define WORLD_W 9
-#define WORLD_H 9
+// World size: the map pack's, else the run of text maps along the top row and left column, else
+// WORLD_DEFAULT_DIM square; in multiplayer the server's WORLD line replaces it
+#define WORLD_DEFAULT_DIM 9
+#define WORLD_MAX 256
+#define MINIMAP_DIM 9 // the minimap shows at most this many maps per side around the current one
 
 typedef struct {
     char tiles[MAP_HEIGHT][MAP_WIDTH + 1];
@@ -31,9 +36,17 @@ typedef struct {
     Enemy enemies[MAX_ENEMIES];
     int numEnemies;
     int initialized;
+    Rng rng; // per-map stream of worldSeed for enemy spawns and movement
 } MapState;
 
-static MapState world[WORLD_H][WORLD_W];
+// Maps are loaded the first time they are needed (see world_map) and kept until the world is
+// reset, so memory follows the maps visited rather than the world size
+static MapState **world = NULL; // worldW * worldH, row-major; NULL until loaded
+static int worldW = 0, worldH = 0;
+static MapState voidMap; // solid stand-in when a map cannot be allocated
+static MapPack worldPack; // stays mapped while maps may still load from it
+static int spawnMX = 0, spawnMY = 0, spawnX = 1, spawnY = 1, haveSpawn = 0; // first 'S' (see world_find_spawn)
+static uint64_t worldSeed = 0;
 static int curWorldX = 0;
 static int curWorldY = 0;
 static MapState *curMap = NULL;
@@ -51,14 +64,33 @@ static int shoot_cooldown_frames = 0; // frames until next allowed shot
 
 static int clamp(int v, int lo, int hi) { return v < lo ? lo : (v > hi ? hi : v); }
 
-static void load_map_file(int mx, int my) {
-    char path[256];
-    snprintf(path, sizeof(path), "maps/x%d-y%d.txt", mx, my);
-    MapState *m = &world[my][mx];
-    FILE *f = fopen(path, "rb");
-    if (!f) {
+// Tiles come from the map pack when world_init found one with a valid entry for this map, else
+// from the text file
+static void load_map_file(MapState *m, int mx, int my, const MapPack *pk) {
+    const unsigned char *packed = NULL;
+    int sx = MAPPACK_NO_SPAWN, sy = MAPPACK_NO_SPAWN;
+    int got = pk->base ? mappack_map(pk, mx, my, &packed, &sx, &sy) : -1;
+    FILE *f = NULL;
+    if (got < 0) {
+        char path[256];
+        snprintf(path, sizeof(path), "maps/x%d-y%d.txt", mx, my);
+        f = fopen(path, "rb");
+    }
+    if (packed) {
         for (int y = 0; y < MAP_HEIGHT; ++y) {
-            for (int x = 0; x < MAP_WIDTH; ++x) m->tiles[y][x] = (y == 0 || y == MAP_HEIGHT - 1 || x == 0 || x == MAP_WIDTH - 1) ? '#' : '.';
+            for (int x = 0; x < MAP_WIDTH; ++x) {
+                char c = (char)packed[y * MAP_WIDTH + x];
+                m->tiles[y][x] = c == 'M' ? '.' : c; // bushes come from the server only
+            }
+            m->tiles[y][MAP_WIDTH] = '\0';
+        }
+    } else if (!f) {
+        // Nobody wrote this map: generate it (see mapgen.h), doors open towards the whole world
+        unsigned doors = (mx > 0 ? MAPGEN_DOOR_W : 0) | (mx < worldW - 1 ? MAPGEN_DOOR_E : 0) |
+                         (my > 0 ? MAPGEN_DOOR_N : 0) | (my < worldH - 1 ? MAPGEN_DOOR_S : 0);
+        mapgen_fill(&m->tiles[0][0], MAP_WIDTH + 1, MAP_WIDTH, MAP_HEIGHT, worldSeed, mx, my, doors);
+        for (int y = 0; y < MAP_HEIGHT; ++y) {
+            for (int x = 0; x < MAP_WIDTH; ++x) if (m->tiles[y][x] == 'M') m->tiles[y][x] = '.'; // bushes come from the server only
             m->tiles[y][MAP_WIDTH] = '\0';
         }
     } else {
@@ -87,13 +119,13 @@ static void load_map_file(int mx, int my) {
     int midY = MAP_HEIGHT / 2;
     if (mx > 0) curMap = curMap; // no-op to silence unused warnings in some compilers
     if (mx > 0) m->tiles[midY][0] = '.';
-    if (mx < WORLD_W - 1) m->tiles[midY][MAP_WIDTH - 1] = '.';
+    if (mx < worldW - 1) m->tiles[midY][MAP_WIDTH - 1] = '.';
     if (my > 0) m->tiles[0][midX] = '.';
-    if (my < WORLD_H - 1) m->tiles[MAP_HEIGHT - 1][midX] = '.';
+    if (my < worldH - 1) m->tiles[MAP_HEIGHT - 1][midX] = '.';
     // Ensure a central spawn exists at world center if none provided by files
-    if (mx == WORLD_W / 2 && my == WORLD_H / 2) {
-        int hasS = 0;
-        for (int y = 0; y < MAP_HEIGHT && !hasS; ++y) {
+    if (mx == worldW / 2 && my == worldH / 2) {
+        int hasS = packed && sx != MAPPACK_NO_SPAWN;
+        for (int y = 0; y < MAP_HEIGHT && !hasS && !packed; ++y) {
             for (int x = 0; x < MAP_WIDTH && !hasS; ++x) {
                 if (m->tiles[y][x] == 'S') hasS = 1;
             }
@@ -102,26 +134,84 @@ static void load_map_file(int mx, int my) {
     }
     m->numEnemies = 0;
     m->initialized = 0;
+    rng_seed_map(&m->rng, worldSeed, mx, my);
+}
+
+// Map (mx,my), loaded on first use. NULL outside the world; voidMap (never kept) if out of memory.
+static MapState *world_map(int mx, int my) {
+    if (mx < 0 || mx >= worldW || my < 0 || my >= worldH) return NULL;
+    MapState **slot = &world[my * worldW + mx];
+    if (!*slot) {
+        MapState *m = (MapState*)calloc(1, sizeof(MapState));
+        if (!m) return &voidMap;
+        load_map_file(m, mx, my, &worldPack);
+        *slot = m;
+    }
+    return *slot;
+}
+
+static void world_free(void) {
+    for (int k = 0; world && k < worldW * worldH; ++k) free(world[k]);
+    free(world);
+    world = NULL;
+    worldW = worldH = 0;
+    haveSpawn = 0;
+}
+
+// Empty storage for a world of w x h maps, with the current map reloaded from it. Without memory
+// for it the world is a single map.
+static void world_alloc(int w, int h) {
+    world = (MapState**)calloc((size_t)w * (size_t)h, sizeof(MapState*));
+    if (!world) { w = h = 1; world = (MapState**)calloc(1, sizeof(MapState*)); }
+    worldW = world ? w : 0; worldH = world ? h : 0;
+    curWorldX = clamp(curWorldX, 0, worldW - 1); curWorldY = clamp(curWorldY, 0, worldH - 1);
+    curMap = world_map(curWorldX, curWorldY);
+    if (!curMap) curMap = &voidMap;
+}
+
+// The first 'S' in row-major map order. Pack entries recording no spawn, and maps the pack lacks
+// (they are generated, without one), are skipped without loading them; other maps and the world
+// center, which loading gives an 'S', are loaded to look. Tiles never turn into 'S', so this holds
+// for the whole game.
+static void world_find_spawn(void) {
+    haveSpawn = 0;
+    for (int k = 0; k < worldW * worldH && !haveSpawn; ++k) {
+        int mx = k % worldW, my = k / worldW, sx, sy;
+        if (worldPack.base && mappack_spawn(&worldPack, mx, my, &sx, &sy) <= 0 && (mx != worldW / 2 || my != worldH / 2)) continue;
+        MapState *m = world_map(mx, my);
+        for (int y = 0; y < MAP_HEIGHT && !haveSpawn; ++y) {
+            for (int x = 0; x < MAP_WIDTH && !haveSpawn; ++x) {
+                if (m->tiles[y][x] == 'S') { spawnMX = mx; spawnMY = my; spawnX = x; spawnY = y; haveSpawn = 1; }
+            }
+        }
+    }
 }
 
 static void world_init(void) {
-    for (int y = 0; y < WORLD_H; ++y) for (int x = 0; x < WORLD_W; ++x) load_map_file(x, y);
-    curWorldX = 0; curWorldY = 0; curMap = &world[curWorldY][curWorldX];
+    worldSeed = ((uint64_t)(unsigned)rand() << 32) ^ (uint64_t)(unsigned)rand();
+    world_free();
+    mappack_close(&worldPack);
+    int w = 0, h = 0;
+    if (mappack_open(&worldPack, MAPPACK_FILE, MAP_WIDTH, MAP_HEIGHT) > 0) {
+        w = mappack_header(&worldPack)->worldW; h = mappack_header(&worldPack)->worldH;
+        if (w > WORLD_MAX || h > WORLD_MAX) { mappack_close(&worldPack); w = h = 0; }
+    }
+    if (w == 0) {
+        char path[64];
+        FILE *f;
+        while (w < WORLD_MAX && (snprintf(path, sizeof(path), "maps/x%d-y0.txt", w), f = fopen(path, "rb")) != NULL) { fclose(f); w++; }
+        while (h < WORLD_MAX && (snprintf(path, sizeof(path), "maps/x0-y%d.txt", h), f = fopen(path, "rb")) != NULL) { fclose(f); h++; }
+        if (w == 0) w = h = WORLD_DEFAULT_DIM;
+    }
+    for (int y = 0; y < MAP_HEIGHT; ++y) { memset(voidMap.tiles[y], '#', MAP_WIDTH); voidMap.tiles[y][MAP_WIDTH] = '\0'; }
+    voidMap.initialized = 1;
+    curWorldX = 0; curWorldY = 0;
+    world_alloc(w, h);
     // In singleplayer, prefer global 'S' across all maps; fallback to '@' in current map.
     // In multiplayer, server is authoritative for our spawn.
     if (!g_mp_active) {
-        int found = 0; int smx = 0, smy = 0, sx = 1, sy = 1;
-        for (int wy = 0; wy < WORLD_H && !found; ++wy) {
-            for (int wx = 0; wx < WORLD_W && !found; ++wx) {
-                MapState *m = &world[wy][wx];
-                for (int y = 0; y < MAP_HEIGHT && !found; ++y) {
-                    for (int x = 0; x < MAP_WIDTH && !found; ++x) {
-                        if (m->tiles[y][x] == 'S') { smx = wx; smy = wy; sx = x; sy = y; found = 1; }
-                    }
-                }
-            }
-        }
-        if (found) { curWorldX = smx; curWorldY = smy; curMap = &world[curWorldY][curWorldX]; playerPos.x = sx; playerPos.y = sy; }
+        world_find_spawn();
+        if (haveSpawn) { curWorldX = spawnMX; curWorldY = spawnMY; curMap = world_map(curWorldX, curWorldY); playerPos.x = spawnX; playerPos.y = spawnY; }
         else {
             int foundAt = 0;
             for (int y = 0; y < MAP_HEIGHT && !foundAt; ++y) for (int x = 0; x < MAP_WIDTH && !foundAt; ++x) if (curMap->tiles[y][x] == '@') { playerPos.x = x; playerPos.y = y; curMap->tiles[y][x] = '.'; foundAt = 1; }
@@ -167,8 +257,8 @@ void game_spawn_enemies(int count) {
         curMap->enemies[i].isAlive = 1;
         curMap->enemies[i].hp = 2;
         for (int attempt = 0; attempt < 1000; ++attempt) {
-            int x = rand() % MAP_WIDTH;
-            int y = rand() % MAP_HEIGHT;
+            int x = (int)rng_below(&curMap->rng, MAP_WIDTH);
+            int y = (int)rng_below(&curMap->rng, MAP_HEIGHT);
             if (game_is_blocked(x, y)) continue;
             if ((x == playerPos.x && y == playerPos.y)) continue;
             if (abs(x - playerPos.x) + abs(y - playerPos.y) < 6) continue;
@@ -192,7 +282,7 @@ int game_move_enemies(void) {
     int moved = 0;
     for (int i = 0; i < curMap->numEnemies; ++i) {
         if (!curMap->enemies[i].isAlive) continue;
-        int dir = rand() % 4;
+        int dir = (int)rng_below(&curMap->rng, 4);
         int dx = 0, dy = 0;
         switch (dir) { case 0: dy = -1; break; case 1: dy = 1; break; case 2: dx = -1; break; case 3: dx = 1; break; }
         int nx = clamp(curMap->enemies[i].pos.x + dx, 0, MAP_WIDTH - 1);
@@ -214,8 +304,8 @@ int game_move_enemies(void) {
 }
 
 static int try_enter_map(int newWorldX, int newWorldY, int targetX, int targetY) {
-    if (newWorldX < 0 || newWorldX >= WORLD_W || newWorldY < 0 || newWorldY >= WORLD_H) return 0;
-    MapState *next = &world[newWorldY][newWorldX];
+    MapState *next = world_map(newWorldX, newWorldY);
+    if (!next || next == &voidMap) return 0;
     int tx = clamp(targetX, 0, MAP_WIDTH - 1);
     int ty = clamp(targetY, 0, MAP_HEIGHT - 1);
     // Only allow transition if the exact entry cell in the next map is open
@@ -260,18 +350,8 @@ void game_check_win_lose(void) {
         if (game_player_lives > 0) game_player_lives--;
         if (game_player_lives <= 0) {
             // Respawn at nearest/global spawn 'S', reset HP and score
-            int found = 0; int sx = 1, sy = 1; int smx = curWorldX, smy = curWorldY;
-            for (int my = 0; my < WORLD_H && !found; ++my) {
-                for (int mx = 0; mx < WORLD_W && !found; ++mx) {
-                    for (int yy = 0; yy < MAP_HEIGHT && !found; ++yy) {
-                        for (int xx = 0; xx < MAP_WIDTH && !found; ++xx) {
-                            if (world[my][mx].tiles[yy][xx] == 'S') { smx = mx; smy = my; sx = xx; sy = yy; found = 1; }
-                        }
-                    }
-                }
-            }
-            curWorldX = smx; curWorldY = smy; curMap = &world[curWorldY][curWorldX];
-            playerPos.x = sx; playerPos.y = sy;
+            if (haveSpawn) { curWorldX = spawnMX; curWorldY = spawnMY; curMap = world_map(curWorldX, curWorldY); }
+            playerPos.x = haveSpawn ? spawnX : 1; playerPos.y = haveSpawn ? spawnY : 1;
             game_player_lives = 3;
             game_score = 0;
             for (int i = 0; i < MAX_PROJECTILES; ++i) projectiles[i].active = 0;
@@ -296,9 +376,9 @@ static int is_wall(int x, int y) {
     return curMap->tiles[y][x] == '#';
 }
 int game_mp_is_open_world(int wx, int wy, int x, int y) {
-    if (wx < 0 || wx >= WORLD_W || wy < 0 || wy >= WORLD_H) return 0;
     if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) return 0;
-    return world[wy][wx].tiles[y][x] != '#';
+    MapState *m = world_map(wx, wy);
+    return m && m->tiles[y][x] != '#';
 }
 
 static void damage_wall(int x, int y) {
@@ -406,7 +486,7 @@ void game_mp_tick_predicted(void) {
         int ny = predictedBullets[i].pos.y + predictedBullets[i].dy;
         // Clamp within map; do not cross walls; remove if blocked
         if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT) { predictedBullets[i].active = 0; continue; }
-        if (world[predictedBullets[i].wy][predictedBullets[i].wx].tiles[ny][nx] == '#') { predictedBullets[i].active = 0; continue; }
+        if (!game_mp_is_open_world(predictedBullets[i].wx, predictedBullets[i].wy, nx, ny)) { predictedBullets[i].active = 0; continue; }
         predictedBullets[i].lastPos = predictedBullets[i].pos;
         predictedBullets[i].pos.x = nx; predictedBullets[i].pos.y = ny;
         predictedBullets[i].lastTick = game_tick_count;
@@ -535,10 +615,10 @@ void game_draw(void) {
                         int isEdge = (x == 0 || x == MAP_WIDTH - 1 || y == 0 || y == MAP_HEIGHT - 1);
                         if (isEdge) {
                             char neighborChar = '.';
-                            if (x == 0 && curWorldX > 0) neighborChar = world[curWorldY][curWorldX-1].tiles[y][MAP_WIDTH-1];
-                            else if (x == MAP_WIDTH - 1 && curWorldX < WORLD_W - 1) neighborChar = world[curWorldY][curWorldX+1].tiles[y][0];
-                            else if (y == 0 && curWorldY > 0) neighborChar = world[curWorldY-1][curWorldX].tiles[MAP_HEIGHT-1][x];
-                            else if (y == MAP_HEIGHT - 1 && curWorldY < WORLD_H - 1) neighborChar = world[curWorldY+1][curWorldX].tiles[0][x];
+                            if (x == 0 && curWorldX > 0) neighborChar = world_map(curWorldX-1, curWorldY)->tiles[y][MAP_WIDTH-1];
+                            else if (x == MAP_WIDTH - 1 && curWorldX < worldW - 1) neighborChar = world_map(curWorldX+1, curWorldY)->tiles[y][0];
+                            else if (y == 0 && curWorldY > 0) neighborChar = world_map(curWorldX, curWorldY-1)->tiles[MAP_HEIGHT-1][x];
+                            else if (y == MAP_HEIGHT - 1 && curWorldY < worldH - 1) neighborChar = world_map(curWorldX, curWorldY+1)->tiles[0][x];
                             out = '.';
                             color = (neighborChar == '#') ? TERM_FG_BRIGHT_WHITE : TERM_FG_BRIGHT_BLACK;
                         } else { out = '.'; color = TERM_FG_BRIGHT_BLACK; }
@@ -635,8 +715,11 @@ void game_draw(void) {
     int gap = 4;
     int rightCol = leftCol + cols * cellW + gap; // place minimap to the right of the scoreboard
 
-    int needCols = rightCol + WORLD_W; // rough width including minimap
-    int needRows = baseRow + 1 + (rows > WORLD_H ? rows : WORLD_H) + 2; // up to hints
+    // Minimap window: up to MINIMAP_DIM maps per side, kept around the current map
+    int miniW = worldW < MINIMAP_DIM ? worldW : MINIMAP_DIM, miniH = worldH < MINIMAP_DIM ? worldH : MINIMAP_DIM;
+    int miniX0 = clamp(curWorldX - miniW / 2, 0, worldW - miniW), miniY0 = clamp(curWorldY - miniH / 2, 0, worldH - miniH);
+    int needCols = rightCol + miniW; // rough width including minimap
+    int needRows = baseRow + 1 + (rows > miniH ? rows : miniH) + 2; // up to hints
     int showMinimap = (termCols >= needCols);
     int showScoreboard = 1;
     if (!showMinimap) {
@@ -683,13 +766,13 @@ void game_draw(void) {
         }
     }
 
-    // Render a 9x9 grid of '.' with current map marked 'X' and players '@' (side-by-side on the same rows)
+    // Render the minimap window as '.' with current map marked 'X' and players '@' (side-by-side on the same rows)
     int miniRow = baseRow + 1; // align top rows of both sections
     if (showMinimap) {
-    for (int my = 0; my < WORLD_H; ++my) {
+    for (int my = miniY0; my < miniY0 + miniH; ++my) {
         // Position cursor at the start of this minimap row
-        APPEND_FMT("\x1b[%d;%dH\x1b[K", miniRow + my, rightCol);
-        for (int mx = 0; mx < WORLD_W; ++mx) {
+        APPEND_FMT("\x1b[%d;%dH\x1b[K", miniRow + my - miniY0, rightCol);
+        for (int mx = miniX0; mx < miniX0 + miniW; ++mx) {
             char ch = '.';
             const char *pcolor = TERM_FG_BRIGHT_BLACK;
             int isCurrentMap = (mx == curWorldX && my == curWorldY);
@@ -720,7 +803,7 @@ void game_draw(void) {
     }
 
     // Hints below both sections
-    int hintsRow = showMinimap ? (miniRow + WORLD_H + 1) : (baseRow + rows + 1);
+    int hintsRow = showMinimap ? (miniRow + miniH + 1) : (baseRow + rows + 1);
     APPEND_FMT("\x1b[%d;%dH\x1b[KUse WASD/Arrows to move, Space to shoot.\r\n", hintsRow, 1);
     if (!g_mp_active) {
         APPEND_FMT("\x1b[KFind purple W to win. Press Q to quit.\r\n");
@@ -829,23 +912,31 @@ void game_draw_loading(int tick) {
 
 // --- MP helpers ---
 void game_mp_set_tile(int wx, int wy, int x, int y, char tile) {
-    if (wx < 0 || wx >= WORLD_W || wy < 0 || wy >= WORLD_H) return;
     if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) return;
-    world[wy][wx].tiles[y][x] = tile;
+    MapState *m = world_map(wx, wy);
+    if (!m || m == &voidMap) return;
+    m->tiles[y][x] = tile;
     if (wx == curWorldX && wy == curWorldY) {
         // ensure curMap points to updated map
-        curMap = &world[curWorldY][curWorldX];
+        curMap = m;
     }
 }
 
+void game_mp_set_world(int w, int h) {
+    if (w < 1 || h < 1 || w > WORLD_MAX || h > WORLD_MAX || (w == worldW && h == worldH)) return;
+    world_free();
+    world_alloc(w, h);
+}
+
 int game_mp_get_cur_world_x(void) { return curWorldX; }
 int game_mp_get_cur_world_y(void) { return curWorldY; }
 
 void game_mp_set_self(int wx, int wy, int x, int y) {
-    if (wx < 0 || wx >= WORLD_W || wy < 0 || wy >= WORLD_H) return;
+    MapState *m = world_map(wx, wy);
+    if (!m) return;
     curWorldX = wx;
     curWorldY = wy;
-    curMap = &world[curWorldY][curWorldX];
+    curMap = m;
     playerPos.x = x;
     playerPos.y = y;
 }
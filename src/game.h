@@ -26,6 +26,8 @@ int game_tick_status(void);
 
 // MP helpers (client-side): apply authoritative world changes from server
 void game_mp_set_tile(int wx, int wy, int x, int y, char tile);
+// World size from the server's WORLD line; maps held for another size are dropped
+void game_mp_set_world(int w, int h);
 int game_mp_get_cur_world_x(void);
 int game_mp_get_cur_world_y(void);
 // In MP, server is authoritative for our own position/world
@@ -0,0 +1,350 @@
+// WebSocket gateway: terminates browser WebSocket connections and speaks the plain TCP protocol to
+// the game server, one local connection per browser, all served from one poll loop. Handshakes,
+// unmasking and framing happen here instead of on the server's main thread, which only sees
+// ordinary TCP clients. The server's own WebSocket port stays for setups without a gateway.
+// Browsers are not multiplexed onto a shared server connection: that would need a mux protocol
+// and per-browser state in the server, while a loopback TCP connection per browser costs the
+// server no more than any native client. Connecting to the server never blocks the loop: its
+// address is resolved once at startup and each connect completes in the background.
+//
+// Usage: gateway [--server host:port] [ws port]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET sock_t;
+#define poll WSAPoll // Vista+ (_WIN32_WINNT >= 0x0600)
+#define sock_close closesocket
+#define sock_would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+typedef int sock_t;
+#define sock_close close
+#define sock_would_block() (errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+
+#include "../ws.h"
+
+#define GW_FRAME_MAX 4096 // largest client frame accepted (clients send short command lines)
+#define GW_IN_MAX 8192 // upgrade request, then client frames not yet complete
+#define GW_UP_BUF 65536 // server bytes read at once, plus a partial line
+#define GW_BACKLOG_MAX (1024 * 1024) // unsent bytes either way after which a connection is dropped
+
+// Bytes waiting for a non-blocking send
+typedef struct {
+    char *data;
+    int off, len, cap;
+} Queue;
+
+// One browser and its connection to the server
+typedef struct {
+    sock_t ws;
+    sock_t up; // -1 until the upgrade request is complete
+    int connecting; // up is still connecting; the 101 waits in resp until it does
+    char resp[256];
+    int respLen;
+    int closing; // the server hung up or the browser sent close: flush toWs, then drop
+    int dead; // drop after the current pass
+    uint8_t in[GW_IN_MAX];
+    int inLen;
+    char *upIn; // GW_UP_BUF of server bytes, cut at the last complete line
+    int upInLen;
+    Queue toWs, toUp;
+    char addr[64];
+} Conn;
+
+static Conn **g_conns;
+static int g_numConns = 0, g_connCap = 0;
+static char g_host[256] = "127.0.0.1";
+static char g_port[16] = "5555";
+static struct sockaddr_storage g_upAddr; // the server, resolved at startup
+static socklen_t g_upAddrLen;
+
+static void sock_set_nonblocking(sock_t s) {
+#ifdef _WIN32
+    u_long mode = 1; ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0); if (flags >= 0) fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+// Returns 0 once more than GW_BACKLOG_MAX would be waiting (or out of memory)
+static int queue_push(Queue *q, const void *data, int len) {
+    if (len <= 0) return 1;
+    if (q->len - q->off + len > GW_BACKLOG_MAX) return 0;
+    if (q->off > 0 && q->len + len > q->cap) { // reclaim what was already sent
+        memmove(q->data, q->data + q->off, (size_t)(q->len - q->off));
+        q->len -= q->off;
+        q->off = 0;
+    }
+    if (q->len + len > q->cap) {
+        int ncap = q->cap ? q->cap : 4096;
+        while (ncap < q->len + len) ncap *= 2;
+        char *nd = (char*)realloc(q->data, (size_t)ncap);
+        if (!nd) return 0;
+        q->data = nd; q->cap = ncap;
+    }
+    memcpy(q->data + q->len, data, (size_t)len);
+    q->len += len;
+    return 1;
+}
+
+// Send what the socket takes. Returns 0 on a send error.
+static int queue_flush(sock_t s, Queue *q) {
+    while (q->off < q->len) {
+        int n = (int)send(s, q->data + q->off, q->len - q->off, 0);
+        if (n < 0) return sock_would_block();
+        q->off += n;
+    }
+    q->off = q->len = 0;
+    return 1;
+}
+
+// Frame for the browser: text (0x1), close (0x8) or pong (0xA)
+static void conn_send_frame(Conn *c, int opcode, const char *data, int len) {
+    uint8_t hdr[10];
+    int hlen = ws_frame_header(hdr, len);
+    hdr[0] = (uint8_t)(0x80 | opcode);
+    if (!queue_push(&c->toWs, hdr, hlen) || !queue_push(&c->toWs, data, len)) c->dead = 1;
+}
+
+// The connection to the server is up (ok) or failed: answer the upgrade either way, then relay
+// or close
+static void conn_up_ready(Conn *c, int ok) {
+    c->connecting = 0;
+    c->upIn = ok ? (char*)malloc(GW_UP_BUF) : NULL;
+    queue_push(&c->toWs, c->resp, c->respLen);
+    if (!c->upIn) {
+        printf("[gw] %s: server %s:%s unreachable\n", c->addr, g_host, g_port);
+        fflush(stdout);
+        if (c->up != (sock_t)-1) sock_close(c->up);
+        c->up = (sock_t)-1;
+        conn_send_frame(c, 0x8, "\x03\xf3", 2); // 1011: internal error
+        c->closing = 1;
+        return;
+    }
+    int one = 1; setsockopt(c->up, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    printf("[gw] %s connected\n", c->addr);
+    fflush(stdout);
+}
+
+// Upgrade request complete: start this browser's connection to the server. The 101 is sent once
+// it is up (conn_up_ready), so the browser sends nothing before there is somewhere to put it.
+static void conn_upgrade(Conn *c, const char *resp, int rlen) {
+    memcpy(c->resp, resp, (size_t)rlen);
+    c->respLen = rlen;
+    c->up = (sock_t)socket(g_upAddr.ss_family, SOCK_STREAM, 0);
+    if (c->up == (sock_t)-1) { conn_up_ready(c, 0); return; }
+    sock_set_nonblocking(c->up);
+    if (connect(c->up, (const struct sockaddr*)&g_upAddr, (int)g_upAddrLen) == 0) { conn_up_ready(c, 1); return; }
+#ifdef _WIN32
+    int pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    int pending = errno == EINPROGRESS;
+#endif
+    if (!pending) { conn_up_ready(c, 0); return; }
+    c->connecting = 1;
+}
+
+// The server socket of a connecting browser polled writable or failed: see how the connect ended
+static void conn_connect_done(Conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->up, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) err = 1;
+    conn_up_ready(c, err == 0);
+}
+
+// Browser bytes: the upgrade request, then frames. Text payloads go to the server as lines.
+// Returns 0 once the browser is gone or broke the protocol.
+static int conn_read_ws(Conn *c) {
+    int n = (int)recv(c->ws, (char*)c->in + c->inLen, GW_IN_MAX - 1 - c->inLen, 0);
+    if (n == 0 || (n < 0 && !sock_would_block())) return 0;
+    if (n < 0) return 1;
+    c->inLen += n;
+    if (c->up == (sock_t)-1) {
+        if (c->closing) { c->inLen = 0; return 1; }
+        c->in[c->inLen] = '\0';
+        char resp[256];
+        int rn = ws_handshake_reply((const char*)c->in, resp, sizeof(resp));
+        if (rn < 0 || (rn == 0 && c->inLen >= GW_IN_MAX - 1)) return 0;
+        if (rn == 0) return 1;
+        c->inLen = 0; // browsers wait for the 101 before sending frames
+        conn_upgrade(c, resp, rn);
+        return 1;
+    }
+    int used = 0;
+    for (;;) {
+        int opcode, off, plen;
+        int k = ws_parse_frame(c->in + used, c->inLen - used, GW_FRAME_MAX, &opcode, &off, &plen);
+        if (k < 0) return 0;
+        if (k == 0) break;
+        int fin = c->in[used] & 0x80;
+        const char *payload = (const char*)c->in + used + off;
+        if (opcode == 0x0 || opcode == 0x1) {
+            int ok = queue_push(&c->toUp, payload, plen);
+            // The server reads lines; a message without its newline still ends one
+            if (ok && fin && (plen == 0 || payload[plen - 1] != '\n')) ok = queue_push(&c->toUp, "\n", 1);
+            if (!ok) return 0;
+        } else if (opcode == 0x8) {
+            conn_send_frame(c, 0x8, payload, plen < 2 ? plen : 2);
+            c->closing = 1;
+        } else if (opcode == 0x9) {
+            conn_send_frame(c, 0xA, payload, plen);
+        }
+        used += k;
+    }
+    c->inLen -= used;
+    memmove(c->in, c->in + used, (size_t)c->inLen);
+    return 1;
+}
+
+// Server bytes: complete lines go to the browser, one text frame per tick like the server's own
+// WebSocket port sends them (see ws_message_span). Returns 0 once the server hung up.
+static int conn_read_up(Conn *c) {
+    int n = (int)recv(c->up, c->upIn + c->upInLen, GW_UP_BUF - c->upInLen, 0);
+    if (n == 0 || (n < 0 && !sock_would_block())) return 0;
+    if (n < 0) return 1;
+    c->upInLen += n;
+    int end = c->upInLen;
+    while (end > 0 && c->upIn[end - 1] != '\n') end--;
+    if (end == 0 && c->upInLen == GW_UP_BUF) { c->dead = 1; return 1; } // no line is that long
+    for (int from = 0, m; from < end; from += m) {
+        m = ws_message_span(c->upIn + from, end - from);
+        conn_send_frame(c, 0x1, c->upIn + from, m);
+    }
+    c->upInLen -= end;
+    memmove(c->upIn, c->upIn + end, (size_t)c->upInLen);
+    return 1;
+}
+
+static void conn_add(sock_t s, const struct sockaddr_storage *sa, socklen_t salen) {
+    if (g_numConns == g_connCap) {
+        int ncap = g_connCap ? g_connCap * 2 : 64;
+        Conn **nc = (Conn**)realloc(g_conns, (size_t)ncap * sizeof(Conn*));
+        if (!nc) { sock_close(s); return; }
+        g_conns = nc; g_connCap = ncap;
+    }
+    Conn *c = (Conn*)calloc(1, sizeof(Conn));
+    if (!c) { sock_close(s); return; }
+    sock_set_nonblocking(s);
+    int one = 1; setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    c->ws = s;
+    c->up = (sock_t)-1;
+    char host[48] = "?", serv[16] = "?";
+    getnameinfo((const struct sockaddr*)sa, salen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+    snprintf(c->addr, sizeof(c->addr), "%s:%s", host, serv);
+    g_conns[g_numConns++] = c;
+}
+
+static void conn_remove(int k) {
+    Conn *c = g_conns[k];
+    if (c->up != (sock_t)-1 && !c->connecting) {
+        printf("[gw] %s disconnected\n", c->addr);
+        fflush(stdout);
+    }
+    if (c->up != (sock_t)-1) sock_close(c->up);
+    sock_close(c->ws);
+    free(c->upIn);
+    free(c->toWs.data);
+    free(c->toUp.data);
+    free(c);
+    g_conns[k] = g_conns[--g_numConns];
+}
+
+int main(int argc, char **argv) {
+#ifdef _WIN32
+    WSADATA wsa; WSAStartup(MAKEWORD(2,2), &wsa);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    // Positional: [ws port]; options may appear anywhere
+    const char *wsport = "5557";
+    for (int a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--server") == 0 && a + 1 < argc) {
+            const char *hp = argv[++a], *colon = strrchr(hp, ':');
+            if (colon) {
+                snprintf(g_host, sizeof(g_host), "%.*s", (int)(colon - hp), hp);
+                snprintf(g_port, sizeof(g_port), "%s", colon + 1);
+            } else {
+                snprintf(g_host, sizeof(g_host), "%s", hp);
+            }
+        }
+        else wsport = argv[a];
+    }
+    struct addrinfo hints; memset(&hints, 0, sizeof(hints)); hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM; hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *res = NULL; if (getaddrinfo(NULL, wsport, &hints, &res) != 0) { fprintf(stderr, "getaddrinfo failed\n"); return 1; }
+    sock_t lsock = (sock_t)socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int yes = 1; setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    if (bind(lsock, res->ai_addr, (int)res->ai_addrlen) != 0) { fprintf(stderr, "bind failed\n"); return 1; }
+    if (listen(lsock, SOMAXCONN) != 0) { fprintf(stderr, "listen failed\n"); return 1; }
+    freeaddrinfo(res);
+    // Resolved once: a lookup per browser would stall every other browser while it runs
+    hints.ai_family = AF_UNSPEC; hints.ai_flags = 0;
+    if (getaddrinfo(g_host, g_port, &hints, &res) != 0 || res->ai_addrlen > sizeof(g_upAddr)) { fprintf(stderr, "cannot resolve %s:%s\n", g_host, g_port); return 1; }
+    memcpy(&g_upAddr, res->ai_addr, res->ai_addrlen);
+    g_upAddrLen = (socklen_t)res->ai_addrlen;
+    freeaddrinfo(res);
+    printf("[gw] WebSocket on %s, server at %s:%s\n", wsport, g_host, g_port);
+    fflush(stdout);
+
+    struct pollfd *pfds = NULL;
+    int pfdCap = 0;
+    for (;;) {
+        // pfds: [0] listener, then the browser and server socket of each connection
+        if (1 + 2 * g_numConns > pfdCap) {
+            int ncap = pfdCap ? pfdCap * 2 : 128;
+            while (ncap < 1 + 2 * g_numConns) ncap *= 2;
+            struct pollfd *np = (struct pollfd*)realloc(pfds, (size_t)ncap * sizeof(struct pollfd));
+            if (!np) { fprintf(stderr, "out of memory\n"); return 1; }
+            pfds = np; pfdCap = ncap;
+        }
+        pfds[0].fd = lsock; pfds[0].events = POLLIN; pfds[0].revents = 0;
+        for (int k = 0; k < g_numConns; ++k) {
+            Conn *c = g_conns[k];
+            struct pollfd *w = &pfds[1 + 2 * k], *u = w + 1;
+            w->fd = c->ws; w->events = (short)(POLLIN | (c->toWs.off < c->toWs.len ? POLLOUT : 0)); w->revents = 0;
+            u->fd = c->closing ? (sock_t)-1 : c->up; u->revents = 0;
+            u->events = c->connecting ? POLLOUT : (short)(POLLIN | (c->toUp.off < c->toUp.len ? POLLOUT : 0));
+        }
+        int polled = g_numConns;
+        poll(pfds, 1 + 2 * polled, 1000);
+
+        if (pfds[0].revents & POLLIN) {
+            struct sockaddr_storage sa; socklen_t salen = sizeof(sa);
+            sock_t cs = accept(lsock, (struct sockaddr*)&sa, &salen);
+            if (cs != (sock_t)-1) conn_add(cs, &sa, salen);
+        }
+        for (int k = 0; k < polled; ++k) {
+            Conn *c = g_conns[k];
+            if ((pfds[1 + 2 * k].revents & (POLLIN | POLLHUP | POLLERR)) && !conn_read_ws(c)) c->dead = 1;
+            if (c->connecting) {
+                // Polled before the upgrade started this connect, so revents says nothing yet
+                if (!c->dead && pfds[2 + 2 * k].fd == c->up && (pfds[2 + 2 * k].revents & (POLLOUT | POLLHUP | POLLERR))) conn_connect_done(c);
+                continue;
+            }
+            if (!c->dead && (pfds[2 + 2 * k].revents & (POLLIN | POLLHUP | POLLERR)) && !conn_read_up(c)) {
+                conn_send_frame(c, 0x8, "\x03\xe9", 2); // 1001: going away
+                c->closing = 1;
+            }
+        }
+        for (int k = g_numConns - 1; k >= 0; --k) {
+            Conn *c = g_conns[k];
+            if (!c->dead && c->up != (sock_t)-1 && !c->connecting && !c->closing && !queue_flush(c->up, &c->toUp)) c->dead = 1;
+            if (!c->dead && !queue_flush(c->ws, &c->toWs)) c->dead = 1;
+            if (c->closing && c->toWs.off == c->toWs.len) c->dead = 1;
+            if (c->dead) conn_remove(k);
+        }
+    }
+}
@@ -34,32 +34,6 @@ static int g_predDx = 0, g_predDy = 0;
 static double g_predExpireMs = 0.0;
 static double g_lastPredStepMs = 0.0;
 
-static void try_predict_step(int dx, int dy) {
-    int wx = game_mp_get_cur_world_x();
-    int wy = game_mp_get_cur_world_y();
-    extern RemotePlayer g_remote_players[]; extern int g_my_player_id; extern int game_tick_count;
-    if (g_my_player_id < 0 || !g_remote_players[g_my_player_id].active) return;
-    int x = g_remote_players[g_my_player_id].pos.x + dx;
-    int y = g_remote_players[g_my_player_id].pos.y + dy;
-    int nwx = wx, nwy = wy, nx = x, ny = y;
-    if (dx < 0 && x < 0) { nwx = wx - 1; nx = MAP_WIDTH - 1; }
-    if (dx > 0 && x >= MAP_WIDTH) { nwx = wx + 1; nx = 0; }
-    if (dy < 0 && y < 0) { nwy = wy - 1; ny = MAP_HEIGHT - 1; }
-    if (dy > 0 && y >= MAP_HEIGHT) { nwy = wy + 1; ny = 0; }
-    if (!game_mp_is_open_world(nwx, nwy, nx, ny)) return;
-    int occupied = 0; for (int i = 0; i < MAX_REMOTE_PLAYERS; ++i) { if (i == g_my_player_id) continue; if (!g_remote_players[i].active) continue; if (g_remote_players[i].worldX == nwx && g_remote_players[i].worldY == nwy && g_remote_players[i].pos.x == nx && g_remote_players[i].pos.y == ny) { occupied = 1; break; } }
-    if (occupied) return;
-    g_remote_players[g_my_player_id].lastWorldX = g_remote_players[g_my_player_id].worldX;
-    g_remote_players[g_my_player_id].lastWorldY = g_remote_players[g_my_player_id].worldY;
-    g_remote_players[g_my_player_id].lastPos = g_remote_players[g_my_player_id].pos;
-    g_remote_players[g_my_player_id].worldX = nwx;
-    g_remote_players[g_my_player_id].worldY = nwy;
-    g_remote_players[g_my_player_id].pos.x = nx;
-    g_remote_players[g_my_player_id].pos.y = ny;
-    g_remote_players[g_my_player_id].lastUpdateTick = game_tick_count;
-    needsRedraw = 1;
-}
-
 static void handleInput(void) {
     // Drain all inputs available this frame and combine into a single intent (supports diagonals)
     int dx = 0, dy = 0; int shoot = 0; int build = 0; int gotAny = 0;
@@ -135,7 +109,7 @@ int main(void) {
     }
     if (mode == 2) {
         term_clear_screen();
-        printf("Enter server host[:port] (default port 5555): "); fflush(stdout);
+        printf("Enter server host[:port][/lobby] or shm:PATH (default port 5555): "); fflush(stdout);
         char addr[256] = {0};
         // crude line read: wait until user hits Enter
         int entered = 0; int c;
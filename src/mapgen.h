@@ -0,0 +1,92 @@
+#ifndef MAPGEN_H
+#define MAPGEN_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rng.h"
+
+// Procedural maps for world cells that have no text map (or pack entry): the server, the native
+// client in singleplayer and mappack --seed all build them here, so one seed gives one world
+// everywhere. A map depends only on the seed, its coordinates and which of its doors are open;
+// the caller decides the doors (open towards every generated neighbor, matched to the facing
+// tile of an authored one). Layout: solid border with the edge-center doors, wall blocks and
+// bush patches inside, straight corridors from each open door to the center, every floor tile
+// reachable from the center, sometimes one life pickup 'X'.
+
+#define MAPGEN_DOOR_W 1u // (0, h/2)
+#define MAPGEN_DOOR_E 2u // (w-1, h/2)
+#define MAPGEN_DOOR_N 4u // (w/2, 0)
+#define MAPGEN_DOOR_S 8u // (w/2, h-1)
+#define MAPGEN_MAX_W 64
+#define MAPGEN_MAX_H 32
+#define MAPGEN_SALT 0x6d617067656eULL // "mapgen": keeps layouts apart from the maps' sim streams
+
+// Tiles of map (mx,my) into rows of w chars, stride bytes apart (no terminators written). w and h
+// are at most MAPGEN_MAX_W and MAPGEN_MAX_H.
+static inline void mapgen_fill(char *tiles, int stride, int w, int h, uint64_t seed, int mx, int my, unsigned doors) {
+    if (w < 3 || h < 3 || w > MAPGEN_MAX_W || h > MAPGEN_MAX_H) return;
+#define MG_AT(x, y) tiles[(y) * stride + (x)]
+    Rng r;
+    rng_seed_map(&r, seed ^ MAPGEN_SALT, mx, my);
+    int midX = w / 2, midY = h / 2;
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x) MG_AT(x, y) = (y == 0 || y == h - 1 || x == 0 || x == w - 1) ? '#' : '.';
+
+    // Wall blocks, then bushes on the floor that is left
+    int blocks = 8 + (int)rng_below(&r, 8);
+    for (int b = 0; b < blocks; ++b) {
+        int bw = 2 + (int)rng_below(&r, 7), bh = 1 + (int)rng_below(&r, 4);
+        if (bw > w - 2) bw = w - 2;
+        if (bh > h - 2) bh = h - 2;
+        int x0 = 1 + (int)rng_below(&r, (uint32_t)(w - 1 - bw)), y0 = 1 + (int)rng_below(&r, (uint32_t)(h - 1 - bh));
+        for (int y = y0; y < y0 + bh; ++y)
+            for (int x = x0; x < x0 + bw; ++x) MG_AT(x, y) = '#';
+    }
+    int bushes = (int)rng_below(&r, 3);
+    for (int b = 0; b < bushes; ++b) {
+        int x0 = 1 + (int)rng_below(&r, (uint32_t)(w - 2)), y0 = 1 + (int)rng_below(&r, (uint32_t)(h - 2));
+        int bw = 2 + (int)rng_below(&r, 3), bh = 1 + (int)rng_below(&r, 2);
+        for (int y = y0; y < y0 + bh && y < h - 1; ++y)
+            for (int x = x0; x < x0 + bw && x < w - 1; ++x)
+                if (MG_AT(x, y) == '.') MG_AT(x, y) = 'M';
+    }
+
+    // Corridors cut through whatever they cross, so every open door reaches the center
+    if (doors & MAPGEN_DOOR_W) for (int x = 0; x <= midX; ++x) MG_AT(x, midY) = '.';
+    if (doors & MAPGEN_DOOR_E) for (int x = midX; x < w; ++x) MG_AT(x, midY) = '.';
+    if (doors & MAPGEN_DOOR_N) for (int y = 0; y <= midY; ++y) MG_AT(midX, y) = '.';
+    if (doors & MAPGEN_DOOR_S) for (int y = midY; y < h; ++y) MG_AT(midX, y) = '.';
+    MG_AT(midX, midY) = '.';
+
+    // Wall in pockets the center cannot reach
+    unsigned char seen[MAPGEN_MAX_H][MAPGEN_MAX_W];
+    int queue[MAPGEN_MAX_W * MAPGEN_MAX_H], qh = 0, qt = 0;
+    memset(seen, 0, sizeof(seen));
+    seen[midY][midX] = 1;
+    queue[qt++] = midY * w + midX;
+    while (qh < qt) {
+        int x = queue[qh] % w, y = queue[qh] / w;
+        qh++;
+        static const int dx[4] = { 1, -1, 0, 0 }, dy[4] = { 0, 0, 1, -1 };
+        for (int d = 0; d < 4; ++d) {
+            int nx = x + dx[d], ny = y + dy[d];
+            if (nx < 0 || nx >= w || ny < 0 || ny >= h || seen[ny][nx] || MG_AT(nx, ny) == '#') continue;
+            seen[ny][nx] = 1;
+            queue[qt++] = ny * w + nx;
+        }
+    }
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+            if (!seen[y][x]) MG_AT(x, y) = '#';
+
+    // One map in three holds a pickup, on a reachable floor tile other than the center or a door
+    if (rng_below(&r, 3) == 0 && qt > 1) {
+        int k = queue[1 + (int)rng_below(&r, (uint32_t)(qt - 1))];
+        int x = k % w, y = k / w;
+        if (x > 0 && x < w - 1 && y > 0 && y < h - 1 && MG_AT(x, y) == '.') MG_AT(x, y) = 'X';
+    }
+#undef MG_AT
+}
+
+#endif // MAPGEN_H
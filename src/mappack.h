@@ -0,0 +1,134 @@
+#ifndef MAPPACK_H
+#define MAPPACK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Binary map pack: maps/*.txt compiled by src/mappack/mappack.c into one file that the server
+// and the native client map at startup instead of opening and parsing every text map. The text
+// maps stay the source; without a pack, or for a map whose entry fails its check, they load as
+// before. Host byte order (a pack from another byte order fails the header check). Layout:
+//   MapPackHeader
+//   MapPackEntry[worldW * worldH], row-major by map (my * worldW + mx)
+//   tiles: mapW * mapH bytes per map that had a file, row-major, already sanitized
+// The pack carries the world size, so readers size their world from it. Opening checks only the
+// header, so it costs the same for any world size; each map's entry and checksum are checked when
+// the map is read (mappack_map).
+
+#define MAPPACK_MAGIC "DGNMAPS1" // 8 bytes, no terminator in the file
+#define MAPPACK_VERSION 1
+#define MAPPACK_FILE "maps/world.pack"
+#define MAPPACK_NO_SPAWN 0xFFFF
+#define MAPPACK_TILES "#.XW@SM" // every byte of a packed map is one of these
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint16_t worldW, worldH, mapW, mapH;
+    uint32_t size; // bytes in the whole file
+} MapPackHeader;
+
+typedef struct {
+    uint32_t offset; // tiles from the start of the file; 0 if the map had no text file
+    uint32_t checksum; // FNV-1a of the tiles
+    uint16_t spawnX, spawnY; // first 'S' in row-major order, MAPPACK_NO_SPAWN if none
+} MapPackEntry;
+
+typedef struct {
+    const unsigned char *base; // whole file, NULL when no pack is open
+    size_t size;
+    int mapped; // base came from mmap (else malloc)
+} MapPack;
+
+static inline uint32_t mappack_checksum(const unsigned char *p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static inline const MapPackHeader *mappack_header(const MapPack *pk) {
+    return (const MapPackHeader*)pk->base;
+}
+
+static inline void mappack_close(MapPack *pk) {
+    if (!pk->base) return;
+#ifndef _WIN32
+    if (pk->mapped) munmap((void*)pk->base, pk->size);
+    else
+#endif
+    free((void*)pk->base);
+    pk->base = NULL; pk->size = 0; pk->mapped = 0;
+}
+
+// Map the pack at path for maps of mapW x mapH tiles; the world size is the header's. Returns 1
+// when open, 0 if there is no such file, -1 if it is not a pack for these maps.
+static inline int mappack_open(MapPack *pk, const char *path, int mapW, int mapH) {
+    memset(pk, 0, sizeof(*pk));
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MapPackHeader)) { close(fd); return -1; }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (p == MAP_FAILED) return -1;
+    pk->base = (const unsigned char*)p; pk->size = (size_t)st.st_size; pk->mapped = 1;
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    long n = (fseek(f, 0, SEEK_END) == 0) ? ftell(f) : -1;
+    unsigned char *buf = n >= (long)sizeof(MapPackHeader) ? (unsigned char*)malloc((size_t)n) : NULL;
+    if (!buf || fseek(f, 0, SEEK_SET) != 0 || fread(buf, 1, (size_t)n, f) != (size_t)n) { free(buf); fclose(f); return -1; }
+    fclose(f);
+    pk->base = buf; pk->size = (size_t)n;
+#endif
+    const MapPackHeader *h = mappack_header(pk);
+    size_t tableEnd = sizeof(MapPackHeader) + (size_t)h->worldW * h->worldH * sizeof(MapPackEntry);
+    if (memcmp(h->magic, MAPPACK_MAGIC, 8) != 0 || h->version != MAPPACK_VERSION || h->size != pk->size ||
+        h->worldW == 0 || h->worldH == 0 || h->mapW != mapW || h->mapH != mapH || tableEnd > pk->size) {
+        mappack_close(pk);
+        return -1;
+    }
+    return 1;
+}
+
+// Tiles of map (mx,my): mapW * mapH bytes, row-major, no terminators. Returns 1 with *tiles and
+// the first spawn (sx = MAPPACK_NO_SPAWN if none), 0 if the map had no text file, -1 if its entry
+// is out of range, fails the checksum or holds a byte outside MAPPACK_TILES.
+static inline int mappack_map(const MapPack *pk, int mx, int my, const unsigned char **tiles, int *sx, int *sy) {
+    const MapPackHeader *h = mappack_header(pk);
+    if (mx < 0 || mx >= h->worldW || my < 0 || my >= h->worldH) return -1;
+    const MapPackEntry *e = (const MapPackEntry*)(pk->base + sizeof(MapPackHeader)) + (size_t)my * h->worldW + mx;
+    if (e->offset == 0) return 0;
+    size_t n = (size_t)h->mapW * h->mapH;
+    if (e->offset < sizeof(MapPackHeader) || (size_t)e->offset + n > pk->size) return -1;
+    const unsigned char *t = pk->base + e->offset;
+    if (mappack_checksum(t, n) != e->checksum) return -1;
+    for (size_t i = 0; i < n; ++i) if (!t[i] || !strchr(MAPPACK_TILES, t[i])) return -1;
+    if (e->spawnX != MAPPACK_NO_SPAWN && (e->spawnX >= h->mapW || e->spawnY >= h->mapH)) return -1;
+    *tiles = t; *sx = e->spawnX; *sy = e->spawnY;
+    return 1;
+}
+
+// Spawn of map (mx,my) as its entry records it, without reading the tiles. Returns 1 with the
+// spawn, 0 if the map has none, -1 if it had no text file or (mx,my) is outside the pack. An
+// entry that records a spawn can still fail mappack_map; callers that need the tiles check there.
+static inline int mappack_spawn(const MapPack *pk, int mx, int my, int *sx, int *sy) {
+    const MapPackHeader *h = mappack_header(pk);
+    if (mx < 0 || mx >= h->worldW || my < 0 || my >= h->worldH) return -1;
+    const MapPackEntry *e = (const MapPackEntry*)(pk->base + sizeof(MapPackHeader)) + (size_t)my * h->worldW + mx;
+    if (e->offset == 0) return -1;
+    if (e->spawnX == MAPPACK_NO_SPAWN) return 0;
+    *sx = e->spawnX; *sy = e->spawnY;
+    return 1;
+}
+
+#endif // MAPPACK_H
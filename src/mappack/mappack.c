@@ -0,0 +1,151 @@
+// Map packer: compiles the text maps (maps/x<mx>-y<my>.txt) into one binary pack (see
+// ../mappack.h) that the server and the native client map at startup. Tiles are sanitized the
+// way the server reads text maps, so a packed world plays exactly like the text one. Door tiles
+// that disagree across a map border are reported; the pack is written either way. With --seed,
+// maps without a text file are generated (../mapgen.h) as the server would for that seed and
+// stored too, which freezes a generated world: later generator changes or another --seed on the
+// server no longer alter it.
+//
+// Usage: mappack [--world W H] [--seed N] [maps dir] [out file]
+// Defaults: a 9x9 world, maps/ and maps/world.pack. Run it again after editing a map.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../types.h"
+#include "../mappack.h"
+#include "../mapgen.h"
+
+#define MAP_TILES (MAP_WIDTH * MAP_HEIGHT)
+
+// One text map as the server loads it: unknown characters become '.', short lines and missing
+// rows are walls. Returns 0 if the file does not exist.
+static int read_text_map(const char *dir, int mx, int my, unsigned char *tiles) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/x%d-y%d.txt", dir, mx, my);
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    char line[512];
+    for (int y = 0; y < MAP_HEIGHT; ++y) {
+        unsigned char *row = tiles + y * MAP_WIDTH;
+        if (!fgets(line, sizeof(line), f)) { memset(row, '#', (size_t)(MAP_HEIGHT - y) * MAP_WIDTH); break; }
+        int len = (int)strcspn(line, "\r\n");
+        for (int x = 0; x < MAP_WIDTH; ++x) {
+            char c = x < len ? line[x] : '#';
+            row[x] = (unsigned char)(c && strchr(MAPPACK_TILES, c) ? c : '.');
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    // Positional: [maps dir] [out file]; options may appear anywhere
+    int worldW = 9, worldH = 9, npos = 0, generate = 0;
+    uint64_t seed = 0;
+    const char *dir = "maps", *out = MAPPACK_FILE;
+    for (int a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--world") == 0 && a + 2 < argc) { worldW = atoi(argv[a + 1]); worldH = atoi(argv[a + 2]); a += 2; }
+        else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) { seed = strtoull(argv[++a], NULL, 0); generate = 1; }
+        else if (npos == 0) { dir = argv[a]; npos++; }
+        else if (npos == 1) { out = argv[a]; npos++; }
+    }
+    if (worldW < 1 || worldH < 1 || worldW > 256 || worldH > 256) {
+        fprintf(stderr, "usage: mappack [--world W H] [--seed N] [maps dir] [out file]\n");
+        return 1;
+    }
+    int numMaps = worldW * worldH;
+    size_t tableEnd = sizeof(MapPackHeader) + (size_t)numMaps * sizeof(MapPackEntry);
+    unsigned char *buf = (unsigned char*)calloc(1, tableEnd + (size_t)numMaps * MAP_TILES);
+    if (!buf) { fprintf(stderr, "out of memory\n"); return 1; }
+    MapPackHeader *h = (MapPackHeader*)buf;
+    MapPackEntry *entries = (MapPackEntry*)(buf + sizeof(MapPackHeader));
+    memcpy(h->magic, MAPPACK_MAGIC, 8);
+    h->version = MAPPACK_VERSION;
+    h->worldW = (uint16_t)worldW; h->worldH = (uint16_t)worldH;
+    h->mapW = MAP_WIDTH; h->mapH = MAP_HEIGHT;
+    size_t off = tableEnd;
+    int found = 0, generated = 0;
+    for (int my = 0; my < worldH; ++my) {
+        for (int mx = 0; mx < worldW; ++mx) {
+            MapPackEntry *e = &entries[my * worldW + mx];
+            e->spawnX = e->spawnY = MAPPACK_NO_SPAWN;
+            if (!read_text_map(dir, mx, my, buf + off)) continue;
+            e->offset = (uint32_t)off;
+            off += MAP_TILES;
+            found++;
+        }
+    }
+    if (!found && !generate) { fprintf(stderr, "mappack: no maps in %s/\n", dir); return 1; }
+
+    // Doors are the edge centers. A generated map opens one towards each neighbor unless that is
+    // a text map walled there (the server's rule, so the pack holds what it would generate).
+    int midX = MAP_WIDTH / 2, midY = MAP_HEIGHT / 2, mismatched = 0;
+    for (int my = 0; my < worldH && generate; ++my) {
+        for (int mx = 0; mx < worldW; ++mx) {
+            MapPackEntry *e = &entries[my * worldW + mx];
+            if (e->offset) continue;
+            const MapPackEntry *l = mx > 0 ? &entries[my * worldW + mx - 1] : NULL;
+            const MapPackEntry *r = mx + 1 < worldW ? &entries[my * worldW + mx + 1] : NULL;
+            const MapPackEntry *u = my > 0 ? &entries[(my - 1) * worldW + mx] : NULL;
+            const MapPackEntry *d = my + 1 < worldH ? &entries[(my + 1) * worldW + mx] : NULL;
+            unsigned doors = 0;
+            if (l && (!l->offset || buf[l->offset + midY * MAP_WIDTH + MAP_WIDTH - 1] != '#')) doors |= MAPGEN_DOOR_W;
+            if (r && (!r->offset || buf[r->offset + midY * MAP_WIDTH] != '#')) doors |= MAPGEN_DOOR_E;
+            if (u && (!u->offset || buf[u->offset + (MAP_HEIGHT - 1) * MAP_WIDTH + midX] != '#')) doors |= MAPGEN_DOOR_N;
+            if (d && (!d->offset || buf[d->offset + midX] != '#')) doors |= MAPGEN_DOOR_S;
+            mapgen_fill((char*)buf + off, MAP_WIDTH, MAP_WIDTH, MAP_HEIGHT, seed, mx, my, doors);
+            e->offset = (uint32_t)off;
+            off += MAP_TILES;
+            generated++;
+        }
+    }
+    for (int k = 0; k < numMaps; ++k) {
+        MapPackEntry *e = &entries[k];
+        if (!e->offset) continue;
+        const unsigned char *t = buf + e->offset;
+        e->checksum = mappack_checksum(t, MAP_TILES);
+        const unsigned char *s = memchr(t, 'S', MAP_TILES);
+        if (s) { e->spawnX = (uint16_t)((s - t) % MAP_WIDTH); e->spawnY = (uint16_t)((s - t) / MAP_WIDTH); }
+    }
+    h->size = (uint32_t)off;
+
+    // A door open on one side of a border and walled on the other cannot be walked through,
+    // which is rarely what the map author meant
+    for (int my = 0; my < worldH; ++my) {
+        for (int mx = 0; mx < worldW; ++mx) {
+            const MapPackEntry *e = &entries[my * worldW + mx];
+            if (!e->offset) continue;
+            const unsigned char *t = buf + e->offset;
+            const MapPackEntry *r = mx + 1 < worldW ? &entries[my * worldW + mx + 1] : NULL;
+            const MapPackEntry *d = my + 1 < worldH ? &entries[(my + 1) * worldW + mx] : NULL;
+            if (r && r->offset && (t[midY * MAP_WIDTH + MAP_WIDTH - 1] == '#') != (buf[r->offset + midY * MAP_WIDTH] == '#')) {
+                fprintf(stderr, "mappack: door between x%d-y%d and x%d-y%d is open on one side only\n", mx, my, mx + 1, my);
+                mismatched++;
+            }
+            if (d && d->offset && (t[(MAP_HEIGHT - 1) * MAP_WIDTH + midX] == '#') != (buf[d->offset + midX] == '#')) {
+                fprintf(stderr, "mappack: door between x%d-y%d and x%d-y%d is open on one side only\n", mx, my, mx, my + 1);
+                mismatched++;
+            }
+        }
+    }
+
+    // Write beside the target and rename, so a starting server never maps a half-written pack
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    FILE *f = fopen(tmp, "wb");
+    if (!f || fwrite(buf, 1, off, f) != off || fclose(f) != 0) {
+        fprintf(stderr, "mappack: cannot write %s\n", tmp);
+        return 1;
+    }
+#ifdef _WIN32
+    remove(out); // rename does not replace an existing file here
+#endif
+    if (rename(tmp, out) != 0) { fprintf(stderr, "mappack: cannot rename %s to %s\n", tmp, out); return 1; }
+    printf("mappack: %d of %d maps from %s/", found, numMaps, dir);
+    if (generate) printf(", %d generated from seed %llu,", generated, (unsigned long long)seed);
+    printf(" into %s (%zu bytes, %d door mismatches)\n", out, off, mismatched);
+    free(buf);
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/select.h>
 #endif
 
 int net_init(void) {
@@ -56,9 +57,9 @@ int net_set_tcp_nodelay_keepalive(net_socket_t s) {
     return (ok == 2) ? 0 : -1;
 }
 
-net_socket_t net_connect_hostport(const char *host, const char *port) {
+static net_socket_t connect_any(const char *host, const char *port, int socktype) {
     struct addrinfo hints; memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC; hints.ai_socktype = socktype;
     struct addrinfo *res = NULL;
     if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
     net_socket_t sock = -1;
@@ -72,6 +73,21 @@ net_socket_t net_connect_hostport(const char *host, const char *port) {
     return sock;
 }
 
+net_socket_t net_connect_hostport(const char *host, const char *port) {
+    return connect_any(host, port, SOCK_STREAM);
+}
+
+// A UDP socket connected to host:port, so plain send/recv reach only that peer
+net_socket_t net_udp_connect_hostport(const char *host, const char *port) {
+    return connect_any(host, port, SOCK_DGRAM);
+}
+
+int net_wait_readable(net_socket_t s, int timeout_ms) {
+    fd_set rf; FD_ZERO(&rf); FD_SET(s, &rf);
+    struct timeval tv; tv.tv_sec = timeout_ms / 1000; tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return select((int)s + 1, &rf, NULL, NULL, &tv);
+}
+
 int net_send_all(net_socket_t s, const void *buf, int len) {
     const char *p = (const char*)buf; int sent = 0;
     while (sent < len) {
@@ -21,10 +21,12 @@ typedef int net_socket_t;
 int net_init(void);
 void net_cleanup(void);
 net_socket_t net_connect_hostport(const char *host, const char *port);
+net_socket_t net_udp_connect_hostport(const char *host, const char *port);
 int net_set_nonblocking(net_socket_t s);
 int net_set_tcp_nodelay_keepalive(net_socket_t s);
 int net_send_all(net_socket_t s, const void *buf, int len);
 int net_recv_nonblocking(net_socket_t s, void *buf, int cap);
+int net_wait_readable(net_socket_t s, int timeout_ms); // >0 readable, 0 timeout, <0 error
 void net_close(net_socket_t s);
 
 #endif // NET_H
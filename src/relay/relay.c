@@ -0,0 +1,474 @@
+// Spectator relay: holds one SPECTATE subscription to the game server and fans its stream out to
+// any number of read-only viewers over TCP and WebSocket. The server pays for one client however
+// many watch. The relay keeps its own copy of the world (tiles, entrance flags, the last PLAYER
+// line per id) so a new viewer gets the full picture without asking upstream, and buffers per
+// viewer so a slow one only ever delays itself. The server's address is resolved once at startup
+// and (re)connecting happens in the background, so an unreachable server never stalls viewers.
+//
+// Usage: relay --key KEY [--server host:port] [--lobby NAME] [tcp port] [ws port]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET sock_t;
+#define poll WSAPoll // Vista+ (_WIN32_WINNT >= 0x0600)
+#define sock_close closesocket
+#define sock_would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+typedef int sock_t;
+#define sock_close close
+#define sock_would_block() (errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+
+#include "../types.h"
+#include "../ws.h"
+
+#define RELAY_WORLD_MAX 256 // maps per axis the server may announce (its WORLD_MAX)
+#define RELAY_BACKLOG_MAX (4 * 1024 * 1024) // unsent bytes after which a viewer is dropped
+#define RELAY_RECONNECT_MS 2000 // wait between upstream connection attempts
+#define RELAY_CONNECT_MS 5000 // an upstream connect still pending after this is abandoned
+#define RELAY_UPSTREAM_BUF 65536 // partial upstream line carried between reads
+#define RELAY_HANDSHAKE_MAX 8192 // WebSocket upgrade request size limit
+
+// One watcher. Everything it is sent goes through out[]: a non-blocking send takes what the
+// socket accepts and the rest waits for POLLOUT.
+typedef struct {
+    sock_t sock;
+    int isWebSocket;
+    int ready; // upgraded (WS) and sent the cached world; from here on it gets the live stream
+    int dead; // over RELAY_BACKLOG_MAX or a failed send: dropped after the current pass
+    char *hs; // WS upgrade request so far, NULL once answered
+    int hsLen;
+    char *out;
+    int outOff, outLen, outCap;
+} Viewer;
+
+static Viewer *g_viewers;
+static int g_numViewers = 0, g_viewerCap = 0;
+
+// World as the subscription last described it; per-map arrays are g_worldW * g_worldH, row-major,
+// sized by the server's WORLD line
+static int g_worldW = 0, g_worldH = 0;
+static char **g_tiles; // MAP_HEIGHT x MAP_WIDTH once a tile arrived, '\0' = unknown
+static char (*g_entr)[16]; // ENTR flags as sent ("l r u d"), "" if never
+static char (*g_players)[96]; // last PLAYER line per id while active, "" otherwise
+static int g_playerCap = 0;
+static int g_tick = -1;
+static char g_lobby[32]; // instance name from SPECTATING
+
+// Upstream subscription
+static const char *g_key = NULL;
+static const char *g_lobbyArg = NULL;
+static char g_host[256] = "127.0.0.1";
+static char g_port[16] = "5555";
+static struct sockaddr_storage g_upAddr; // the server, resolved at startup
+static socklen_t g_upAddrLen;
+static sock_t g_up = (sock_t)-1;
+static int g_upConnecting = 0; // g_up is still connecting; polled for POLLOUT until it is done
+static double g_upDeadline = 0.0; // when a pending connect is given up
+static int g_subscribed = 0; // SPECTATING seen on the current connection
+static char g_upBuf[RELAY_UPSTREAM_BUF];
+static int g_upLen = 0;
+
+static double relay_now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static void sock_set_nonblocking(sock_t s) {
+#ifdef _WIN32
+    u_long mode = 1; ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0); if (flags >= 0) fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+// --- Viewers ---
+
+static void viewer_queue(Viewer *v, const char *data, int len) {
+    if (v->dead || len <= 0) return;
+    if (v->outLen - v->outOff + len > RELAY_BACKLOG_MAX) { v->dead = 1; return; }
+    if (v->outOff > 0 && v->outLen + len > v->outCap) { // reclaim what was already sent
+        memmove(v->out, v->out + v->outOff, (size_t)(v->outLen - v->outOff));
+        v->outLen -= v->outOff;
+        v->outOff = 0;
+    }
+    if (v->outLen + len > v->outCap) {
+        int ncap = v->outCap ? v->outCap : 16384;
+        while (ncap < v->outLen + len) ncap *= 2;
+        char *nd = (char*)realloc(v->out, (size_t)ncap);
+        if (!nd) { v->dead = 1; return; }
+        v->out = nd; v->outCap = ncap;
+    }
+    memcpy(v->out + v->outLen, data, (size_t)len);
+    v->outLen += len;
+}
+
+// Queue one message: as is for TCP viewers, as a single text frame for WebSocket ones
+static void viewer_queue_message(Viewer *v, const char *data, int len) {
+    if (v->isWebSocket) {
+        uint8_t hdr[10];
+        viewer_queue(v, (const char*)hdr, ws_frame_header(hdr, len));
+    }
+    viewer_queue(v, data, len);
+}
+
+static void viewer_flush(Viewer *v) {
+    while (!v->dead && v->outOff < v->outLen) {
+        int n = (int)send(v->sock, v->out + v->outOff, v->outLen - v->outOff, 0);
+        if (n < 0) { if (!sock_would_block()) v->dead = 1; return; }
+        v->outOff += n;
+    }
+    v->outOff = v->outLen = 0;
+}
+
+// Everything a viewer needs before the live stream: YOU -1 (no player of its own), the instance,
+// the players that are in it, every tile seen so far and the entrance flags, then READY
+static void viewer_send_world(Viewer *v) {
+    static char *buf;
+    static int cap;
+    int len = 0;
+    int need = 160 + g_playerCap * 96;
+    for (int k = 0; k < g_worldW * g_worldH; ++k) {
+        if (g_tiles[k]) need += MAP_WIDTH * MAP_HEIGHT * 24;
+        if (g_entr[k][0]) need += 32;
+    }
+    if (need > cap) {
+        char *nb = (char*)realloc(buf, (size_t)need);
+        if (!nb) { v->dead = 1; return; }
+        buf = nb; cap = need;
+    }
+    len += snprintf(buf + len, (size_t)(cap - len), "YOU -1\n");
+    if (g_subscribed) len += snprintf(buf + len, (size_t)(cap - len), "SPECTATING %s\n", g_lobby);
+    if (g_worldW > 0) len += snprintf(buf + len, (size_t)(cap - len), "WORLD %d %d\n", g_worldW, g_worldH);
+    if (g_tick >= 0) len += snprintf(buf + len, (size_t)(cap - len), "TICK %d ALL\n", g_tick);
+    for (int id = 0; id < g_playerCap; ++id) {
+        if (g_players[id][0]) len += snprintf(buf + len, (size_t)(cap - len), "%s\n", g_players[id]);
+    }
+    for (int k = 0; k < g_worldW * g_worldH; ++k) {
+        const char *t = g_tiles[k];
+        if (!t) continue;
+        for (int y = 0; y < MAP_HEIGHT; ++y)
+            for (int x = 0; x < MAP_WIDTH; ++x)
+                if (t[y * MAP_WIDTH + x]) len += snprintf(buf + len, (size_t)(cap - len), "TILE %d %d %d %d %c\n", k % g_worldW, k / g_worldW, x, y, t[y * MAP_WIDTH + x]);
+    }
+    for (int k = 0; k < g_worldW * g_worldH; ++k)
+        if (g_entr[k][0]) len += snprintf(buf + len, (size_t)(cap - len), "ENTR %d %d %s\n", k % g_worldW, k / g_worldW, g_entr[k]);
+    len += snprintf(buf + len, (size_t)(cap - len), "READY\n");
+    viewer_queue_message(v, buf, len);
+    v->ready = 1;
+}
+
+static void viewer_add(sock_t s, int isWebSocket) {
+    if (g_numViewers == g_viewerCap) {
+        int ncap = g_viewerCap ? g_viewerCap * 2 : 64;
+        Viewer *nv = (Viewer*)realloc(g_viewers, (size_t)ncap * sizeof(Viewer));
+        if (!nv) { sock_close(s); return; }
+        g_viewers = nv; g_viewerCap = ncap;
+    }
+    sock_set_nonblocking(s);
+    int one = 1; setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    Viewer *v = &g_viewers[g_numViewers++];
+    memset(v, 0, sizeof(*v));
+    v->sock = s;
+    v->isWebSocket = isWebSocket;
+    if (isWebSocket) {
+        v->hs = (char*)malloc(RELAY_HANDSHAKE_MAX);
+        if (!v->hs) v->dead = 1;
+    } else {
+        viewer_send_world(v);
+    }
+}
+
+// Viewers only ever send a WS upgrade (and whatever a browser sends on close); anything else is
+// read and dropped. Returns 0 once the viewer is gone.
+static int viewer_read(Viewer *v) {
+    char tmp[4096];
+    int n = (int)recv(v->sock, tmp, sizeof(tmp), 0);
+    if (n == 0 || (n < 0 && !sock_would_block())) return 0;
+    if (n < 0 || !v->hs) return 1;
+    if (v->hsLen + n > RELAY_HANDSHAKE_MAX - 1) return 0;
+    memcpy(v->hs + v->hsLen, tmp, (size_t)n);
+    v->hsLen += n;
+    v->hs[v->hsLen] = '\0';
+    char resp[256];
+    int rn = ws_handshake_reply(v->hs, resp, sizeof(resp));
+    if (rn < 0) return 0;
+    if (rn == 0) return 1;
+    free(v->hs);
+    v->hs = NULL;
+    viewer_queue(v, resp, rn);
+    viewer_send_world(v);
+    return 1;
+}
+
+static void viewer_remove(int k) {
+    sock_close(g_viewers[k].sock);
+    free(g_viewers[k].hs);
+    free(g_viewers[k].out);
+    g_viewers[k] = g_viewers[--g_numViewers];
+}
+
+// --- Upstream ---
+
+static void cache_reset(void) {
+    for (int k = 0; k < g_worldW * g_worldH; ++k) free(g_tiles[k]);
+    free(g_tiles); free(g_entr);
+    g_tiles = NULL; g_entr = NULL;
+    g_worldW = g_worldH = 0;
+    for (int id = 0; id < g_playerCap; ++id) g_players[id][0] = '\0';
+    g_tick = -1;
+}
+
+// Keep what a new viewer needs from one line of the stream. Bullets, enemies and ACKs only matter
+// for the tick they arrive in, so they are not kept.
+static void cache_line(const char *line) {
+    int a, b, x, y, id, active;
+    char ch;
+    if (sscanf(line, "TICK %d", &a) == 1) {
+        g_tick = a;
+        // TICK n ALL: the PLAYER lines that follow are everyone
+        if (strstr(line, "ALL"))
+            for (id = 0; id < g_playerCap; ++id) g_players[id][0] = '\0';
+    } else if (sscanf(line, "WORLD %d %d", &a, &b) == 2) {
+        // Sent once, right after SPECTATING; nothing is cached for a world without it
+        if (g_worldW > 0 || a < 1 || b < 1 || a > RELAY_WORLD_MAX || b > RELAY_WORLD_MAX) return;
+        g_tiles = (char**)calloc((size_t)a * (size_t)b, sizeof(*g_tiles));
+        g_entr = (char(*)[16])calloc((size_t)a * (size_t)b, sizeof(*g_entr));
+        if (!g_tiles || !g_entr) { free(g_tiles); free(g_entr); g_tiles = NULL; g_entr = NULL; return; }
+        g_worldW = a; g_worldH = b;
+    } else if (sscanf(line, "PLAYER %d %*d %*d %*d %*d %*d %d", &id, &active) == 2) {
+        if (id < 0 || id >= MAX_REMOTE_PLAYERS) return;
+        if (id >= g_playerCap) {
+            int ncap = g_playerCap ? g_playerCap : 64;
+            while (ncap <= id) ncap *= 2;
+            char (*np)[96] = realloc(g_players, (size_t)ncap * sizeof(*np));
+            if (!np) return;
+            memset(np + g_playerCap, 0, (size_t)(ncap - g_playerCap) * sizeof(*np));
+            g_players = np; g_playerCap = ncap;
+        }
+        if (active) snprintf(g_players[id], sizeof(g_players[id]), "%s", line);
+        else g_players[id][0] = '\0';
+    } else if (sscanf(line, "TILE %d %d %d %d %c", &a, &b, &x, &y, &ch) == 5) {
+        if (a < 0 || a >= g_worldW || b < 0 || b >= g_worldH) return;
+        if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) return;
+        char **t = &g_tiles[b * g_worldW + a];
+        if (!*t && !(*t = (char*)calloc(MAP_WIDTH * MAP_HEIGHT, 1))) return;
+        (*t)[y * MAP_WIDTH + x] = ch;
+    } else if (sscanf(line, "ENTR %d %d %n", &a, &b, &x) == 2) {
+        if (a < 0 || a >= g_worldW || b < 0 || b >= g_worldH) return;
+        snprintf(g_entr[b * g_worldW + a], sizeof(g_entr[0]), "%s", line + x);
+    }
+}
+
+static void upstream_close(void) {
+    sock_close(g_up);
+    g_up = (sock_t)-1;
+    g_upConnecting = 0;
+    g_subscribed = 0;
+    g_upLen = 0;
+}
+
+// Connected: subscribe. Returns 0 (and closes) if the request cannot be sent.
+static int upstream_subscribe(void) {
+    g_upConnecting = 0;
+    int one = 1; setsockopt(g_up, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    char line[160];
+    int n = snprintf(line, sizeof(line), "SPECTATE %s%s%s\n", g_key, g_lobbyArg ? " " : "", g_lobbyArg ? g_lobbyArg : "");
+    if (send(g_up, line, n, 0) != n) { upstream_close(); return 0; }
+    printf("[relay] Connected to %s:%s\n", g_host, g_port);
+    fflush(stdout);
+    return 1;
+}
+
+// Start connecting to the server without waiting for it. Returns 0 if the attempt failed at once.
+static int upstream_connect(void) {
+    g_up = (sock_t)socket(g_upAddr.ss_family, SOCK_STREAM, 0);
+    if (g_up == (sock_t)-1) return 0;
+    sock_set_nonblocking(g_up);
+    if (connect(g_up, (const struct sockaddr*)&g_upAddr, (int)g_upAddrLen) == 0) return upstream_subscribe();
+#ifdef _WIN32
+    int pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    int pending = errno == EINPROGRESS;
+#endif
+    if (!pending) { upstream_close(); return 0; }
+    g_upConnecting = 1;
+    g_upDeadline = relay_now_ms() + RELAY_CONNECT_MS;
+    return 1;
+}
+
+// The pending connect polled writable or failed: see how it ended. Returns 0 if it failed.
+static int upstream_connect_done(void) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(g_up, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) err = 1;
+    if (err != 0) { upstream_close(); return 0; }
+    return upstream_subscribe();
+}
+
+// Read from the server: cache the complete lines and pass them to every ready viewer, one
+// message per tick (see ws_message_span). What the server sent before SPECTATING (the
+// connection starts out as a player) is skipped. Returns 0 when the connection is gone.
+static int upstream_read(void) {
+    int n = (int)recv(g_up, g_upBuf + g_upLen, sizeof(g_upBuf) - 1 - g_upLen, 0);
+    if (n < 0 && sock_would_block()) return 1;
+    if (n <= 0) return 0;
+    g_upLen += n;
+    g_upBuf[g_upLen] = '\0';
+    int fwd = -1, p = 0;
+    for (char *eol; (eol = strchr(g_upBuf + p, '\n')) != NULL; p = (int)(eol - g_upBuf) + 1) {
+        char *line = g_upBuf + p;
+        *eol = '\0';
+        if (!g_subscribed) {
+            if (strncmp(line, "SPECTATING ", 11) == 0) {
+                cache_reset();
+                snprintf(g_lobby, sizeof(g_lobby), "%s", line + 11);
+                g_subscribed = 1;
+                fwd = p;
+                printf("[relay] Spectating instance %s\n", g_lobby);
+                fflush(stdout);
+            } else if (strcmp(line, "DENIED") == 0) {
+                fprintf(stderr, "[relay] Server refused the spectator key\n");
+                exit(1);
+            }
+        } else {
+            cache_line(line);
+        }
+        *eol = '\n';
+    }
+    int from = fwd >= 0 ? fwd : 0;
+    for (int m; g_subscribed && from < p; from += m) {
+        m = ws_message_span(g_upBuf + from, p - from);
+        for (int k = 0; k < g_numViewers; ++k) {
+            if (g_viewers[k].ready) viewer_queue_message(&g_viewers[k], g_upBuf + from, m);
+        }
+    }
+    // Keep the partial line; one longer than the buffer is cut (no line of the protocol is)
+    g_upLen -= p;
+    if (g_upLen >= (int)sizeof(g_upBuf) - 1) g_upLen = 0;
+    memmove(g_upBuf, g_upBuf + p, (size_t)g_upLen);
+    return 1;
+}
+
+static sock_t listen_on(const char *port) {
+    struct addrinfo hints; memset(&hints, 0, sizeof(hints)); hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM; hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0) return (sock_t)-1;
+    sock_t s = (sock_t)socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int yes = 1; setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    if (bind(s, res->ai_addr, (int)res->ai_addrlen) != 0 || listen(s, SOMAXCONN) != 0) { sock_close(s); s = (sock_t)-1; }
+    freeaddrinfo(res);
+    return s;
+}
+
+int main(int argc, char **argv) {
+#ifdef _WIN32
+    WSADATA wsa; WSAStartup(MAKEWORD(2,2), &wsa);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    // Positional: [tcp port] [ws port]; options may appear anywhere
+    const char *port = "5565";
+    const char *wsport = "5566";
+    int npos = 0;
+    for (int a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--key") == 0 && a + 1 < argc) g_key = argv[++a];
+        else if (strcmp(argv[a], "--lobby") == 0 && a + 1 < argc) g_lobbyArg = argv[++a];
+        else if (strcmp(argv[a], "--server") == 0 && a + 1 < argc) {
+            const char *hp = argv[++a], *colon = strrchr(hp, ':');
+            if (colon) {
+                snprintf(g_host, sizeof(g_host), "%.*s", (int)(colon - hp), hp);
+                snprintf(g_port, sizeof(g_port), "%s", colon + 1);
+            } else {
+                snprintf(g_host, sizeof(g_host), "%s", hp);
+            }
+        }
+        else if (npos == 0) { port = argv[a]; npos++; }
+        else if (npos == 1) { wsport = argv[a]; npos++; }
+    }
+    if (!g_key) {
+        fprintf(stderr, "usage: relay --key KEY [--server host:port] [--lobby NAME] [tcp port] [ws port]\n");
+        return 1;
+    }
+    sock_t lsock = listen_on(port), wslsock = listen_on(wsport);
+    if (lsock == (sock_t)-1 || wslsock == (sock_t)-1) { fprintf(stderr, "bind failed\n"); return 1; }
+    // Resolved once: a lookup on every reconnect would stall the viewers while it runs
+    struct addrinfo hints; memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(g_host, g_port, &hints, &res) != 0 || res->ai_addrlen > sizeof(g_upAddr)) { fprintf(stderr, "cannot resolve %s:%s\n", g_host, g_port); return 1; }
+    memcpy(&g_upAddr, res->ai_addr, res->ai_addrlen);
+    g_upAddrLen = (socklen_t)res->ai_addrlen;
+    freeaddrinfo(res);
+    printf("[relay] Relaying %s:%s to viewers on TCP %s and WS %s\n", g_host, g_port, port, wsport);
+    fflush(stdout);
+
+    struct pollfd *pfds = NULL;
+    int pfdCap = 0;
+    double retryAt = 0.0;
+    for (;;) {
+        if (g_up == (sock_t)-1 && relay_now_ms() >= retryAt && !upstream_connect()) retryAt = relay_now_ms() + RELAY_RECONNECT_MS;
+        if (g_upConnecting && relay_now_ms() >= g_upDeadline) {
+            upstream_close();
+            retryAt = relay_now_ms() + RELAY_RECONNECT_MS;
+        }
+        // pfds: [0] TCP listener, [1] WS listener, [2] upstream, then one per viewer
+        if (g_numViewers + 3 > pfdCap) {
+            int ncap = pfdCap ? pfdCap * 2 : 64;
+            while (ncap < g_numViewers + 3) ncap *= 2;
+            struct pollfd *np = (struct pollfd*)realloc(pfds, (size_t)ncap * sizeof(struct pollfd));
+            if (!np) { fprintf(stderr, "out of memory\n"); return 1; }
+            pfds = np; pfdCap = ncap;
+        }
+        pfds[0].fd = lsock; pfds[0].events = POLLIN; pfds[0].revents = 0;
+        pfds[1].fd = wslsock; pfds[1].events = POLLIN; pfds[1].revents = 0;
+        pfds[2].fd = g_up; pfds[2].events = g_upConnecting ? POLLOUT : POLLIN; pfds[2].revents = 0;
+        for (int k = 0; k < g_numViewers; ++k) {
+            Viewer *v = &g_viewers[k];
+            pfds[k + 3].fd = v->sock;
+            pfds[k + 3].events = (short)(POLLIN | (v->outOff < v->outLen ? POLLOUT : 0));
+            pfds[k + 3].revents = 0;
+        }
+        int npfd = g_numViewers + 3;
+        poll(pfds, npfd, g_up == (sock_t)-1 || g_upConnecting ? 250 : 1000);
+
+        for (int l = 0; l < 2; ++l) {
+            if (!(pfds[l].revents & POLLIN)) continue;
+            sock_t cs = accept(pfds[l].fd, NULL, NULL);
+            if (cs != (sock_t)-1) viewer_add(cs, l == 1);
+        }
+        if (g_upConnecting) {
+            if ((pfds[2].revents & (POLLOUT | POLLHUP | POLLERR)) && !upstream_connect_done()) retryAt = relay_now_ms() + RELAY_RECONNECT_MS;
+        } else if (g_up != (sock_t)-1 && (pfds[2].revents & (POLLIN | POLLHUP | POLLERR)) && !upstream_read()) {
+            printf("[relay] Lost the server, reconnecting (viewers stay connected)\n");
+            fflush(stdout);
+            upstream_close();
+            retryAt = relay_now_ms() + RELAY_RECONNECT_MS;
+        }
+        // Viewers polled this round; ones added above keep their slot beyond npfd until the next
+        for (int k = 0; k < npfd - 3; ++k) {
+            Viewer *v = &g_viewers[k];
+            if ((pfds[k + 3].revents & (POLLIN | POLLHUP | POLLERR)) && !viewer_read(v)) v->dead = 1;
+        }
+        for (int k = g_numViewers - 1; k >= 0; --k) {
+            viewer_flush(&g_viewers[k]);
+            if (g_viewers[k].dead) viewer_remove(k);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Small seeded PRNG (PCG32, https://www.pcg-random.org/) used instead of rand() wherever the
+// simulation needs randomness. Every map owns one stream derived from the world seed and its
+// coordinates, so its outcome does not depend on other maps and can be replayed from the seed.
+typedef struct {
+    uint64_t state;
+    uint64_t inc; // stream selector, always odd
+} Rng;
+
+static inline uint32_t rng_next(Rng *r) {
+    uint64_t old = r->state;
+    r->state = old * 6364136223846793005ULL + r->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+}
+
+static inline void rng_seed(Rng *r, uint64_t seed, uint64_t stream) {
+    r->state = 0;
+    r->inc = (stream << 1) | 1u;
+    rng_next(r);
+    r->state += seed;
+    rng_next(r);
+}
+
+// Uniform value in [0, n) via multiply-shift (bias is negligible for the small n used here)
+static inline uint32_t rng_below(Rng *r, uint32_t n) {
+    return (uint32_t)(((uint64_t)rng_next(r) * n) >> 32);
+}
+
+static inline void rng_seed_map(Rng *r, uint64_t worldSeed, int wx, int wy) {
+    rng_seed(r, worldSeed, ((uint64_t)(uint32_t)wy << 32) | (uint32_t)wx);
+}
+
+#endif // RNG_H
@@ -1,3 +1,6 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // memfd_create for shared-memory clients
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,71 +11,250 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 typedef SOCKET sock_t;
+#define poll WSAPoll // Vista+ (_WIN32_WINNT >= 0x0600)
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
 typedef int sock_t;
 #endif
+// Map simulation runs on worker threads with pthreads; Windows (or -DSERVER_NO_THREADS) steps
+// the same per-map jobs serially.
+#if !defined(_WIN32) && !defined(SERVER_NO_THREADS)
+#define SIM_THREADS 1
+#include <pthread.h>
+#endif
 
 #include "../types.h"
+#include "../rng.h"
+#include "../ws.h"
+#include "../shm.h"
+#include "../udp.h"
+#include "../mappack.h"
+#include "../mapgen.h"
+
+#define WORLD_DEFAULT_DIM 9 // maps per side when neither a pack nor the text maps give a size
+#define WORLD_MAX 256 // maps per side at most (the pack's limit too)
+#define WORLD_PACK_HINT_MAPS 1024 // larger worlds without a pack log a hint to build one
+#define CLIENT_TABLE_INITIAL 16 // client slots allocated at startup; the table doubles on demand
+#define CLIENT_TABLE_MAX 4096 // hard cap on connected clients (ids stay below it)
+#define CLIENT_SLOT_BITS 12 // ClientRef: slot in the low bits (CLIENT_TABLE_MAX <= 1 << bits), generation above
+#define WS_BUF_SIZE 8192 // WebSocket handshake buffer, only held until the upgrade completes
+#define WS_BUFS_PER_SLAB 16 // handshake buffers carved from one allocation
+#define MAP_META_MAX_MARKS 32
+#define BULLET_CELLS_PER_STEP 2 // tiles a bullet may travel per step_bullets call (< 64)
+#define BULLET_POOL_INITIAL MAX_REMOTE_BULLETS
+#define BULLET_POOL_MAX 16384 // hard cap on live server bullets
+#define MAX_MAP_ENEMIES (MAP_WIDTH * MAP_HEIGHT) // enemies never share a tile
+#define FLOW_UNREACHABLE 0xFFFF
+#define SIM_MAX_WORKERS 16
+#define SIM_BULLET_CHUNK 1024 // bullet slots traced per parallel job
+#define ENEMY_STEP_TICKS 3 // enemies step every 3 ticks (~6-7 steps/sec) on occupied maps
+#define IDLE_MAPS_PER_STEP 4 // unoccupied maps fast-forwarded per enemy step (round robin)
+#define ENEMY_CATCHUP_MAX_STEPS 20 // cap on missed enemy steps replayed in one batch
+#define TICKS_PER_SEC 20 // the main loop runs one tick every TICK_MS
+#define CLIENT_IDLE_TIMEOUT_SEC 180 // disconnect after 3 minutes without input
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS) // slots per timer wheel level
+#define TW_LEVELS 4 // covers 64^4 ticks (~155 hours at 20 ticks/sec)
+#define INPUT_QUEUE_LEN 16 // queued INPUT actions per client (>= the token burst)
+#define INPUTS_PER_TICK 1 // queued actions applied per client per tick
+#define TICK_MS (1000 / TICKS_PER_SEC)
+#define LOAD_CALM_TICKS 40 // ticks well under budget before stepping back down the ladder (~2s)
+#define LOAD_STEP_GAP_TICKS 10 // minimum ticks between two steps up the ladder
+#define SNAPSHOT_IDLE_SEC 10 // clients without input this long count as idle for snapshot thinning
+#define SNAPSHOT_THIN_EVERY 4 // idle clients get every 4th snapshot while thinned
+#define MAP_STREAMS_PER_TICK 1 // map snapshots sent per tick while streaming is deferred
+#define REWIND_MAX_TICKS 8 // per-map position frames kept for lag compensation
+#define REWIND_DEFAULT_TICKS 6 // default --rewind cap (~300ms); must stay below REWIND_MAX_TICKS
+#define INSTANCES_DEFAULT 64 // default --instances: world instances (lobbies) one process hosts
+#define LOBBY_SIZE_DEFAULT 16 // default --lobby-size: players per instance
+#define INSTANCE_NAME_LEN 16
+#define INSTANCE_RECLAIM_TICKS (60 * TICKS_PER_SEC) // an instance nobody is in is freed after this
+#define MAP_EVICT_TICKS (30 * TICKS_PER_SEC) // an unoccupied, unmodified map is dropped after this
+#define MAP_EVICT_SCAN 8 // loaded maps per instance checked for eviction each tick
+#define TEMPLATE_PREFETCH_MAX 64 // templates waiting for or being loaded by the prefetch thread
+#define UDP_KEY_ROTATE_MS 60000.0 // CONNECT tokens get a new key this often (the last one still counts)
+
+// Bitboards below keep one row per uint64_t (bit x) and one column per uint32_t (bit y)
+#if MAP_WIDTH > 64 || MAP_HEIGHT > 32
+#error "map bitboards need MAP_WIDTH <= 64 and MAP_HEIGHT <= 32"
+#endif
+
+// Special tiles of one map, derived from tiles at load time and kept current by map_set_tile.
+// Mark lists are sorted row-major; counts stay exact even if a list overflows its capacity.
+typedef struct {
+    int numOpen; // non-wall tiles
+    int numSpawns, numPickups, numGoals; // 'S', 'X', 'W'
+    Vec2 spawns[MAP_META_MAX_MARKS];
+    Vec2 pickups[MAP_META_MAX_MARKS];
+    Vec2 goals[MAP_META_MAX_MARKS];
+} MapMeta;
+
+// Cross-map effects recorded by a map job and applied serially afterwards (apply_map_events)
+typedef enum {
+    EV_FREE_BULLET, // a: bullet slot to return to the pool
+    EV_SCORE, // a: client, b: points
+    EV_HIT_PLAYER, // a: victim, b: bullet owner
+    EV_CONTACT, // a: client touching an enemy at (x,y)
+    EV_PICKUP, // a: client standing on 'X' at (x,y)
+    EV_BREAK_WALL // wall at (x,y) destroyed
+} SimEventType;
 
-#define WORLD_W 9
-#define WORLD_H 9
-#define MAX_CLIENTS MAX_REMOTE_PLAYERS
+typedef struct {
+    unsigned char type;
+    int16_t x, y;
+    int a, b;
+} SimEvent;
+
+typedef struct {
+    SimEvent *ev;
+    int count, cap;
+} SimEventList;
+
+// Enemies on one map as a structure of arrays, packed in [0, count). Removal swaps the last
+// enemy into the hole, so spawn and despawn are O(1) (see enemy_spawn / enemy_despawn).
+typedef struct {
+    int count;
+    int16_t x[MAX_MAP_ENEMIES], y[MAX_MAP_ENEMIES];
+    int8_t hp[MAX_MAP_ENEMIES];
+    uint16_t id[MAX_MAP_ENEMIES]; // stable across despawn swaps, never 0 (see map_record_frame)
+    uint16_t nextId;
+} MapEnemies;
+
+// Reference to a client that may outlive its connection (bullet owners, rewind frames): the slot
+// in the low CLIENT_SLOT_BITS and the slot's generation above. Stale once the slot is reused.
+typedef uint32_t ClientRef; // 0 is never a live reference
+
+// Who stood where at the end of one tick (what TICK n showed), for lag-compensated shots
+typedef struct {
+    int tick;
+    uint16_t enemyIdAt[MAP_HEIGHT][MAP_WIDTH]; // 0 if none
+    ClientRef playerAt[MAP_HEIGHT][MAP_WIDTH]; // resident client, 0 if none
+} MapFrame;
 
+// Tiles of one map and what derives from them. Loaded once per process into g_mapTemplates when
+// first needed and shared read-only by every instance; a map gets its own copy on its first edit
+// (map_layout_mut).
 typedef struct {
     char tiles[MAP_HEIGHT][MAP_WIDTH + 1];
     unsigned char wallDmg[MAP_HEIGHT][MAP_WIDTH];
+    MapMeta meta;
+    // Wall bitboards mirrored from tiles (see bb_set/bb_clear)
+    uint64_t wallRows[MAP_HEIGHT];
+    uint32_t wallCols[MAP_WIDTH];
+} MapLayout;
+
+typedef struct {
+    const MapLayout *lay; // the template until the first edit, then own
+    MapLayout *own; // private copy, NULL while the map is unedited; kept for the instance's life
+    unsigned char playerOcc[MAP_HEIGHT][MAP_WIDTH]; // resident players per tile
+    // Occupancy bitboards mirrored from enemies and playerOcc, next to lay's walls
+    uint64_t enemyRows[MAP_HEIGHT];
+    uint32_t enemyCols[MAP_WIDTH];
+    uint64_t playerRows[MAP_HEIGHT];
+    uint32_t playerCols[MAP_WIDTH];
+    // Entrance-block flags as sent in ENTR (bit0 left, bit1 right, bit2 up, bit3 down; 1 = blocked)
+    unsigned char entrFlags;
+    int entrPending; // on its instance's entrPendingMaps: residents and spectators need a fresh ENTR
+    // Resident clients (intrusive list through Client.mapPrev/mapNext)
+    int residentHead; // client index or -1
+    int numResidents;
+    int activeSlot; // index into its instance's activeMaps while numResidents > 0, else -1
+    int loadedSlot; // index into its instance's loadedMaps
+    int vacatedTick; // g_tick_counter when the last resident left, or when the map was loaded
+    int killed; // an enemy died here, so a fresh load would not play the same (see map_evict_idle)
+    MapEnemies enemies;
+    int16_t enemyAt[MAP_HEIGHT][MAP_WIDTH]; // enemy index on each tile or -1
+    // Flow field shared by all enemies: BFS steps to the nearest resident player through
+    // non-wall tiles (FLOW_UNREACHABLE if none). Rebuilt lazily while flowDirty is set.
+    uint16_t flowDist[MAP_HEIGHT][MAP_WIDTH];
+    int flowDirty;
+    Rng rng; // this map's stream of its instance's seed; all enemy randomness draws from it
+    SimEventList events; // filled by this map's job, drained in the serial merge
+    int unstoredFree; // bullets freed when events had no room (list through BulletPool.next) or -1
+    int enemyTick; // g_tick_counter of the last enemy step (live or caught up)
+    int idleDue; // picked for a background catch-up this tick
+    // Live bullets on this map (list through BulletPool.next/prev)
+    int bulletHead; // bullet slot or -1
+    int numBullets;
+    MapFrame frames[REWIND_MAX_TICKS]; // frame of tick t in slot t % REWIND_MAX_TICKS
 } Map;
 
+// Server bullets as a structure-of-arrays pool. Slots below `high` are either live or on the
+// free stack; arrays grow by doubling up to BULLET_POOL_MAX (see bullet_alloc).
 typedef struct {
-    int active;
-    int worldX;
-    int worldY;
-    Vec2 pos;
-    Direction dir;
-    int ownerId;
-} SrvBullet;
+    int cap, high, live;
+    unsigned char *active;
+    int16_t *x, *y;
+    int8_t *dx, *dy;
+    unsigned char *dir; // Direction
+    ClientRef *owner; // may outlive the shooter (see client_from_ref)
+    int *map; // wy * g_worldW + wx
+    int *next, *prev; // per-map list links
+    unsigned char *adv, *hit; // step_bullets scratch: tiles advanced, and whether an obstacle stopped it
+    int *freeStack;
+    int numFree;
+} BulletPool;
+
+// Timer linked into one slot of the timer wheel; next/prev are NULL while it is not armed
+typedef struct Timer {
+    struct Timer *next, *prev;
+    uint32_t expires; // tick at which fn runs
+    void (*fn)(struct Timer *t);
+    int owner; // e.g. the client index
+} Timer;
 
+// Hierarchical timer wheel keyed by tick: level L slot s holds timers due within the L-th
+// 64^L-tick window, so arm/cancel are O(1) and a tick only visits the timers it fires plus,
+// every 64 ticks, one cascaded slot per higher level.
 typedef struct {
-    int active;
-    int worldX;
-    int worldY;
-    Vec2 pos;
-    int hp;
-} SrvEnemy;
+    uint32_t now; // next tick to run
+    Timer slots[TW_LEVELS][TW_SLOTS]; // list sentinels
+} TimerWheel;
+
+// One queued INPUT line; seq is the client's sequence number (0 if it sends none)
+typedef struct {
+    int8_t dx, dy, shoot;
+    uint32_t seq;
+    int viewTick; // newest TICK the client had seen when sending it (-1 if not reported)
+    int arrivalTick;
+} InputCmd;
 
+typedef struct Instance Instance;
+
+// Per-tick client state, walked by the simulation and snapshot loops. Kept compact; everything
+// only touched on connect, input or socket events lives in ClientConn at the same index.
 typedef struct {
     int connected;
+    uint32_t gen; // bumped each time the slot is taken (see client_ref)
     sock_t sock;
-    int isWebSocket;
-    int wsHandshakeDone;
-    char wsBuf[8192];
-    int wsBufLen;
+    unsigned char isWebSocket, wsHandshakeDone;
+    unsigned char snapSkipped; // missed a thinned snapshot; the next one carries the whole player set
+    unsigned char streamPending; // map snapshot waiting in drain_map_streams
+    unsigned char spectator; // watches its instance without playing (see client_spectate)
+    unsigned char isShm; // output goes to the shared-memory ring; sock is only the control socket
+    unsigned char isUdp; // datagrams on g_udpSock; sock is -1 (see udp_receive)
     int worldX, worldY;
     Vec2 pos;
     int color;
     Direction facing;
     int hp;
-    int invincibleTicks; // 3s at 20 ticks/sec => 60 ticks
-    int superTicks; // 5s at 20 ticks/sec => 100 ticks
-    int shootCooldown; // ticks until next allowed shot
+    // Status timers are tick deadlines, active while g_tick_counter < deadline (see ticks_left)
+    int invincibleUntil; // 3s at 20 ticks/sec => 60 ticks
+    int superUntil; // 5s at 20 ticks/sec => 100 ticks
+    int shootReadyAt; // tick of the next allowed shot
     int score;
     time_t lastActive;
-    char addr[64];
-    char port[16];
-    unsigned long long connId;
-    // Lightweight input rate limiting
-    int tokens; // leaky-bucket tokens
-    int maxTokens; // capacity
-    int refillTicks; // every N ticks, add tokens
-    int refillAmount; // tokens added per refill
-    int tickSinceRefill;
+    int inqCount; // queued INPUT actions (the ring itself is in ClientConn)
+    uint32_t ackSeq, ackSent; // sequence of the last applied input, and the last one sent in ACK
     // Last snapshot sent in broadcast (for delta compression)
     int lastSentActive;
     int lastSentWorldX;
@@ -84,14 +266,156 @@ typedef struct {
     int lastSentInv;
     int lastSentSup;
     int lastSentScore;
+    // Map membership (see map_link_client)
+    int inMap;
+    int mapPrev, mapNext;
+    // Instance membership (see instance_join); NULL until the client has joined one
+    Instance *inst;
+    int instPrev, instNext;
 } Client;
 
-static Map world[WORLD_H][WORLD_W];
-static Client clients[MAX_CLIENTS];
+// Connection-side client state, parallel to clients[]
+typedef struct {
+    char *wsBuf; // WS_BUF_SIZE handshake buffer from the slab pool, NULL once upgraded (see ws_buf_take)
+    int wsBufLen;
+    Timer idleTimer; // inactivity timeout (see client_idle_timer)
+    char addr[64];
+    char port[16];
+    unsigned long long connId;
+    // Lightweight input rate limiting
+    int tokens; // leaky-bucket tokens
+    int maxTokens; // capacity
+    int refillTicks; // every N ticks, add tokens
+    int refillAmount; // tokens added per refill
+    int tokenTick; // tick of the last refill; refills are applied lazily (see client_take_token)
+    // INPUT actions waiting for the simulation (ring), applied by drain_inputs
+    InputCmd inq[INPUT_QUEUE_LEN];
+    int inqHead;
+    uint32_t lastSeq; // newest sequence number accepted into the queue
+    // Lag compensation: newest TICK reported in INPUT, and the smoothed ticks between seeing a
+    // TICK and its report arriving (in 1/8 ticks)
+    int viewTick;
+    int lagTicks8;
+    int streamReady; // send READY after the pending map snapshot
+    // UDP clients: reliable channel, peer address and when it was last heard from
+    UdpChannel *udp;
+    struct sockaddr_storage udpAddr;
+    int udpAddrLen;
+    double udpHeardMs;
+    int udpLost; // reliable backlog overflowed; dropped by udp_service
+#ifdef SHM_TRANSPORT
+    ShmLink *shm; // mapped rings of a shared-memory client (see shm_accept)
+    int shmWake; // eventfd signaled when the client waits for output
+#endif
+} ClientConn;
+
+// Freed WS handshake buffers, threaded through their first bytes
+typedef union WsBuf {
+    union WsBuf *nextFree;
+    char data[WS_BUF_SIZE];
+} WsBuf;
+
+// One independent world (a lobby): its maps, bullets and spawn point. Every instance runs the
+// same map files with its own seed; clients see and affect only the instance they joined.
+struct Instance {
+    int id;
+    char name[INSTANCE_NAME_LEN]; // "#<id>" for matchmade instances, else the lobby name from HELLO
+    uint64_t seed; // seeds this instance's map Rngs
+    // Maps by wy * g_worldW + wx, NULL until something needs them (see map_get). loadedMaps
+    // lists the loaded ones (unordered), so no per-tick pass scans the whole world.
+    Map **maps;
+    int *loadedMaps;
+    int numLoaded;
+    int evictCursor; // next loaded map considered for eviction
+    BulletPool bullets;
+    // Maps with at least one resident client, packed as wy * g_worldW + wx (unordered)
+    int *activeMaps;
+    int numActiveMaps;
+    // Loaded maps whose ENTR changed since the last tick flush, resident or not (see map_entr_mark)
+    int *entrPendingMaps;
+    int numEntrPending;
+    // Spawn (the world's, see world_find_spawn) and the open tiles around it in the ring order
+    // used by place_near_spawn. Rebuilt lazily after edits on the spawn map.
+    int spawnMX, spawnMY;
+    Vec2 spawnCandidates[MAP_WIDTH * MAP_HEIGHT];
+    int numSpawnCandidates;
+    int spawnCandidatesDirty;
+    int idleCursor; // next loaded map considered for a background catch-up
+    // Members (intrusive list through Client.instPrev/instNext). Instances without members are
+    // parked: off the running list, so no tick touches them until someone joins again.
+    int memberHead;
+    int numMembers;
+    int spectatorHead; // read-only subscribers (see client_spectate), linked the same way
+    int runSlot; // index into g_running while numMembers > 0, else -1
+    int idleSince; // g_tick_counter when it was created or its last member or spectator left
+    // Slots that left since the oldest full snapshot a member still waits for; members still see
+    // them until told otherwise. Those from departedNew on left since the last snapshot.
+    int *departed;
+    int numDeparted, departedCap, departedNew;
+};
+
+// Instance the code below works on. Entry points (client commands, each instance's step and
+// snapshot, sim jobs on their worker thread) set it, so the per-map functions stay unchanged.
+#ifdef SIM_THREADS
+static __thread Instance *g_inst;
+#else
+static Instance *g_inst;
+#endif
+static Instance **g_instances; // by id, created on demand
+static int g_worldW, g_worldH; // maps per row and per column, fixed at startup (see world_open)
+static MapLayout **g_mapTemplates; // by wy * g_worldW + wx, loaded on first use (see map_template)
+static MapLayout g_wallLayout; // solid stand-in for a template there was no memory for
+static MapPack g_mapPack; // open for the process's life when a pack fits the world
+static int g_spawnMX, g_spawnMY; // map holding the world's first 'S'
+static int g_numInstances = 0;
+static int g_nextInstanceId = 0; // ids are not reused, so a matchmade "#id" names one world
+static int g_maxInstances = INSTANCES_DEFAULT; // --instances
+static int g_lobbySize = LOBBY_SIZE_DEFAULT; // --lobby-size: players per instance
+static const char *g_spectatorKey = NULL; // --spectator-key: SPECTATE is refused without one
+static const char *g_shmPath = NULL; // --shm: AF_UNIX socket where shared-memory clients connect
+static int g_shmBell = -1; // doorbell eventfd rung by every shared-memory client after writing
+static sock_t g_udpSock = (sock_t)-1; // UDP clients, on the TCP port's number
+static int g_numUdp = 0; // connected UDP clients
+static uint64_t g_udpKeys[2][2]; // CONNECT token keys: [0] current, [1] the one before (see udp_token)
+static double g_udpKeyMs = 0.0; // when g_udpKeys[0] was drawn
+static Instance **g_running; // instances with members, stepped every tick (unordered)
+static int g_numRunning = 0;
+// Client table: slot i is clients[i] (hot) plus conns[i] (cold). Both grow by doubling from
+// CLIENT_TABLE_INITIAL up to CLIENT_TABLE_MAX slots; the slot index is the id sent to clients.
+static Client *clients;
+static ClientConn *conns;
+static int g_clientCap = 0;
+static int g_clientHigh = 0; // slots at and above this are free and already reported inactive
+static WsBuf *g_wsBufFree = NULL;
 static unsigned long long g_nextConnId = 1ULL;
-static SrvBullet bullets[MAX_REMOTE_BULLETS];
-static SrvEnemy enemies[WORLD_H][WORLD_W][MAX_ENEMIES];
 static int g_tick_counter = 0; // global server tick counter (~20 ticks/sec)
+static TimerWheel g_timers;
+static int g_rewindCap = REWIND_DEFAULT_TICKS; // --rewind: max ticks a shot is traced into the past
+
+// Degradation ladder, entered one rung at a time while ticks run over budget (see load_update)
+enum { LOAD_NORMAL, LOAD_SKIP_IDLE_MAPS, LOAD_THIN_SNAPSHOTS, LOAD_DEFER_STREAMS, LOAD_LEVELS };
+static const char *const g_loadLevelNames[LOAD_LEVELS] = { "normal", "skip background maps", "thin idle snapshots", "defer map streaming" };
+
+// Per-tick time accounting against the tick budget
+typedef struct {
+    double budgetMs; // --tick-budget, default TICK_MS
+    double workMs; // smoothed time per tick spent outside poll()
+    double simMs, sendMs; // last tick: inputs and simulation, snapshot encoding and sends
+    int level; // current rung
+    int lastStepTick, calmTicks;
+    unsigned long long overruns, lateTicks; // ticks over budget; ticks that started a full period late
+    unsigned long long entered[LOAD_LEVELS]; // times each rung was entered
+    unsigned long long skippedIdleMaps, thinnedSnapshots, deferredStreams;
+} LoadStats;
+static LoadStats g_load = { .budgetMs = TICK_MS };
+static uint64_t g_worldSeed = 0; // seeds every map's Rng and the generated maps (--seed, else the start time)
+
+// Regions (--regions N): the world's columns are split into N bands, each simulated by its own
+// process (see region_start). A region loads maps of any column but only steps its own; of the
+// others it reads just the edge tiles its neighbors mirror to it.
+static int g_region = 0, g_numRegions = 1;
+static int g_regionX0 = 0, g_regionX1 = 0; // columns [X0, X1) belong to this region (all once the world is sized)
+static int g_regionAccepts = 1; // holds the spawn map: takes new connections and lobby switches
 
 // Simple WS connection limits
 #define MAX_WS_PER_IP 2
@@ -109,10 +433,10 @@ static WsIpRate g_wsIpRates[WS_CONN_RATE_SLOTS];
 static int ws_count_active_for_ip(const char *ip) {
     if (!ip || !*ip) return 0;
     int cnt = 0;
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
+    for (int i = 0; i < g_clientHigh; ++i) {
         if (!clients[i].connected) continue;
         if (!clients[i].isWebSocket) continue;
-        if (strcmp(clients[i].addr, ip) == 0) cnt++;
+        if (strcmp(conns[i].addr, ip) == 0) cnt++;
     }
     return cnt;
 }
@@ -143,96 +467,412 @@ static int ws_rate_allow(const char *ip) {
     return 1;
 }
 
-static int is_map_active(int wx, int wy) {
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].connected) continue;
-        if (clients[i].worldX == wx && clients[i].worldY == wy) return 1;
+// --- Timer wheel ---
+static void tw_init(TimerWheel *w, uint32_t now) {
+    w->now = now;
+    for (int l = 0; l < TW_LEVELS; ++l)
+        for (int k = 0; k < TW_SLOTS; ++k) w->slots[l][k].next = w->slots[l][k].prev = &w->slots[l][k];
+}
+
+static void tw_list_append(Timer *head, Timer *t) {
+    t->prev = head->prev; t->next = head;
+    head->prev->next = t; head->prev = t;
+}
+
+// Link t into the slot for its expiry; expiries beyond the top level's reach are pulled in
+static void tw_link(TimerWheel *w, Timer *t) {
+    uint32_t delta = t->expires - w->now;
+    int l = 0;
+    while (l < TW_LEVELS - 1 && delta >= (1u << (TW_BITS * (l + 1)))) l++;
+    if (delta >= (1u << (TW_BITS * TW_LEVELS))) t->expires = w->now + (1u << (TW_BITS * TW_LEVELS)) - 1;
+    tw_list_append(&w->slots[l][(t->expires >> (TW_BITS * l)) & (TW_SLOTS - 1)], t);
+}
+
+static void tw_cancel(Timer *t) {
+    if (!t->next) return;
+    t->prev->next = t->next; t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// (Re)arm t to run fn at tick `expires`; past expiries run at the next tick processed
+static void tw_arm(TimerWheel *w, Timer *t, uint32_t expires, void (*fn)(Timer *t), int owner) {
+    tw_cancel(t);
+    if ((int32_t)(expires - w->now) < 0) expires = w->now;
+    t->expires = expires; t->fn = fn; t->owner = owner;
+    tw_link(w, t);
+}
+
+// Move slot list `head` onto the local sentinel `out` (empty if the slot was empty)
+static void tw_detach(Timer *head, Timer *out) {
+    if (head->next == head) { out->next = out->prev = out; return; }
+    out->next = head->next; out->prev = head->prev;
+    out->next->prev = out; out->prev->next = out;
+    head->next = head->prev = head;
+}
+
+// Run every tick up to and including `tick`. Callbacks may arm or cancel any timer, including
+// their own; timers armed for the tick being run fire at the next one.
+static void tw_advance(TimerWheel *w, uint32_t tick) {
+    while ((int32_t)(tick - w->now) >= 0) {
+        Timer due;
+        // At each level-0 wrap, redistribute the next window of each higher level downwards
+        for (int l = 1; l < TW_LEVELS && (w->now & ((1u << (TW_BITS * l)) - 1)) == 0; ++l) {
+            Timer moved;
+            tw_detach(&w->slots[l][(w->now >> (TW_BITS * l)) & (TW_SLOTS - 1)], &moved);
+            while (moved.next != &moved) {
+                Timer *t = moved.next;
+                tw_cancel(t);
+                tw_link(w, t);
+            }
+        }
+        tw_detach(&w->slots[0][w->now & (TW_SLOTS - 1)], &due);
+        w->now++;
+        while (due.next != &due) {
+            Timer *t = due.next;
+            tw_cancel(t);
+            t->fn(t);
+        }
     }
-    return 0;
 }
 
-// --- Minimal Base64 encoding ---
-static const char b64tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static int base64_encode(const uint8_t *in, int inlen, char *out, int outcap) {
-    int o = 0;
-    int i = 0;
-    while (i + 2 < inlen) {
-        if (o + 4 > outcap) return o;
-        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8) | in[i+2];
-        out[o++] = b64tab[(v >> 18) & 63];
-        out[o++] = b64tab[(v >> 12) & 63];
-        out[o++] = b64tab[(v >> 6) & 63];
-        out[o++] = b64tab[v & 63];
-        i += 3;
-    }
-    int rem = inlen - i;
-    if (rem == 1) {
-        if (o + 4 > outcap) return o;
-        uint32_t v = ((uint32_t)in[i]) << 16;
-        out[o++] = b64tab[(v >> 18) & 63];
-        out[o++] = b64tab[(v >> 12) & 63];
-        out[o++] = '=';
-        out[o++] = '=';
-    } else if (rem == 2) {
-        if (o + 4 > outcap) return o;
-        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8);
-        out[o++] = b64tab[(v >> 18) & 63];
-        out[o++] = b64tab[(v >> 12) & 63];
-        out[o++] = b64tab[(v >> 6) & 63];
-        out[o++] = '=';
-    }
-    if (o < outcap) out[o] = '\0';
-    return o;
-}
-
-// --- Minimal SHA1 implementation ---
-static uint32_t rol32(uint32_t v, int r) { return (v << r) | (v >> (32 - r)); }
-static void sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
-    uint32_t h0 = 0x67452301, h1 = 0xEFCDAB89, h2 = 0x98BADCFE, h3 = 0x10325476, h4 = 0xC3D2E1F0;
-    size_t newlen = len + 1; while ((newlen % 64) != 56) newlen++;
-    size_t total = newlen + 8;
-    uint8_t *msg = (uint8_t*)malloc(total);
-    if (!msg) return;
-    memcpy(msg, data, len);
-    msg[len] = 0x80;
-    memset(msg + len + 1, 0, newlen - (len + 1));
-    uint64_t bits = (uint64_t)len * 8ULL;
-    msg[newlen + 0] = (uint8_t)((bits >> 56) & 0xFF);
-    msg[newlen + 1] = (uint8_t)((bits >> 48) & 0xFF);
-    msg[newlen + 2] = (uint8_t)((bits >> 40) & 0xFF);
-    msg[newlen + 3] = (uint8_t)((bits >> 32) & 0xFF);
-    msg[newlen + 4] = (uint8_t)((bits >> 24) & 0xFF);
-    msg[newlen + 5] = (uint8_t)((bits >> 16) & 0xFF);
-    msg[newlen + 6] = (uint8_t)((bits >> 8) & 0xFF);
-    msg[newlen + 7] = (uint8_t)((bits >> 0) & 0xFF);
-
-    for (size_t off = 0; off < total; off += 64) {
-        uint32_t w[80];
-        for (int i = 0; i < 16; i++) {
-            w[i] = ((uint32_t)msg[off + i*4 + 0] << 24) |
-                   ((uint32_t)msg[off + i*4 + 1] << 16) |
-                   ((uint32_t)msg[off + i*4 + 2] << 8)  |
-                   ((uint32_t)msg[off + i*4 + 3]);
+// Ticks left before `deadline` (a g_tick_counter value), 0 once it has passed
+static int ticks_left(int deadline) {
+    int d = deadline - g_tick_counter;
+    return d > 0 ? d : 0;
+}
+
+// Token bucket for INPUT: add the refills owed since tokenTick, then take one token if any
+static int client_take_token(ClientConn *c) {
+    int periods = (g_tick_counter - c->tokenTick) / c->refillTicks;
+    if (periods > 0) {
+        long t = c->tokens + (long)periods * c->refillAmount;
+        c->tokens = t > c->maxTokens ? c->maxTokens : (int)t;
+        c->tokenTick += periods * c->refillTicks;
+    }
+    if (c->tokens <= 0) return 0;
+    c->tokens--;
+    return 1;
+}
+
+static ClientRef client_ref(int ci) { return (clients[ci].gen << CLIENT_SLOT_BITS) | (uint32_t)ci; }
+static int client_ref_slot(ClientRef r) { return (int)(r & ((1u << CLIENT_SLOT_BITS) - 1)); }
+
+// Slot of a client still connected to g_inst, or -1 if it left (or its slot was taken by someone
+// else, or it moved to another instance)
+static int client_from_ref(ClientRef r) {
+    int ci = client_ref_slot(r);
+    if (r == 0 || ci >= g_clientCap || !clients[ci].connected || client_ref(ci) != r || clients[ci].inst != g_inst) return -1;
+    return ci;
+}
+
+// WS handshake buffers come from slabs of WS_BUFS_PER_SLAB and return to a free list once the
+// upgrade is done, so plain TCP clients and upgraded sockets hold none
+static char *ws_buf_take(void) {
+    if (!g_wsBufFree) {
+        WsBuf *slab = (WsBuf*)malloc(sizeof(WsBuf) * WS_BUFS_PER_SLAB);
+        if (!slab) return NULL;
+        for (int k = 0; k < WS_BUFS_PER_SLAB; ++k) { slab[k].nextFree = g_wsBufFree; g_wsBufFree = &slab[k]; }
+    }
+    WsBuf *b = g_wsBufFree;
+    g_wsBufFree = b->nextFree;
+    return b->data;
+}
+
+static void ws_buf_release(char *p) {
+    if (!p) return;
+    WsBuf *b = (WsBuf*)p;
+    b->nextFree = g_wsBufFree;
+    g_wsBufFree = b;
+}
+
+static void bb_set(uint64_t *rows, uint32_t *cols, int x, int y) { rows[y] |= 1ULL << x; cols[x] |= 1u << y; }
+static void bb_clear(uint64_t *rows, uint32_t *cols, int x, int y) { rows[y] &= ~(1ULL << x); cols[x] &= ~(1u << y); }
+
+// Index of the lowest / highest set bit; v must be non-zero
+static int bit_lowest(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int i = 0; while (!(v & 1)) { v >>= 1; i++; } return i;
+#endif
+}
+static int bit_highest(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(v);
+#else
+    int i = 0; while (v >>= 1) i++; return i;
+#endif
+}
+
+// Breadth-first spread from the tiles already in queue[0..n), lowering flowDist only. Each
+// wave starts from equal distances, so a tile is queued at most once.
+static void flow_spread(Map *m, Vec2 *queue, int n) {
+    static const int ddx[4] = { 0, 0, -1, 1 }, ddy[4] = { -1, 1, 0, 0 };
+    for (int h = 0; h < n; ++h) {
+        int x = queue[h].x, y = queue[h].y;
+        uint16_t nd = (uint16_t)(m->flowDist[y][x] + 1);
+        for (int k = 0; k < 4; ++k) {
+            int nx = x + ddx[k], ny = y + ddy[k];
+            if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT) continue;
+            if ((m->lay->wallRows[ny] >> nx) & 1) continue;
+            if (m->flowDist[ny][nx] <= nd) continue;
+            m->flowDist[ny][nx] = nd;
+            queue[n].x = nx; queue[n].y = ny; n++;
         }
-        for (int i = 16; i < 80; i++) w[i] = rol32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
-        uint32_t a = h0, b = h1, c = h2, d = h3, e = h4;
-        for (int i = 0; i < 80; i++) {
-            uint32_t f, k;
-            if (i < 20) { f = (b & c) | ((~b) & d); k = 0x5A827999; }
-            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
-            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
-            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
-            uint32_t temp = rol32(a, 5) + f + e + k + w[i];
-            e = d; d = c; c = rol32(b, 30); b = a; a = temp;
+    }
+}
+
+static void flow_rebuild(Map *m) {
+    Vec2 queue[MAP_WIDTH * MAP_HEIGHT];
+    int n = 0;
+    memset(m->flowDist, 0xff, sizeof(m->flowDist));
+    for (int y = 0; y < MAP_HEIGHT; ++y) {
+        for (uint64_t row = m->playerRows[y]; row; row &= row - 1) {
+            int x = bit_lowest(row);
+            m->flowDist[y][x] = 0;
+            queue[n].x = x; queue[n].y = y; n++;
         }
-        h0 += a; h1 += b; h2 += c; h3 += d; h4 += e;
     }
-    free(msg);
-    out[0]= (h0>>24)&0xFF; out[1]=(h0>>16)&0xFF; out[2]=(h0>>8)&0xFF; out[3]=h0&0xFF;
-    out[4]= (h1>>24)&0xFF; out[5]=(h1>>16)&0xFF; out[6]=(h1>>8)&0xFF; out[7]=h1&0xFF;
-    out[8]= (h2>>24)&0xFF; out[9]=(h2>>16)&0xFF; out[10]=(h2>>8)&0xFF; out[11]=h2&0xFF;
-    out[12]=(h3>>24)&0xFF; out[13]=(h3>>16)&0xFF; out[14]=(h3>>8)&0xFF; out[15]=h3&0xFF;
-    out[16]=(h4>>24)&0xFF; out[17]=(h4>>16)&0xFF; out[18]=(h4>>8)&0xFF; out[19]=h4&0xFF;
+    flow_spread(m, queue, n);
+    m->flowDirty = 0;
+}
+
+// Incremental update: tile (x,y) can now be reached in d steps (new player tile or opened wall)
+static void flow_lower(Map *m, int x, int y, uint16_t d) {
+    if (m->flowDirty || m->flowDist[y][x] <= d) return;
+    Vec2 queue[MAP_WIDTH * MAP_HEIGHT];
+    m->flowDist[y][x] = d;
+    queue[0].x = x; queue[0].y = y;
+    flow_spread(m, queue, 1);
+}
+
+// A player arriving on a tile only shortens paths; one leaving may lengthen them (full rebuild)
+static void map_occ_inc(Map *m, int x, int y) { if (m->playerOcc[y][x]++ == 0) { bb_set(m->playerRows, m->playerCols, x, y); flow_lower(m, x, y, 0); } }
+static void map_occ_dec(Map *m, int x, int y) { if (--m->playerOcc[y][x] == 0) { bb_clear(m->playerRows, m->playerCols, x, y); m->flowDirty = 1; } }
+
+// Loaded map (wx,wy) of g_inst, or NULL (see map_get)
+static Map *map_loaded(int wx, int wy) { return g_inst->maps[wy * g_worldW + wx]; }
+
+// Add client to the resident list of the map at its current worldX/worldY and mark its tile
+// occupied. The first resident puts the map into the active set. The map must be loaded.
+static void map_link_client(int ci) {
+    Client *c = &clients[ci];
+    if (c->inMap) return;
+    Instance *in = c->inst;
+    Map *m = in->maps[c->worldY * g_worldW + c->worldX];
+    map_occ_inc(m, c->pos.x, c->pos.y);
+    c->mapPrev = -1;
+    c->mapNext = m->residentHead;
+    if (m->residentHead >= 0) clients[m->residentHead].mapPrev = ci;
+    m->residentHead = ci;
+    if (m->numResidents++ == 0) {
+        m->activeSlot = in->numActiveMaps;
+        in->activeMaps[in->numActiveMaps++] = c->worldY * g_worldW + c->worldX;
+    }
+    c->inMap = 1;
+}
+
+// Remove client from its map's resident list; the last resident leaving drops the map
+// from the active set (swap-remove, so order of activeMaps is not stable).
+static void map_unlink_client(int ci) {
+    Client *c = &clients[ci];
+    if (!c->inMap) return;
+    Instance *in = c->inst;
+    Map *m = in->maps[c->worldY * g_worldW + c->worldX];
+    map_occ_dec(m, c->pos.x, c->pos.y);
+    if (c->mapPrev >= 0) clients[c->mapPrev].mapNext = c->mapNext; else m->residentHead = c->mapNext;
+    if (c->mapNext >= 0) clients[c->mapNext].mapPrev = c->mapPrev;
+    c->mapPrev = c->mapNext = -1;
+    if (--m->numResidents == 0) {
+        int slot = m->activeSlot;
+        int last = in->activeMaps[--in->numActiveMaps];
+        in->activeMaps[slot] = last;
+        in->maps[last]->activeSlot = slot;
+        m->activeSlot = -1;
+        m->vacatedTick = g_tick_counter;
+    }
+    c->inMap = 0;
+}
+
+// Move a client to a tile (possibly on another map, which must be loaded), keeping the
+// membership index in sync
+static void client_move(int ci, int wx, int wy, int x, int y) {
+    Client *c = &clients[ci];
+    if (c->inMap && c->worldX == wx && c->worldY == wy) {
+        Map *m = map_loaded(wx, wy);
+        map_occ_dec(m, c->pos.x, c->pos.y);
+        map_occ_inc(m, x, y);
+        c->pos.x = x; c->pos.y = y;
+        return;
+    }
+    map_unlink_client(ci);
+    c->worldX = wx; c->worldY = wy; c->pos.x = x; c->pos.y = y;
+    map_link_client(ci);
+}
+
+// Return the resident client at (x,y) on map (wx,wy), or -1
+static int map_client_at(int wx, int wy, int x, int y) {
+    const Map *m = map_loaded(wx, wy);
+    if (!m->playerOcc[y][x]) return -1;
+    for (int ci = m->residentHead; ci >= 0; ci = clients[ci].mapNext) {
+        if (clients[ci].pos.x == x && clients[ci].pos.y == y) return ci;
+    }
+    return -1;
+}
+
+// Take a client out of its instance. Members are told in the next snapshot (see departed); the
+// last member leaving parks the instance. Spectators were never shown, so they just unlink.
+static void instance_leave(int ci) {
+    Client *c = &clients[ci];
+    Instance *in = c->inst;
+    if (!in) return;
+    map_unlink_client(ci);
+    int *head = c->spectator ? &in->spectatorHead : &in->memberHead;
+    if (c->instPrev >= 0) clients[c->instPrev].instNext = c->instNext; else *head = c->instNext;
+    if (c->instNext >= 0) clients[c->instNext].instPrev = c->instPrev;
+    c->instPrev = c->instNext = -1;
+    c->inst = NULL;
+    if (c->spectator) {
+        if (in->numMembers == 0 && in->spectatorHead < 0) in->idleSince = g_tick_counter;
+        return;
+    }
+    c->lastSentActive = 0; // the departed list reports it from here on
+    if (--in->numMembers == 0) {
+        Instance *last = g_running[--g_numRunning];
+        g_running[in->runSlot] = last;
+        last->runSlot = in->runSlot;
+        in->runSlot = -1;
+        in->numDeparted = in->departedNew = 0; // nobody left to tell
+        if (in->spectatorHead < 0) in->idleSince = g_tick_counter;
+        return;
+    }
+    for (int k = 0; k < in->numDeparted; ++k) {
+        if (in->departed[k] != ci) continue;
+        if (k >= in->departedNew) return;
+        // Left before, came back and left again: the next delta has to report it once more
+        memmove(in->departed + k, in->departed + k + 1, (size_t)(in->numDeparted - k - 1) * sizeof(int));
+        in->numDeparted--; in->departedNew--;
+        break;
+    }
+    if (in->numDeparted == in->departedCap) {
+        int ncap = in->departedCap ? in->departedCap * 2 : 16;
+        int *nd = (int*)realloc(in->departed, (size_t)ncap * sizeof(int));
+        if (!nd) return; // members keep a stale player until their next full snapshot
+        in->departed = nd; in->departedCap = ncap;
+    }
+    in->departed[in->numDeparted++] = ci;
+}
+
+static void disconnect_client(int i) {
+    tw_cancel(&conns[i].idleTimer);
+    instance_leave(i);
+    clients[i].connected = 0;
+    ws_buf_release(conns[i].wsBuf);
+    conns[i].wsBuf = NULL;
+    if (clients[i].isUdp) {
+        udp_channel_free(conns[i].udp);
+        free(conns[i].udp);
+        conns[i].udp = NULL;
+        g_numUdp--;
+        return; // no socket of its own
+    }
+#ifdef SHM_TRANSPORT
+    if (conns[i].shm) {
+        munmap(conns[i].shm, sizeof(ShmLink));
+        close(conns[i].shmWake);
+        conns[i].shm = NULL;
+    }
+#endif
+#ifdef _WIN32
+    closesocket(clients[i].sock);
+#else
+    close(clients[i].sock);
+#endif
+    clients[i].sock = 0;
+}
+
+// Fires CLIENT_IDLE_TIMEOUT_SEC after arming. Input only refreshes lastActive, so if the client
+// was active in the meantime the timer is re-armed for the remainder instead.
+static void client_idle_timer(Timer *t) {
+    int i = t->owner;
+    if (!clients[i].connected) return;
+    long idle = (long)(time(NULL) - clients[i].lastActive);
+    if (idle > CLIENT_IDLE_TIMEOUT_SEC) {
+        printf("[srv] Client %d (cid=%llu) disconnected (timeout) %s:%s\n", i, conns[i].connId, conns[i].addr, conns[i].port);
+        fflush(stdout);
+        disconnect_client(i);
+        return;
+    }
+    tw_arm(&g_timers, t, g_timers.now + (uint32_t)((CLIENT_IDLE_TIMEOUT_SEC - idle + 1) * TICKS_PER_SEC), client_idle_timer, i);
+}
+
+// Fresh player state for a client that just joined; also arms its idle timer
+static void client_reset_player(int i) {
+    clients[i].facing = DIR_RIGHT;
+    clients[i].hp = 3;
+    clients[i].invincibleUntil = 0;
+    clients[i].superUntil = 0;
+    clients[i].shootReadyAt = 0;
+    clients[i].score = 0;
+    clients[i].lastActive = time(NULL);
+    conns[i].tokens = 10; // start with some burst allowance
+    conns[i].maxTokens = 20;
+    conns[i].refillTicks = 2; // every 2 server ticks (~100ms)
+    conns[i].refillAmount = 1; // add 1 token
+    conns[i].tokenTick = g_tick_counter;
+    conns[i].inqHead = clients[i].inqCount = 0;
+    conns[i].lastSeq = clients[i].ackSeq = clients[i].ackSent = 0;
+    conns[i].viewTick = -1;
+    conns[i].lagTicks8 = 0;
+    clients[i].snapSkipped = 0;
+    clients[i].streamPending = conns[i].streamReady = 0;
+    tw_arm(&g_timers, &conns[i].idleTimer, g_timers.now + CLIENT_IDLE_TIMEOUT_SEC * TICKS_PER_SEC, client_idle_timer, i);
+}
+
+// Double the client table up to CLIENT_TABLE_MAX. Idle timers are list nodes inside conns[],
+// so armed ones are unlinked before the arrays move and linked again afterwards.
+static int client_table_grow(void) {
+    if (g_clientCap >= CLIENT_TABLE_MAX) return 0;
+    int ncap = g_clientCap ? g_clientCap * 2 : CLIENT_TABLE_INITIAL;
+    if (ncap > CLIENT_TABLE_MAX) ncap = CLIENT_TABLE_MAX;
+    for (int i = 0; i < g_clientCap; ++i) {
+        Timer *t = &conns[i].idleTimer;
+        if (t->next) tw_cancel(t); else t->fn = NULL;
+    }
+    Client *nc = (Client*)realloc(clients, (size_t)ncap * sizeof(Client));
+    if (nc) clients = nc;
+    ClientConn *ncc = nc ? (ClientConn*)realloc(conns, (size_t)ncap * sizeof(ClientConn)) : NULL;
+    if (ncc) conns = ncc;
+    for (int i = 0; i < g_clientCap; ++i) {
+        Timer *t = &conns[i].idleTimer;
+        t->next = t->prev = NULL;
+        if (t->fn) tw_arm(&g_timers, t, t->expires, t->fn, i);
+    }
+    if (!nc || !ncc) return 0;
+    memset(clients + g_clientCap, 0, (size_t)(ncap - g_clientCap) * sizeof(Client));
+    memset(conns + g_clientCap, 0, (size_t)(ncap - g_clientCap) * sizeof(ClientConn));
+    g_clientCap = ncap;
+    return 1;
+}
+
+// Take the lowest free slot (keeps ids and g_clientHigh small), growing the table if every slot
+// is in use. Returns -1 when CLIENT_TABLE_MAX clients are connected.
+static int client_alloc(sock_t sock, int isWebSocket) {
+    int ci = 0;
+    while (ci < g_clientCap && clients[ci].connected) ci++;
+    if (ci == g_clientCap && !client_table_grow()) return -1;
+    uint32_t gen = (clients[ci].gen + 1) & (UINT32_MAX >> CLIENT_SLOT_BITS);
+    memset(&clients[ci], 0, sizeof(Client));
+    memset(&conns[ci], 0, sizeof(ClientConn));
+    clients[ci].gen = gen ? gen : 1;
+    clients[ci].connected = 1;
+    clients[ci].sock = sock;
+    clients[ci].isWebSocket = (unsigned char)isWebSocket;
+    clients[ci].color = ci;
+    clients[ci].mapPrev = clients[ci].mapNext = -1;
+    clients[ci].instPrev = clients[ci].instNext = -1;
+    if (ci >= g_clientHigh) g_clientHigh = ci + 1;
+    return ci;
 }
 
 // --- Minimal case-insensitive substring search (ASCII) ---
@@ -253,81 +893,60 @@ static const char *strcasestr_local(const char *haystack, const char *needle) {
 }
 
 static int ws_send_text_frame(sock_t s, const char *data, int len) {
-    // build a server-to-client unmasked text frame
-    uint8_t hdr[10]; int hlen = 0;
-    hdr[0] = 0x81; // FIN + text
-    if (len < 126) { hdr[1] = (uint8_t)len; hlen = 2; }
-    else if (len <= 0xFFFF) { hdr[1] = 126; hdr[2] = (len >> 8) & 0xFF; hdr[3] = len & 0xFF; hlen = 4; }
-    else { hdr[1] = 127; // 64-bit length
-           hdr[2]=hdr[3]=hdr[4]=hdr[5]=0; hdr[6]=(len>>24)&0xFF; hdr[7]=(len>>16)&0xFF; hdr[8]=(len>>8)&0xFF; hdr[9]=len&0xFF; hlen = 10; }
+    uint8_t hdr[10];
+    int hlen = ws_frame_header(hdr, len);
     int n1 = (int)send(s, (const char*)hdr, hlen, 0);
     if (n1 < 0) return n1;
     return (int)send(s, data, len, 0);
 }
 
-static int ws_handshake(Client *c) {
-    // Expect HTTP GET with Sec-WebSocket-Key
+static int ws_handshake(int ci) {
+    ClientConn *c = &conns[ci];
+    if (!c->wsBuf) return -1;
     c->wsBuf[c->wsBufLen] = '\0';
-    const char *end = strstr(c->wsBuf, "\r\n\r\n");
-    if (!end) end = strstr(c->wsBuf, "\n\n"); // be tolerant
-    if (!end) return 0; // need more
-    // (debug logs removed)
-    // Robust header parse: find Sec-WebSocket-Key case-insensitively, ignoring whitespace
-    char key[128] = {0};
-    const char *p = c->wsBuf;
-    while (p < end) {
-        const char *ln = p;
-        const char *nl = strstr(ln, "\n");
-        if (!nl || nl > end) nl = end;
-        // Trim CRLF
-        const char *lineEnd = nl;
-        if (lineEnd > ln && *(lineEnd-1) == '\r') lineEnd--;
-        // Find colon
-        const char *colon = NULL;
-        for (const char *q = ln; q < lineEnd; ++q) { if (*q == ':') { colon = q; break; } }
-        if (colon) {
-            // Header name
-            int nameMatch = 1;
-            const char *name = "sec-websocket-key";
-            const char *q = ln; int idx = 0;
-            while (q < colon && name[idx]) {
-                char a = tolower((unsigned char)*q);
-                char b = name[idx];
-                if (a != b) { nameMatch = 0; break; }
-                q++; idx++;
-            }
-            if (name[idx] != '\0') nameMatch = 0; // not full name
-            // ignore extra spaces in header name area
-            if (nameMatch) {
-                const char *val = colon + 1;
-                while (val < lineEnd && (*val==' '||*val=='\t')) val++;
-                int ki = 0;
-                while (val < lineEnd && ki < (int)sizeof(key)-1) key[ki++] = *val++;
-                key[ki] = '\0';
-                break;
-            }
-        }
-        p = nl + 1;
-    }
-    if (key[0] == '\0') { return -1; }
-    const char *GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    char concat[256]; snprintf(concat, sizeof(concat), "%s%s", key, GUID);
-    uint8_t digest[20]; sha1((const uint8_t*)concat, strlen(concat), digest);
-    char accept[64]; base64_encode(digest, 20, accept, sizeof(accept));
     char resp[256];
-    int rn = snprintf(resp, sizeof(resp),
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
-    if (send(c->sock, resp, rn, 0) < 0) { return -1; }
-    c->wsHandshakeDone = 1;
+    int rn = ws_handshake_reply(c->wsBuf, resp, sizeof(resp));
+    if (rn <= 0) return rn; // need more, or not an upgrade request
+    if (send(clients[ci].sock, resp, rn, 0) < 0) { return -1; }
+    clients[ci].wsHandshakeDone = 1;
+    ws_buf_release(c->wsBuf);
+    c->wsBuf = NULL;
     c->wsBufLen = 0;
     return 1;
 }
 
+static void udp_send_datagram(void *ctx, const char *pkt, int len) {
+    const ClientConn *cc = (const ClientConn*)ctx;
+    sendto(g_udpSock, pkt, len, 0, (const struct sockaddr*)&cc->udpAddr, cc->udpAddrLen);
+}
+
+#ifdef SHM_TRANSPORT
+// Output to a shared-memory client, with a signal only if it is blocked waiting for some. A full
+// ring means the client stopped reading: shutting the control socket down makes the next poll
+// disconnect it like a closed TCP peer, instead of stalling the loop the way a blocking send does.
+static void shm_client_send(int ci, const char *data, int len) {
+    ShmLink *l = conns[ci].shm;
+    if (!shm_ring_write(&l->down, l->downData, SHM_DOWN_SIZE, data, len)) {
+        shutdown(clients[ci].sock, SHUT_RDWR);
+        return;
+    }
+    if (shm_ring_take_wake(&l->down)) eventfd_write(conns[ci].shmWake, 1);
+}
+#endif
+
 static void send_text_to_client(int idx, const char *data, int len) {
     if (!clients[idx].connected) return;
+    if (clients[idx].isUdp) {
+        // Reliable channel, sent by udp_service; a client this far behind is gone
+        if (!udp_queue(conns[idx].udp, data, len)) conns[idx].udpLost = 1;
+        return;
+    }
+#ifdef SHM_TRANSPORT
+    if (clients[idx].isShm) {
+        shm_client_send(idx, data, len);
+        return;
+    }
+#endif
     if (clients[idx].isWebSocket && clients[idx].wsHandshakeDone) {
         ws_send_text_frame(clients[idx].sock, data, len);
     } else {
@@ -335,530 +954,2516 @@ static void send_text_to_client(int idx, const char *data, int len) {
     }
 }
 
-static void send_full_map_to(int clientIdx) {
-    if (clientIdx < 0 || clientIdx >= MAX_CLIENTS) return;
-    if (!clients[clientIdx].connected) return;
+// --- Region links ---
+// Neighboring regions talk over an AF_UNIX stream pair, one text line per message like the client
+// protocol. HANDOFF lines carry the client's socket along (SCM_RIGHTS).
+typedef struct {
+    sock_t fd; // -1 without a neighbor on that side
+    char buf[16384];
+    int len;
+    int fds[16]; // sockets received ahead of their HANDOFF lines, oldest first
+    int numFds;
+} RegionLink;
+static RegionLink g_links[2] = { { .fd = (sock_t)-1 }, { .fd = (sock_t)-1 } }; // 0: left neighbor, 1: right
+
+static int region_owns(int wx) { return wx >= g_regionX0 && wx < g_regionX1; }
+
+// Send one line to a neighbor, with fd attached if >= 0. Returns 0 without a working link.
+static int region_send(int side, const char *data, int len, int fd) {
+#ifdef _WIN32
+    (void)side; (void)data; (void)len; (void)fd;
+    return 0;
+#else
+    RegionLink *l = &g_links[side];
+    if (l->fd < 0) return 0;
+    struct iovec iov = { (void*)data, (size_t)len };
+    struct msghdr msg; memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov; msg.msg_iovlen = 1;
+    union { struct cmsghdr h; char b[CMSG_SPACE(sizeof(int))]; } ctl;
+    if (fd >= 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.b; msg.msg_controllen = sizeof(ctl.b);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET; cm->cmsg_type = SCM_RIGHTS; cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    return sendmsg(l->fd, &msg, 0) == len;
+#endif
+}
+
+// Edge tiles of a border map are mirrored to the neighbor holding the map beyond that edge. They
+// are all it reads of maps it does not own: the entry tile on a transition and its ENTR flags.
+static void region_tile_changed(int wx, int wy, int x, int y, char ch) {
+    int side = x == 0 ? 0 : x == MAP_WIDTH - 1 ? 1 : -1;
+    if (side < 0 || !region_owns(wx) || region_owns(side ? wx + 1 : wx - 1)) return;
     char line[64];
-    for (int wy = 0; wy < WORLD_H; ++wy) {
-        for (int wx = 0; wx < WORLD_W; ++wx) {
-            for (int y = 0; y < MAP_HEIGHT; ++y) {
-                for (int x = 0; x < MAP_WIDTH; ++x) {
-                    char ch = world[wy][wx].tiles[y][x];
-                    int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", wx, wy, x, y, ch);
-                    send_text_to_client(clientIdx, line, n);
-                }
-            }
-        }
+    region_send(side, line, snprintf(line, sizeof(line), "TILE %s %d %d %d %d %c\n", g_inst->name, wx, wy, x, y, ch), -1);
+}
+
+static int map_meta_list_for(MapMeta *mm, char ch, Vec2 **list, int **count) {
+    switch (ch) {
+        case 'S': *list = mm->spawns; *count = &mm->numSpawns; return 1;
+        case 'X': *list = mm->pickups; *count = &mm->numPickups; return 1;
+        case 'W': *list = mm->goals; *count = &mm->numGoals; return 1;
     }
+    return 0;
 }
 
-static void send_map_to(int clientIdx, int wx, int wy) {
-    if (clientIdx < 0 || clientIdx >= MAX_CLIENTS) return;
-    if (!clients[clientIdx].connected) return;
-    if (wx < 0 || wx >= WORLD_W || wy < 0 || wy >= WORLD_H) return;
-    char buf[32768]; int off = 0; char line[64];
+static void map_meta_rebuild(MapLayout *l) {
+    MapMeta *mm = &l->meta;
+    memset(mm, 0, sizeof(*mm));
     for (int y = 0; y < MAP_HEIGHT; ++y) {
         for (int x = 0; x < MAP_WIDTH; ++x) {
-            char ch = world[wy][wx].tiles[y][x];
-            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", wx, wy, x, y, ch);
-            if (n <= 0) continue;
-            if (off + n >= (int)sizeof(buf)) {
-                send_text_to_client(clientIdx, buf, off);
-                off = 0;
-            }
-            memcpy(buf + off, line, n);
-            off += n;
+            char ch = l->tiles[y][x];
+            if (ch != '#') mm->numOpen++;
+            Vec2 *list; int *count;
+            if (!map_meta_list_for(mm, ch, &list, &count)) continue;
+            if (*count < MAP_META_MAX_MARKS) { list[*count].x = x; list[*count].y = y; }
+            (*count)++;
         }
     }
-    if (off > 0) send_text_to_client(clientIdx, buf, off);
+}
 
-    // After sending tiles, also send entrance blocked/open status so clients can render border dots correctly.
-    {
-        int midX = MAP_WIDTH / 2;
-        int midY = MAP_HEIGHT / 2;
-        int bl = 0, br = 0, bu = 0, bd = 0; // 1 means blocked by a wall in the adjacent map
-        // Left neighbor blocks if exists and its right-edge center is a wall '#'
-        if (wx > 0) {
-            bl = (world[wy][wx - 1].tiles[midY][MAP_WIDTH - 1] == '#') ? 1 : 0;
+static void map_walls_rebuild(MapLayout *l) {
+    memset(l->wallRows, 0, sizeof(l->wallRows));
+    memset(l->wallCols, 0, sizeof(l->wallCols));
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+        for (int x = 0; x < MAP_WIDTH; ++x)
+            if (l->tiles[y][x] == '#') bb_set(l->wallRows, l->wallCols, x, y);
+}
+
+static FILE *try_open_map(const char *prefix, int mx, int my) {
+    char path[256]; snprintf(path, sizeof(path), "%smaps/x%d-y%d.txt", prefix, mx, my);
+    return fopen(path, "rb");
+}
+
+// Authored tiles of map (mx,my): from the pack when it has a valid entry for it, else from its
+// text file. Returns 0 if there are none (the map is generated); sets *bad if the pack entry was
+// rejected.
+static int map_read_source(char tiles[MAP_HEIGHT][MAP_WIDTH + 1], int mx, int my, const MapPack *pk, int *bad) {
+    const unsigned char *packed = NULL;
+    int sx, sy;
+    int got = pk->base ? mappack_map(pk, mx, my, &packed, &sx, &sy) : -1;
+    if (got == 0) return 0;
+    if (got > 0) {
+        // Already sanitized by mappack
+        for (int y = 0; y < MAP_HEIGHT; ++y) {
+            memcpy(tiles[y], packed + y * MAP_WIDTH, MAP_WIDTH);
+            tiles[y][MAP_WIDTH] = '\0';
+        }
+        return 1;
+    }
+    if (pk->base) *bad = 1;
+    FILE *f = try_open_map("", mx, my);
+    if (!f) f = try_open_map("../", mx, my);
+    if (!f) f = try_open_map("../../", mx, my);
+    if (!f) return 0;
+    char line[512];
+    for (int y = 0; y < MAP_HEIGHT; ++y) {
+        if (!fgets(line, sizeof(line), f)) { for (; y < MAP_HEIGHT; ++y) { for (int x = 0; x < MAP_WIDTH; ++x) tiles[y][x] = '#'; tiles[y][MAP_WIDTH] = '\0'; } break; }
+        int len = (int)strcspn(line, "\r\n");
+        for (int x = 0; x < MAP_WIDTH; ++x) { char c = (x < len) ? line[x] : '#'; if (c!='#'&&c!='.'&&c!='X'&&c!='W'&&c!='@'&&c!='S'&&c!='M') c='.'; tiles[y][x] = c; }
+        tiles[y][MAP_WIDTH] = '\0';
+    }
+    fclose(f);
+    return 1;
+}
+
+// Doors of generated map (mx,my): open towards every neighbor inside the world, except an
+// authored one whose facing edge center is a wall
+static unsigned map_gen_doors(int mx, int my, const MapPack *pk) {
+    static const struct { int dx, dy, fx, fy; unsigned door; } sides[4] = {
+        { -1, 0, MAP_WIDTH - 1, MAP_HEIGHT / 2, MAPGEN_DOOR_W }, { 1, 0, 0, MAP_HEIGHT / 2, MAPGEN_DOOR_E },
+        { 0, -1, MAP_WIDTH / 2, MAP_HEIGHT - 1, MAPGEN_DOOR_N }, { 0, 1, MAP_WIDTH / 2, 0, MAPGEN_DOOR_S },
+    };
+    unsigned doors = 0;
+    for (int d = 0; d < 4; ++d) {
+        int nx = mx + sides[d].dx, ny = my + sides[d].dy, bad = 0;
+        if (nx < 0 || nx >= g_worldW || ny < 0 || ny >= g_worldH) continue;
+        char nt[MAP_HEIGHT][MAP_WIDTH + 1];
+        if (!map_read_source(nt, nx, ny, pk, &bad) || nt[sides[d].fy][sides[d].fx] != '#') doors |= sides[d].door;
+    }
+    return doors;
+}
+
+// Template tiles of map (mx,my): authored (map_read_source) or, where nobody wrote one, generated
+// from the world seed. Pure apart from reading files, so the prefetch thread runs it too. Returns
+// 0 if the pack entry was rejected.
+static int load_map_file(MapLayout *l, int mx, int my, const MapPack *pk) {
+    int bad = 0;
+    memset(l->wallDmg, 0, sizeof(l->wallDmg));
+    if (!map_read_source(l->tiles, mx, my, pk, &bad)) {
+        for (int y = 0; y < MAP_HEIGHT; ++y) l->tiles[y][MAP_WIDTH] = '\0';
+        mapgen_fill(&l->tiles[0][0], MAP_WIDTH + 1, MAP_WIDTH, MAP_HEIGHT, g_worldSeed, mx, my, map_gen_doors(mx, my, pk));
+    }
+    map_meta_rebuild(l);
+    // Ensure a central spawn exists at world center if the map has none
+    if (mx == g_worldW / 2 && my == g_worldH / 2 && l->meta.numSpawns == 0) {
+        l->tiles[MAP_HEIGHT / 2][MAP_WIDTH / 2] = 'S';
+        map_meta_rebuild(l);
+    }
+    map_walls_rebuild(l);
+    return !bad;
+}
+
+static int map_file_exists(int mx, int my) {
+    static const char *const prefixes[] = { "", "../", "../../" };
+    for (int k = 0; k < 3; ++k) {
+        FILE *f = try_open_map(prefixes[k], mx, my);
+        if (f) { fclose(f); return 1; }
+    }
+    return 0;
+}
+
+// Whether the text map (mx,my) has an 'S', read straight from the file without building a
+// template: 1 if it has, 0 if not, -1 if there is no file
+static int map_file_spawn(int mx, int my) {
+    FILE *f = try_open_map("", mx, my);
+    if (!f) f = try_open_map("../", mx, my);
+    if (!f) f = try_open_map("../../", mx, my);
+    if (!f) return -1;
+    char line[512];
+    int found = 0;
+    for (int y = 0; y < MAP_HEIGHT && !found && fgets(line, sizeof(line), f); ++y) {
+        int len = (int)strcspn(line, "\r\n");
+        found = memchr(line, 'S', (size_t)(len < MAP_WIDTH ? len : MAP_WIDTH)) != NULL;
+    }
+    fclose(f);
+    return found;
+}
+
+// Size the world and open the pack, before the regions fork. The size is --world when given,
+// else the pack's, else the run of text maps along the top row and left column, else
+// WORLD_DEFAULT_DIM square. The pack stays mapped: templates are read from it on demand. Returns
+// 0 when out of memory.
+static int world_open(int forcedW, int forcedH) {
+    static const char *const prefixes[] = { "", "../", "../../" };
+    char path[256];
+    int rc = 0;
+    for (int k = 0; k < 3 && rc == 0; ++k) {
+        snprintf(path, sizeof(path), "%s%s", prefixes[k], MAPPACK_FILE);
+        rc = mappack_open(&g_mapPack, path, MAP_WIDTH, MAP_HEIGHT);
+    }
+    const MapPackHeader *h = rc > 0 ? mappack_header(&g_mapPack) : NULL;
+    if (h && (h->worldW > WORLD_MAX || h->worldH > WORLD_MAX || (forcedW > 0 && (h->worldW != forcedW || h->worldH != forcedH)))) {
+        mappack_close(&g_mapPack);
+        h = NULL;
+        rc = -1;
+    }
+    if (rc < 0) printf("[srv] %s is not a pack for this world; reading text maps\n", path);
+    if (forcedW > 0) {
+        g_worldW = forcedW; g_worldH = forcedH;
+    } else if (h) {
+        g_worldW = h->worldW; g_worldH = h->worldH;
+    } else {
+        g_worldW = g_worldH = 0;
+        while (g_worldW < WORLD_MAX && map_file_exists(g_worldW, 0)) g_worldW++;
+        while (g_worldH < WORLD_MAX && map_file_exists(0, g_worldH)) g_worldH++;
+        if (g_worldW == 0) g_worldW = g_worldH = WORLD_DEFAULT_DIM;
+    }
+    if (h) printf("[srv] Maps from %s\n", path);
+    printf("[srv] World of %dx%d maps\n", g_worldW, g_worldH);
+    if (!h && g_worldW * g_worldH > WORLD_PACK_HINT_MAPS) printf("[srv] No map pack: the spawn search opens a file per map; run ./mappack for a faster start\n");
+    fflush(stdout);
+    for (int y = 0; y < MAP_HEIGHT; ++y) { memset(g_wallLayout.tiles[y], '#', MAP_WIDTH); g_wallLayout.tiles[y][MAP_WIDTH] = '\0'; }
+    map_meta_rebuild(&g_wallLayout);
+    map_walls_rebuild(&g_wallLayout);
+    g_mapTemplates = (MapLayout**)calloc((size_t)g_worldW * (size_t)g_worldH, sizeof(MapLayout*));
+    return g_mapTemplates != NULL;
+}
+
+// Template of map (mx,my), loaded the first time anything asks. Only serial code asks: a map job
+// never looks past its own map, which is loaded. Out of memory, a solid stand-in is returned
+// (and not kept), so nothing enters the map until a later try succeeds.
+static const MapLayout *map_template(int mx, int my) {
+    MapLayout **t = &g_mapTemplates[my * g_worldW + mx];
+    if (!*t) {
+        MapLayout *l = (MapLayout*)malloc(sizeof(MapLayout));
+        if (!l) return &g_wallLayout;
+        if (!load_map_file(l, mx, my, &g_mapPack)) {
+            printf("[srv] Pack entry of map (%d,%d) is bad; read it as text\n", mx, my);
+            fflush(stdout);
         }
-        // Right neighbor
-        if (wx < WORLD_W - 1) {
-            br = (world[wy][wx + 1].tiles[midY][0] == '#') ? 1 : 0;
+        *t = l;
+    }
+    return *t;
+}
+
+// The world's spawn is the first 'S' in row-major map order. Only the map holding it gets its
+// template built: pack entries record their spawn, text maps are scanned as they are read, and
+// generated maps hold none. The world center is always looked at, as loading gives it an 'S' if
+// it lacks one. Without any 'S' it is map (0,0).
+static void world_find_spawn(void) {
+    g_spawnMX = g_spawnMY = 0;
+    for (int k = 0; k < g_worldW * g_worldH; ++k) {
+        int mx = k % g_worldW, my = k / g_worldW, sx, sy;
+        int src = g_mapPack.base ? mappack_spawn(&g_mapPack, mx, my, &sx, &sy) : map_file_spawn(mx, my);
+        if (src <= 0 && (mx != g_worldW / 2 || my != g_worldH / 2)) continue;
+        if (map_template(mx, my)->meta.numSpawns > 0) { g_spawnMX = mx; g_spawnMY = my; return; }
+    }
+}
+
+// --- Template prefetch ---
+// When a map loads, a background thread reads or generates the templates a move to one of its
+// neighbors would need, so the player walking on finds them ready instead of the tick paying. The thread only
+// fills fresh MapLayouts; serial code installs them (template_prefetch_collect), and map_template
+// still loads whatever has not arrived, which gives the same layout.
+typedef struct {
+    int k; // wy * g_worldW + wx
+    MapLayout *l; // NULL when out of memory
+    int ok; // load_map_file's result
+} TemplateLoad;
+static int g_prefetchOutstanding = 0; // queued, loading or loaded but not yet collected
+#ifdef SIM_THREADS
+static unsigned char *g_prefetchQueued; // by map, set while outstanding
+static pthread_mutex_t g_prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_prefetchWake = PTHREAD_COND_INITIALIZER;
+static int g_prefetchReq[TEMPLATE_PREFETCH_MAX], g_prefetchHead, g_prefetchCount;
+static TemplateLoad g_prefetchDone[TEMPLATE_PREFETCH_MAX];
+static int g_prefetchNumDone;
+
+static void *template_prefetch_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_prefetchLock);
+    for (;;) {
+        while (g_prefetchCount == 0) pthread_cond_wait(&g_prefetchWake, &g_prefetchLock);
+        int k = g_prefetchReq[g_prefetchHead];
+        g_prefetchHead = (g_prefetchHead + 1) % TEMPLATE_PREFETCH_MAX;
+        g_prefetchCount--;
+        pthread_mutex_unlock(&g_prefetchLock);
+        MapLayout *l = (MapLayout*)malloc(sizeof(MapLayout));
+        int ok = l ? load_map_file(l, k % g_worldW, k / g_worldW, &g_mapPack) : 1;
+        pthread_mutex_lock(&g_prefetchLock);
+        g_prefetchDone[g_prefetchNumDone].k = k;
+        g_prefetchDone[g_prefetchNumDone].l = l;
+        g_prefetchDone[g_prefetchNumDone].ok = ok;
+        g_prefetchNumDone++;
+    }
+    return NULL;
+}
+#endif
+
+// Start the prefetch thread; without one every template loads on first use, as before
+static void template_prefetch_start(void) {
+#ifdef SIM_THREADS
+    g_prefetchQueued = (unsigned char*)calloc((size_t)g_worldW * (size_t)g_worldH, 1);
+    pthread_t th;
+    if (!g_prefetchQueued || pthread_create(&th, NULL, template_prefetch_worker, NULL) != 0) {
+        free(g_prefetchQueued);
+        g_prefetchQueued = NULL;
+        return;
+    }
+    pthread_detach(th);
+#endif
+}
+
+// Ask for the template of map (mx,my) ahead of need. Ignored outside the world, for a template
+// already there or asked for, and while TEMPLATE_PREFETCH_MAX are outstanding.
+static void template_prefetch(int mx, int my) {
+#ifdef SIM_THREADS
+    if (!g_prefetchQueued || mx < 0 || mx >= g_worldW || my < 0 || my >= g_worldH) return;
+    int k = my * g_worldW + mx;
+    if (g_mapTemplates[k] || g_prefetchQueued[k] || g_prefetchOutstanding == TEMPLATE_PREFETCH_MAX) return;
+    pthread_mutex_lock(&g_prefetchLock);
+    g_prefetchReq[(g_prefetchHead + g_prefetchCount) % TEMPLATE_PREFETCH_MAX] = k;
+    g_prefetchCount++;
+    pthread_cond_signal(&g_prefetchWake);
+    pthread_mutex_unlock(&g_prefetchLock);
+    g_prefetchQueued[k] = 1;
+    g_prefetchOutstanding++;
+#else
+    (void)mx; (void)my;
+#endif
+}
+
+// Install the templates the thread finished. One that map_template loaded meanwhile is kept and
+// the prefetched copy dropped; both came from the same source and seed.
+static void template_prefetch_collect(void) {
+#ifdef SIM_THREADS
+    if (g_prefetchOutstanding == 0) return;
+    TemplateLoad done[TEMPLATE_PREFETCH_MAX];
+    pthread_mutex_lock(&g_prefetchLock);
+    int n = g_prefetchNumDone;
+    memcpy(done, g_prefetchDone, (size_t)n * sizeof(TemplateLoad));
+    g_prefetchNumDone = 0;
+    pthread_mutex_unlock(&g_prefetchLock);
+    for (int i = 0; i < n; ++i) {
+        MapLayout **t = &g_mapTemplates[done[i].k];
+        g_prefetchQueued[done[i].k] = 0;
+        g_prefetchOutstanding--;
+        if (!done[i].l) continue;
+        if (*t) { free(done[i].l); continue; }
+        if (!done[i].ok) {
+            printf("[srv] Pack entry of map (%d,%d) is bad; read it as text\n", done[i].k % g_worldW, done[i].k / g_worldW);
+            fflush(stdout);
+        }
+        *t = done[i].l;
+    }
+#endif
+}
+
+// Per-instance state of map (mx,my) in g_inst, no enemies yet; the layout starts as the shared
+// template
+static void map_init(int mx, int my) {
+    Map *m = map_loaded(mx, my);
+    m->lay = map_template(mx, my);
+    m->own = NULL;
+    m->residentHead = -1;
+    m->numResidents = 0;
+    m->activeSlot = -1;
+    m->vacatedTick = g_tick_counter;
+    m->killed = 0;
+    m->bulletHead = -1;
+    m->numBullets = 0;
+    m->unstoredFree = -1;
+    m->flowDirty = 1;
+    m->enemyTick = g_tick_counter; // instances created later start their enemies now
+    m->idleDue = 0;
+    rng_seed_map(&m->rng, g_inst->seed, mx, my);
+    memset(m->playerOcc, 0, sizeof(m->playerOcc));
+    memset(m->playerRows, 0, sizeof(m->playerRows));
+    memset(m->playerCols, 0, sizeof(m->playerCols));
+    m->enemies.count = 0;
+    memset(m->enemyAt, 0xff, sizeof(m->enemyAt));
+    memset(m->enemyRows, 0, sizeof(m->enemyRows));
+    memset(m->enemyCols, 0, sizeof(m->enemyCols));
+}
+
+// Writable layout of m: the first call copies the template. Only the map's own job or the
+// serial part of the tick writes a map, so no lock is needed. NULL when out of memory.
+static MapLayout *map_layout_mut(Map *m) {
+    if (!m->own) {
+        MapLayout *l = (MapLayout*)malloc(sizeof(MapLayout));
+        if (!l) return NULL;
+        memcpy(l, m->lay, sizeof(*l));
+        m->own = l;
+        m->lay = l;
+    }
+    return m->own;
+}
+
+// Layout of map (wx,wy) as g_inst sees it: the loaded map's own, else the template. Never loads
+// a template for a loaded map, so a map job may ask about its own map.
+static const MapLayout *map_layout_at(int wx, int wy) {
+    const Map *m = map_loaded(wx, wy);
+    return m ? m->lay : map_template(wx, wy);
+}
+
+static int is_open(const MapLayout *l, int x, int y) { if (x<0||x>=MAP_WIDTH||y<0||y>=MAP_HEIGHT) return 0; return l->tiles[y][x] != '#'; }
+static int map_has_spawn(int mx, int my) { return map_layout_at(mx, my)->meta.numSpawns > 0; }
+
+// Recompute a loaded map's entrance flags from the door tiles of its neighbors (loaded or not).
+// Edges of the world count as blocked. Returns 1 if the flags changed.
+static int map_refresh_entr(int wx, int wy) {
+    int midX = MAP_WIDTH / 2;
+    int midY = MAP_HEIGHT / 2;
+    unsigned char f = 0x0F;
+    if (wx > 0 && map_layout_at(wx - 1, wy)->tiles[midY][MAP_WIDTH - 1] != '#') f &= ~1;
+    if (wx < g_worldW - 1 && map_layout_at(wx + 1, wy)->tiles[midY][0] != '#') f &= ~2;
+    if (wy > 0 && map_layout_at(wx, wy - 1)->tiles[MAP_HEIGHT - 1][midX] != '#') f &= ~4;
+    if (wy < g_worldH - 1 && map_layout_at(wx, wy + 1)->tiles[0][midX] != '#') f &= ~8;
+    Map *m = map_loaded(wx, wy);
+    int changed = (f != m->entrFlags);
+    m->entrFlags = f;
+    return changed;
+}
+
+// Queue a loaded map of g_inst for the next ENTR flush (once, however many doors change)
+static void map_entr_mark(int wx, int wy) {
+    Map *m = map_loaded(wx, wy);
+    if (m->entrPending) return;
+    m->entrPending = 1;
+    g_inst->entrPendingMaps[g_inst->numEntrPending++] = wy * g_worldW + wx;
+}
+
+// Called for every tile edit. Only the four door tiles (edge centers) feed ENTR: the neighbor
+// behind the door may change state, and this map must re-send its own flags because clients
+// overwrite their ':' entrance marker when the TILE line for the door arrives.
+static void map_entr_tile_changed(int wx, int wy, int x, int y) {
+    int midX = MAP_WIDTH / 2;
+    int midY = MAP_HEIGHT / 2;
+    int nwx = wx, nwy = wy;
+    if (x == 0 && y == midY) nwx = wx - 1;
+    else if (x == MAP_WIDTH - 1 && y == midY) nwx = wx + 1;
+    else if (y == 0 && x == midX) nwy = wy - 1;
+    else if (y == MAP_HEIGHT - 1 && x == midX) nwy = wy + 1;
+    else return;
+    if (nwx < 0 || nwx >= g_worldW || nwy < 0 || nwy >= g_worldH) return;
+    map_entr_mark(wx, wy);
+    // A neighbor that is not loaded reads this door when it loads
+    if (map_loaded(nwx, nwy) && map_refresh_entr(nwx, nwy)) map_entr_mark(nwx, nwy);
+}
+
+static int format_entr_line(char *line, size_t cap, int wx, int wy) {
+    unsigned char f = map_loaded(wx, wy)->entrFlags;
+    return snprintf(line, cap, "ENTR %d %d %d %d %d %d\n", wx, wy, f & 1, (f >> 1) & 1, (f >> 2) & 1, (f >> 3) & 1);
+}
+
+// Tiles and ENTR of a loaded map, then the facing edges of its neighbors
+static void send_map_to(int clientIdx, int wx, int wy) {
+    if (clientIdx < 0 || clientIdx >= g_clientCap) return;
+    if (!clients[clientIdx].connected) return;
+    if (wx < 0 || wx >= g_worldW || wy < 0 || wy >= g_worldH) return;
+    char buf[32768]; int off = 0; char line[64];
+    for (int y = 0; y < MAP_HEIGHT; ++y) {
+        for (int x = 0; x < MAP_WIDTH; ++x) {
+            char ch = map_loaded(wx, wy)->lay->tiles[y][x];
+            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", wx, wy, x, y, ch);
+            if (n <= 0) continue;
+            if (off + n >= (int)sizeof(buf)) {
+                send_text_to_client(clientIdx, buf, off);
+                off = 0;
+            }
+            memcpy(buf + off, line, n);
+            off += n;
+        }
+    }
+    if (off > 0) send_text_to_client(clientIdx, buf, off);
+
+    // After sending tiles, also send entrance blocked/open status so clients can render border dots correctly.
+    {
+        int n = format_entr_line(line, sizeof(line), wx, wy);
+        send_text_to_client(clientIdx, line, n);
+    }
+
+    // Send neighbor edge strips so clients can color border dots for any row/col, not just center
+    // Left neighbor: its rightmost column (x = MAP_WIDTH-1)
+    if (wx > 0) {
+        int nwx = wx - 1, nwy = wy;
+        for (int y = 0; y < MAP_HEIGHT; ++y) {
+            char ch = map_layout_at(nwx, nwy)->tiles[y][MAP_WIDTH - 1];
+            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, MAP_WIDTH - 1, y, ch);
+            send_text_to_client(clientIdx, line, n);
+        }
+    }
+    // Right neighbor: its leftmost column (x = 0)
+    if (wx < g_worldW - 1) {
+        int nwx = wx + 1, nwy = wy;
+        for (int y = 0; y < MAP_HEIGHT; ++y) {
+            char ch = map_layout_at(nwx, nwy)->tiles[y][0];
+            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, 0, y, ch);
+            send_text_to_client(clientIdx, line, n);
+        }
+    }
+    // Up neighbor: its bottom row (y = MAP_HEIGHT-1)
+    if (wy > 0) {
+        int nwx = wx, nwy = wy - 1;
+        for (int x = 0; x < MAP_WIDTH; ++x) {
+            char ch = map_layout_at(nwx, nwy)->tiles[MAP_HEIGHT - 1][x];
+            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, x, MAP_HEIGHT - 1, ch);
+            send_text_to_client(clientIdx, line, n);
+        }
+    }
+    // Down neighbor: its top row (y = 0)
+    if (wy < g_worldH - 1) {
+        int nwx = wx, nwy = wy + 1;
+        for (int x = 0; x < MAP_WIDTH; ++x) {
+            char ch = map_layout_at(nwx, nwy)->tiles[0][x];
+            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, x, 0, ch);
+            send_text_to_client(clientIdx, line, n);
+        }
+    }
+}
+
+static void rebuild_spawn_candidates(void) {
+    int sx = 1, sy = 1;
+    const MapLayout *m = map_loaded(g_inst->spawnMX, g_inst->spawnMY)->lay;
+    if (m->meta.numSpawns > 0) { sx = m->meta.spawns[0].x; sy = m->meta.spawns[0].y; }
+    g_inst->numSpawnCandidates = 0;
+    if (is_open(m, sx, sy)) { g_inst->spawnCandidates[g_inst->numSpawnCandidates].x = sx; g_inst->spawnCandidates[g_inst->numSpawnCandidates].y = sy; g_inst->numSpawnCandidates++; }
+    for (int r = 1; r <= MAP_WIDTH + MAP_HEIGHT; ++r) {
+        for (int dy = -r; dy <= r; ++dy) {
+            int dxs[2] = { -r, r };
+            for (int k = 0; k < 2; ++k) {
+                int tx = sx + dxs[k]; int ty = sy + dy;
+                if (!is_open(m, tx, ty)) continue;
+                g_inst->spawnCandidates[g_inst->numSpawnCandidates].x = tx; g_inst->spawnCandidates[g_inst->numSpawnCandidates].y = ty; g_inst->numSpawnCandidates++;
+            }
+        }
+        for (int dx = -r+1; dx <= r-1; ++dx) {
+            int dys[2] = { -r, r };
+            for (int k = 0; k < 2; ++k) {
+                int tx = sx + dx; int ty = sy + dys[k];
+                if (!is_open(m, tx, ty)) continue;
+                g_inst->spawnCandidates[g_inst->numSpawnCandidates].x = tx; g_inst->spawnCandidates[g_inst->numSpawnCandidates].y = ty; g_inst->numSpawnCandidates++;
+            }
+        }
+    }
+    g_inst->spawnCandidatesDirty = 0;
+}
+
+// Single entry point for tile edits after load: keeps metadata and spawn candidates current.
+// Returns 0 if the edit could not be made (no memory for the map's own layout).
+static int map_set_tile(int wx, int wy, int x, int y, char ch) {
+    Map *m = map_loaded(wx, wy);
+    char old = m->lay->tiles[y][x];
+    if (old == ch) return 1;
+    MapLayout *l = map_layout_mut(m);
+    if (!l) return 0;
+    l->tiles[y][x] = ch;
+    l->wallDmg[y][x] = 0;
+    if (ch == '#') {
+        bb_set(l->wallRows, l->wallCols, x, y);
+        // A new wall on a reachable tile may lengthen paths
+        if (m->flowDist[y][x] != FLOW_UNREACHABLE) m->flowDirty = 1;
+    } else if (old == '#') {
+        bb_clear(l->wallRows, l->wallCols, x, y);
+        // An opened wall can only shorten paths: seed it from its best neighbor
+        uint16_t best = FLOW_UNREACHABLE;
+        if (x > 0 && m->flowDist[y][x-1] < best) best = m->flowDist[y][x-1];
+        if (x < MAP_WIDTH - 1 && m->flowDist[y][x+1] < best) best = m->flowDist[y][x+1];
+        if (y > 0 && m->flowDist[y-1][x] < best) best = m->flowDist[y-1][x];
+        if (y < MAP_HEIGHT - 1 && m->flowDist[y+1][x] < best) best = m->flowDist[y+1][x];
+        if (best != FLOW_UNREACHABLE) flow_lower(m, x, y, (uint16_t)(best + 1));
+    }
+    MapMeta *mm = &l->meta;
+    mm->numOpen += (old == '#') - (ch == '#');
+    Vec2 *list; int *count;
+    int rebuilt = 0;
+    if (map_meta_list_for(mm, old, &list, &count)) {
+        if (*count > MAP_META_MAX_MARKS) {
+            map_meta_rebuild(l); // list was truncated; rescan to refill (counts ch too)
+            rebuilt = 1;
+        } else {
+            int k = 0; while (k < *count && !(list[k].x == x && list[k].y == y)) k++;
+            if (k < *count) { memmove(&list[k], &list[k + 1], (size_t)(*count - k - 1) * sizeof(Vec2)); (*count)--; }
+        }
+    }
+    if (!rebuilt && map_meta_list_for(mm, ch, &list, &count)) {
+        if (*count < MAP_META_MAX_MARKS) {
+            int k = *count; while (k > 0 && (list[k-1].y > y || (list[k-1].y == y && list[k-1].x > x))) { list[k] = list[k-1]; k--; }
+            list[k].x = x; list[k].y = y;
+        }
+        (*count)++;
+    }
+    if (wx == g_inst->spawnMX && wy == g_inst->spawnMY) g_inst->spawnCandidatesDirty = 1;
+    map_entr_tile_changed(wx, wy, x, y);
+    region_tile_changed(wx, wy, x, y, ch);
+    return 1;
+}
+
+// Returns the new enemy's index, or -1 if the tile is taken
+static int enemy_spawn(Map *m, int x, int y, int hp) {
+    MapEnemies *me = &m->enemies;
+    if (m->enemyAt[y][x] >= 0 || me->count >= MAX_MAP_ENEMIES) return -1;
+    int i = me->count++;
+    me->x[i] = (int16_t)x; me->y[i] = (int16_t)y; me->hp[i] = (int8_t)hp;
+    if (++me->nextId == 0) me->nextId = 1;
+    me->id[i] = me->nextId;
+    m->enemyAt[y][x] = (int16_t)i;
+    bb_set(m->enemyRows, m->enemyCols, x, y);
+    return i;
+}
+
+static void enemy_despawn(Map *m, int i) {
+    MapEnemies *me = &m->enemies;
+    m->enemyAt[me->y[i]][me->x[i]] = -1;
+    bb_clear(m->enemyRows, m->enemyCols, me->x[i], me->y[i]);
+    int last = --me->count;
+    if (i != last) {
+        me->x[i] = me->x[last]; me->y[i] = me->y[last]; me->hp[i] = me->hp[last]; me->id[i] = me->id[last];
+        m->enemyAt[me->y[i]][me->x[i]] = (int16_t)i;
+    }
+}
+
+static void enemy_move(Map *m, int i, int nx, int ny) {
+    MapEnemies *me = &m->enemies;
+    m->enemyAt[me->y[i]][me->x[i]] = -1;
+    bb_clear(m->enemyRows, m->enemyCols, me->x[i], me->y[i]);
+    me->x[i] = (int16_t)nx; me->y[i] = (int16_t)ny;
+    m->enemyAt[ny][nx] = (int16_t)i;
+    bb_set(m->enemyRows, m->enemyCols, nx, ny);
+}
+
+static void spawn_enemies_for_map(int mx, int my, int count) {
+    Map *m = map_loaded(mx, my);
+    m->enemies.count = 0;
+    memset(m->enemyAt, 0xff, sizeof(m->enemyAt));
+    memset(m->enemyRows, 0, sizeof(m->enemyRows));
+    memset(m->enemyCols, 0, sizeof(m->enemyCols));
+    if (map_has_spawn(mx, my)) return;
+
+    // Collect all open tiles on this map
+    Vec2 candidates[MAP_HEIGHT * MAP_WIDTH];
+    int numCandidates = 0;
+    for (int y = 0; y < MAP_HEIGHT; ++y) {
+        for (int x = 0; x < MAP_WIDTH; ++x) {
+            if (is_open(m->lay, x, y)) {
+                candidates[numCandidates].x = x;
+                candidates[numCandidates].y = y;
+                numCandidates++;
+            }
+        }
+    }
+
+    if (numCandidates == 0) return;
+
+    // Cap the number of enemies by available open tiles
+    if (count > numCandidates) count = numCandidates;
+
+    // Shuffle candidates (Fisher–Yates)
+    for (int i = numCandidates - 1; i > 0; --i) {
+        int j = (int)rng_below(&m->rng, (uint32_t)(i + 1));
+        Vec2 tmp = candidates[i];
+        candidates[i] = candidates[j];
+        candidates[j] = tmp;
+    }
+
+    for (int i = 0; i < count; ++i) enemy_spawn(m, candidates[i].x, candidates[i].y, 2);
+}
+
+// Map (wx,wy) of g_inst, loaded on first use: its state over the template, its entrance flags
+// and, on this region's columns, its enemies. Spectators got every map loaded when they
+// subscribed, so they get this one now. Serial code only. NULL when out of memory.
+static Map *map_get(int wx, int wy) {
+    Map **slot = &g_inst->maps[wy * g_worldW + wx];
+    if (*slot) return *slot;
+    Map *m = map_template(wx, wy) != &g_wallLayout ? (Map*)calloc(1, sizeof(Map)) : NULL;
+    if (!m) return NULL;
+    *slot = m;
+    m->loadedSlot = g_inst->numLoaded;
+    g_inst->loadedMaps[g_inst->numLoaded++] = wy * g_worldW + wx;
+    map_init(wx, wy);
+    map_refresh_entr(wx, wy);
+    if (region_owns(wx)) spawn_enemies_for_map(wx, wy, 4);
+    for (int ci = g_inst->spectatorHead; ci >= 0; ci = clients[ci].instNext) send_map_to(ci, wx, wy);
+    // Entering a neighbor reads the templates around it (map_refresh_entr); get them ready while
+    // the player walks over
+    static const int ring[8][2] = { { -2, 0 }, { 2, 0 }, { 0, -2 }, { 0, 2 }, { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 } };
+    for (int i = 0; i < 8; ++i) template_prefetch(wx + ring[i][0], wy + ring[i][1]);
+    return m;
+}
+
+// Drop loaded maps that a fresh load would bring back unchanged and nobody has been on for
+// MAP_EVICT_TICKS: no residents, bullets, edits (own layout) or kills. The spawn map stays, as
+// every join lands there. MAP_EVICT_SCAN maps per call, round robin.
+static void map_evict_idle(Instance *in) {
+    for (int n = 0; n < MAP_EVICT_SCAN && in->numLoaded > 0; ++n) {
+        if (in->evictCursor >= in->numLoaded) in->evictCursor = 0;
+        int k = in->loadedMaps[in->evictCursor];
+        Map *m = in->maps[k];
+        if (m->numResidents > 0 || m->numBullets > 0 || m->own || m->killed || m->entrPending || k == in->spawnMY * g_worldW + in->spawnMX ||
+            g_tick_counter - m->vacatedTick < MAP_EVICT_TICKS) {
+            in->evictCursor++;
+            continue;
+        }
+        // Swap-remove; the map moved into this slot is looked at next
+        int last = in->loadedMaps[--in->numLoaded];
+        in->loadedMaps[m->loadedSlot] = last;
+        in->maps[last]->loadedSlot = m->loadedSlot;
+        in->maps[k] = NULL;
+        free(m->events.ev);
+        free(m);
+    }
+}
+
+#define BULLET_GROW(field) do { void *np_ = realloc(bp->field, (size_t)ncap * sizeof(*bp->field)); if (!np_) return 0; bp->field = np_; } while (0)
+static int bullet_pool_grow(void) {
+    BulletPool *bp = &g_inst->bullets;
+    if (bp->cap >= BULLET_POOL_MAX) return 0;
+    int ncap = bp->cap ? bp->cap * 2 : BULLET_POOL_INITIAL;
+    if (ncap > BULLET_POOL_MAX) ncap = BULLET_POOL_MAX;
+    // On failure the arrays already grown stay valid; cap only moves once all succeed
+    BULLET_GROW(active); BULLET_GROW(x); BULLET_GROW(y); BULLET_GROW(dx); BULLET_GROW(dy);
+    BULLET_GROW(dir); BULLET_GROW(owner); BULLET_GROW(map); BULLET_GROW(next); BULLET_GROW(prev);
+    BULLET_GROW(adv); BULLET_GROW(hit); BULLET_GROW(freeStack);
+    memset(bp->active + bp->cap, 0, (size_t)(ncap - bp->cap));
+    bp->cap = ncap;
+    return 1;
+}
+#undef BULLET_GROW
+
+// Returns the new bullet slot, or -1 if the pool is exhausted
+static int bullet_alloc(int wx, int wy, Vec2 pos, Direction dir, ClientRef owner) {
+    BulletPool *bp = &g_inst->bullets;
+    int b;
+    if (bp->numFree > 0) b = bp->freeStack[--bp->numFree];
+    else if (bp->high < bp->cap || bullet_pool_grow()) b = bp->high++;
+    else return -1;
+    bp->active[b] = 1;
+    bp->x[b] = (int16_t)pos.x; bp->y[b] = (int16_t)pos.y;
+    bp->dx[b] = (int8_t)(dir == DIR_LEFT ? -1 : dir == DIR_RIGHT ? 1 : 0);
+    bp->dy[b] = (int8_t)(dir == DIR_UP ? -1 : dir == DIR_DOWN ? 1 : 0);
+    bp->dir[b] = (unsigned char)dir;
+    bp->owner[b] = owner;
+    bp->map[b] = wy * g_worldW + wx;
+    bp->adv[b] = 0; bp->hit[b] = 0;
+    Map *m = map_loaded(wx, wy);
+    bp->prev[b] = -1;
+    bp->next[b] = m->bulletHead;
+    if (m->bulletHead >= 0) bp->prev[m->bulletHead] = b;
+    m->bulletHead = b;
+    m->numBullets++;
+    bp->live++;
+    return b;
+}
+
+// Take a bullet off its map. Only touches that map's list, so map jobs may call it; the slot
+// goes back to the shared free stack later through bullet_release.
+static void bullet_unlink(int b) {
+    BulletPool *bp = &g_inst->bullets;
+    Map *m = g_inst->maps[bp->map[b]];
+    if (bp->prev[b] >= 0) bp->next[bp->prev[b]] = bp->next[b]; else m->bulletHead = bp->next[b];
+    if (bp->next[b] >= 0) bp->prev[bp->next[b]] = bp->prev[b];
+    m->numBullets--;
+    bp->active[b] = 0;
+    bp->adv[b] = 0;
+}
+
+static void bullet_release(int b) {
+    BulletPool *bp = &g_inst->bullets;
+    bp->freeStack[bp->numFree++] = b;
+    bp->live--;
+}
+
+// Growable text buffer for messages whose size follows the client count (snapshots, join
+// frames). Kept across ticks, so steady state does not allocate.
+typedef struct {
+    char *data;
+    int len, cap;
+} OutBuf;
+
+static void outbuf_append(OutBuf *o, const char *s, int n) {
+    if (n <= 0) return;
+    if (o->len + n > o->cap) {
+        int ncap = o->cap ? o->cap : 4096;
+        while (ncap < o->len + n) ncap *= 2;
+        char *nd = (char*)realloc(o->data, (size_t)ncap);
+        if (!nd) return; // drop the line rather than the whole message
+        o->data = nd; o->cap = ncap;
+    }
+    memcpy(o->data + o->len, s, (size_t)n);
+    o->len += n;
+}
+
+// PLAYER line for slot i as members of g_inst see it: clients elsewhere (or gone) and
+// spectators are inactive
+static void append_player_line(OutBuf *o, int i) {
+    char line[128];
+    const Client *c = &clients[i];
+    int n = (c->connected && c->inst == g_inst && !c->spectator)
+        ? snprintf(line, sizeof(line), "PLAYER %d %d %d %d %d %d %d %d %d %d %d\n", i, c->worldX, c->worldY, c->pos.x, c->pos.y, c->color, 1, c->hp, ticks_left(c->invincibleUntil), ticks_left(c->superUntil), c->score)
+        : snprintf(line, sizeof(line), "PLAYER %d 0 0 0 0 %d 0 0 0 0 0\n", i, c->color);
+    outbuf_append(o, line, n);
+}
+
+// Full player set of g_inst after a TICK line: `TICK n ALL` tells the client that slots not listed
+// are inactive. The departed slots still get their inactive line for clients that ignore it.
+static void append_player_set(OutBuf *o) {
+    char line[32];
+    outbuf_append(o, line, snprintf(line, sizeof(line), "TICK %d ALL\n", g_tick_counter));
+    for (int i = g_inst->memberHead; i >= 0; i = clients[i].instNext) append_player_line(o, i);
+    for (int k = 0; k < g_inst->numDeparted; ++k) {
+        const Client *c = &clients[g_inst->departed[k]];
+        if (!(c->connected && c->inst == g_inst && !c->spectator)) append_player_line(o, g_inst->departed[k]);
+    }
+}
+
+// Append BULLET lines for every live bullet (owner id optional)
+static void append_bullet_lines(OutBuf *o, int withOwner) {
+    const BulletPool *bp = &g_inst->bullets;
+    char line[128];
+    for (int b = 0; b < bp->high; ++b) {
+        if (!bp->active[b]) continue;
+        int wx = bp->map[b] % g_worldW, wy = bp->map[b] / g_worldW;
+        int n = withOwner ? snprintf(line, sizeof(line), "BULLET %d %d %d %d %d %d\n", wx, wy, bp->x[b], bp->y[b], 1, client_ref_slot(bp->owner[b]))
+                          : snprintf(line, sizeof(line), "BULLET %d %d %d %d %d\n", wx, wy, bp->x[b], bp->y[b], 1);
+        outbuf_append(o, line, n);
+    }
+}
+
+// TICK, every PLAYER slot and all bullets of g_inst, for a client that just joined or changed
+// maps (or instances) so it can show everyone without waiting for the next delta snapshot
+static void send_state_frame(int ci, int withOwner) {
+    static OutBuf frame;
+    frame.len = 0;
+    append_player_set(&frame);
+    append_bullet_lines(&frame, withOwner);
+    send_text_to_client(ci, frame.data, frame.len);
+}
+
+// First spawn candidate of g_inst nobody stands on (the nearest one if all are taken)
+static Vec2 spawn_pick(void) {
+    if (g_inst->spawnCandidatesDirty) rebuild_spawn_candidates();
+    Vec2 best = { 1, 1 };
+    if (g_inst->numSpawnCandidates > 0) best = g_inst->spawnCandidates[0];
+    for (int k = 0; k < g_inst->numSpawnCandidates; ++k) {
+        Vec2 t = g_inst->spawnCandidates[k];
+        if (!map_loaded(g_inst->spawnMX, g_inst->spawnMY)->playerOcc[t.y][t.x]) { best = t; break; }
+    }
+    return best;
+}
+
+static void place_near_spawn(Client *c) {
+    Vec2 t = spawn_pick();
+    client_move((int)(c - clients), g_inst->spawnMX, g_inst->spawnMY, t.x, t.y);
+}
+
+// Map snapshot for a client that joined or changed maps, with READY after it on join. Sent at
+// once normally; on the top rung of the load ladder they queue and go out MAP_STREAMS_PER_TICK
+// per tick, so a burst of joins or transitions cannot stretch one tick.
+static void client_stream_map(int ci, int ready) {
+    if (g_load.level < LOAD_DEFER_STREAMS) {
+        send_map_to(ci, clients[ci].worldX, clients[ci].worldY);
+        if (ready) send_text_to_client(ci, "READY\n", 6);
+        return;
+    }
+    clients[ci].streamPending = 1;
+    conns[ci].streamReady |= ready;
+    g_load.deferredStreams++;
+}
+
+static int g_streamCursor = 0;
+static void drain_map_streams(void) {
+    int budget = g_load.level >= LOAD_DEFER_STREAMS ? MAP_STREAMS_PER_TICK : g_clientHigh;
+    for (int k = 0; k < g_clientHigh && budget > 0; ++k) {
+        int ci = (g_streamCursor + k) % g_clientHigh;
+        if (!clients[ci].connected || !clients[ci].streamPending) continue;
+        // Always the map the client is on now, even if it moved again while waiting
+        g_inst = clients[ci].inst;
+        send_map_to(ci, clients[ci].worldX, clients[ci].worldY);
+        if (conns[ci].streamReady) send_text_to_client(ci, "READY\n", 6);
+        clients[ci].streamPending = conns[ci].streamReady = 0;
+        g_streamCursor = ci + 1;
+        budget--;
+    }
+}
+
+// --- Instances ---
+// Seeds derive from the name, so every region builds the same world for an instance; "#0" keeps
+// the world seed so a single-lobby server plays as before. Only the spawn map is loaded here; the
+// rest load as players reach them (see map_get). Returns NULL at --instances or out of memory.
+static Instance *instance_create(const char *name) {
+    if (g_numInstances >= g_maxInstances) return NULL;
+    Instance *in = (Instance*)calloc(1, sizeof(Instance));
+    size_t numMaps = (size_t)g_worldW * (size_t)g_worldH;
+    if (in) {
+        in->maps = (Map**)calloc(numMaps, sizeof(Map*));
+        in->loadedMaps = (int*)malloc(numMaps * sizeof(int));
+        in->activeMaps = (int*)malloc(numMaps * sizeof(int));
+        in->entrPendingMaps = (int*)malloc(numMaps * sizeof(int));
+    }
+    if (!in || !in->maps || !in->loadedMaps || !in->activeMaps || !in->entrPendingMaps) {
+        if (in) { free(in->maps); free(in->loadedMaps); free(in->activeMaps); free(in->entrPendingMaps); }
+        free(in);
+        return NULL;
+    }
+    in->id = g_nextInstanceId++;
+    if (name && name[0]) snprintf(in->name, sizeof(in->name), "%s", name);
+    else snprintf(in->name, sizeof(in->name), "#%d", in->id);
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (const char *q = in->name; *q; ++q) h = (h ^ (unsigned char)*q) * 1099511628211ULL;
+    in->seed = strcmp(in->name, "#0") == 0 ? g_worldSeed : g_worldSeed ^ h;
+    in->spawnMX = g_spawnMX; in->spawnMY = g_spawnMY;
+    in->spawnCandidatesDirty = 1;
+    in->memberHead = in->spectatorHead = -1;
+    in->runSlot = -1;
+    in->idleSince = g_tick_counter;
+    Instance *prev = g_inst;
+    g_inst = in;
+    Map *spawn = map_get(in->spawnMX, in->spawnMY);
+    if (spawn) bullet_pool_grow();
+    g_inst = prev;
+    if (!spawn) {
+        free(in->maps); free(in->loadedMaps); free(in->activeMaps); free(in->entrPendingMaps); free(in);
+        return NULL;
+    }
+    g_instances[g_numInstances++] = in;
+    printf("[srv] Instance %s created (%d of %d)\n", in->name, g_numInstances, g_maxInstances);
+    fflush(stdout);
+    return in;
+}
+
+static void instance_free(Instance *in) {
+    for (int k = 0; k < in->numLoaded; ++k) {
+        Map *m = in->maps[in->loadedMaps[k]];
+        free(m->events.ev);
+        free(m->own);
+        free(m);
+    }
+    BulletPool *bp = &in->bullets;
+    free(bp->active); free(bp->x); free(bp->y); free(bp->dx); free(bp->dy); free(bp->dir); free(bp->owner);
+    free(bp->map); free(bp->next); free(bp->prev); free(bp->adv); free(bp->hit); free(bp->freeStack);
+    free(in->maps); free(in->loadedMaps); free(in->activeMaps); free(in->entrPendingMaps); free(in->departed);
+    free(in);
+}
+
+// An instance instance_create would rebuild exactly as it is: every loaded map could be evicted
+// but for its idle time (see map_evict_idle)
+static int instance_pristine(const Instance *in) {
+    for (int k = 0; k < in->numLoaded; ++k) {
+        const Map *m = in->maps[in->loadedMaps[k]];
+        if (m->numBullets > 0 || m->own || m->killed) return 0;
+    }
+    return 1;
+}
+
+// Free instances nobody (member or spectator) has been in for INSTANCE_RECLAIM_TICKS, so lobbies
+// opened by HELLO <name> do not hold --instances places for good. Instance #0 stays. With regions,
+// a neighbor may still run the instance and hand its players back here, so only a pristine one
+// goes: recreating it by name then gives the same world.
+static void instance_reclaim_idle(void) {
+    for (int k = 1; k < g_numInstances; ++k) {
+        Instance *in = g_instances[k];
+        if (in->numMembers > 0 || in->spectatorHead >= 0 || g_tick_counter - in->idleSince < INSTANCE_RECLAIM_TICKS) continue;
+        if (g_numRegions > 1 && !instance_pristine(in)) continue;
+        printf("[srv] Instance %s freed after %d s without players\n", in->name, INSTANCE_RECLAIM_TICKS / TICKS_PER_SEC);
+        fflush(stdout);
+        g_instances[k--] = g_instances[--g_numInstances];
+        instance_free(in);
+    }
+}
+
+static Instance *instance_find(const char *name) {
+    for (int k = 0; k < g_numInstances; ++k) if (strcmp(g_instances[k]->name, name) == 0) return g_instances[k];
+    return NULL;
+}
+
+// Instance for a new connection: the fullest matchmade one that still has room, so players meet
+// instead of spreading thin, or a new one once all are full
+static Instance *instance_match(void) {
+    Instance *best = NULL;
+    for (int k = 0; k < g_numInstances; ++k) {
+        Instance *in = g_instances[k];
+        if (in->name[0] != '#' || in->numMembers >= g_lobbySize) continue;
+        if (!best || in->numMembers > best->numMembers) best = in;
+    }
+    return best ? best : instance_create(NULL);
+}
+
+// Add a client to an instance's members; the first member puts the instance back on the running
+// list. The caller places it (see instance_join).
+static void instance_link(int ci, Instance *in) {
+    Client *c = &clients[ci];
+    c->inst = in;
+    c->instPrev = -1;
+    c->instNext = in->memberHead;
+    if (in->memberHead >= 0) clients[in->memberHead].instPrev = ci;
+    in->memberHead = ci;
+    if (in->numMembers++ == 0) {
+        in->runSlot = g_numRunning;
+        g_running[g_numRunning++] = in;
+    }
+    c->lastSentActive = 0;
+    g_inst = in;
+}
+
+// Join an instance near its spawn
+static void instance_join(int ci, Instance *in) {
+    instance_link(ci, in);
+    place_near_spawn(&clients[ci]);
+}
+
+// YOU <id> and WORLD <w> <h>, the first lines of a session (and of each region handoff): the
+// world's size comes from the server's maps, so clients size theirs from it
+static void send_you_line(int ci) {
+    char line[64];
+    send_text_to_client(ci, line, snprintf(line, sizeof(line), "YOU %d\nWORLD %d %d\n", ci, g_worldW, g_worldH));
+}
+
+// LOBBY name players: the instance the client is in, sent after YOU and after each HELLO <lobby>
+static void send_lobby_line(int ci) {
+    const Instance *in = clients[ci].inst;
+    char line[64];
+    send_text_to_client(ci, line, snprintf(line, sizeof(line), "LOBBY %s %d\n", in->name, in->numMembers));
+}
+
+// Lobby name from HELLO: up to INSTANCE_NAME_LEN - 1 of [A-Za-z0-9_-], or "#<id>" to pick a
+// matchmade instance. Returns the length (0 for a plain HELLO).
+static int lobby_name_parse(const char *s, char *out) {
+    while (*s == ' ') s++;
+    int n = 0, byId = (*s == '#');
+    if (byId) out[n++] = *s++;
+    for (; *s && n < INSTANCE_NAME_LEN - 1; ++s) {
+        if (byId ? !isdigit((unsigned char)*s) : !isalnum((unsigned char)*s) && *s != '_' && *s != '-') break;
+        out[n++] = *s;
+    }
+    out[n] = '\0';
+    return (n == 1 && out[0] == '#') ? 0 : n;
+}
+
+// `HELLO <lobby>`: move the client to the named instance, opening it if needed (matchmade "#n"
+// instances are only looked up). A full or unknown lobby leaves it where it is. Either way the
+// client is told which instance it is in.
+static void client_switch_instance(int ci, const char *name) {
+    Instance *from = clients[ci].inst, *to = NULL;
+    if (!from) return; // disconnected
+    // The new instance starts at its spawn, so only the region holding it switches lobbies
+    if (g_regionAccepts) {
+        to = instance_find(name);
+        if (!to && name[0] != '#') to = instance_create(name);
+    }
+    if (!to || to == from || to->numMembers >= g_lobbySize) { send_lobby_line(ci); return; }
+    instance_leave(ci);
+    // Queued inputs were meant for the old world; acknowledge them so prediction rebases
+    clients[ci].inqCount = 0;
+    clients[ci].ackSeq = conns[ci].lastSeq;
+    instance_join(ci, to);
+    send_lobby_line(ci);
+    printf("[srv] Client %d (cid=%llu) moved from instance %s to %s\n", ci, conns[ci].connId, from->name, to->name);
+    fflush(stdout);
+    // Every slot outside the new instance goes inactive on the client, then the new map
+    send_state_frame(ci, 1);
+    client_stream_map(ci, 0);
+}
+
+static void send_to_spectators(const Instance *in, const char *data, int len) {
+    for (int i = in->spectatorHead; i >= 0; i = clients[i].instNext) send_text_to_client(i, data, len);
+}
+
+// `SPECTATE <key> [lobby]`: turn the connection into a read-only subscriber of an instance (its
+// own by default) for a relay fanning the stream out to viewers (see src/relay/relay.c). A
+// spectator takes no place in the lobby, keeps no map resident and never times out. It gets
+// SPECTATING, WORLD, the state frame and every loaded map, then each snapshot, tile edit, ENTR
+// change and map loaded later (see map_get).
+static void client_spectate(int ci, const char *args) {
+    Client *c = &clients[ci];
+    char key[64] = "", name[INSTANCE_NAME_LEN];
+    int used = 0;
+    if (!c->inst) return; // disconnected
+    sscanf(args, "%63s%n", key, &used);
+    Instance *in = lobby_name_parse(args + used, name) > 0 ? instance_find(name) : c->inst;
+    if (!g_spectatorKey || strcmp(key, g_spectatorKey) != 0 || !in) {
+        printf("[srv] Client %d (cid=%llu) refused as spectator %s:%s\n", ci, conns[ci].connId, conns[ci].addr, conns[ci].port);
+        fflush(stdout);
+        send_text_to_client(ci, "DENIED\n", 7);
+        disconnect_client(ci);
+        return;
+    }
+    instance_leave(ci);
+    tw_cancel(&conns[ci].idleTimer);
+    c->inqCount = 0;
+    c->spectator = 1;
+    c->inst = in;
+    c->instPrev = -1;
+    c->instNext = in->spectatorHead;
+    if (in->spectatorHead >= 0) clients[in->spectatorHead].instPrev = ci;
+    in->spectatorHead = ci;
+    g_inst = in;
+    printf("[srv] Client %d (cid=%llu) spectating instance %s %s:%s\n", ci, conns[ci].connId, in->name, conns[ci].addr, conns[ci].port);
+    fflush(stdout);
+    char line[64];
+    send_text_to_client(ci, line, snprintf(line, sizeof(line), "SPECTATING %s\nWORLD %d %d\n", in->name, g_worldW, g_worldH));
+    send_state_frame(ci, 1);
+    for (int k = 0; k < in->numLoaded; ++k) send_map_to(ci, in->loadedMaps[k] % g_worldW, in->loadedMaps[k] / g_worldW);
+    send_text_to_client(ci, "READY\n", 6);
+}
+
+// --- Regions ---
+// A player walking across a region border is handed to the neighbor together with its socket:
+// the connection stays open, the client only gets a new YOU id and the map it walked into.
+
+static Instance *region_instance(const char *name) {
+    Instance *in = instance_find(name);
+    return in ? in : instance_create(name);
+}
+
+// Hand client ci over to the region owning (wx, wy) and free its slot here. Returns 0 if the
+// neighbor cannot be reached, or for a shared-memory or UDP client, which has no socket of its
+// own to pass on; the client then stays on this side of the border.
+static int region_handoff(int ci, int wx, int wy, int x, int y) {
+    Client *c = &clients[ci];
+    ClientConn *cc = &conns[ci];
+    if (c->isShm || c->isUdp) return 0;
+    int side = wx < g_regionX0 ? 0 : 1;
+    char line[1024];
+    int n = snprintf(line, sizeof(line), "HANDOFF %s %d %d %d %d %d %d %d %d %d %d %d %d %u %u %d %llu %s %s %d",
+                     c->inst->name, wx, wy, x, y, c->isWebSocket, c->color, (int)c->facing, c->hp,
+                     ticks_left(c->invincibleUntil), ticks_left(c->superUntil), ticks_left(c->shootReadyAt), c->score,
+                     (unsigned)c->ackSeq, (unsigned)cc->lastSeq, cc->lagTicks8, cc->connId,
+                     cc->addr[0] ? cc->addr : "?", cc->port[0] ? cc->port : "?", c->inqCount);
+    // Inputs still queued go along so the player keeps moving at the same pace
+    for (int k = 0; k < c->inqCount; ++k) {
+        const InputCmd *in = &cc->inq[(cc->inqHead + k) % INPUT_QUEUE_LEN];
+        n += snprintf(line + n, sizeof(line) - (size_t)n, " %d %d %d %u", in->dx, in->dy, in->shoot, (unsigned)in->seq);
+    }
+    n += snprintf(line + n, sizeof(line) - (size_t)n, "\n");
+    if (!region_send(side, line, n, (int)c->sock)) return 0;
+    printf("[srv] Client %d (cid=%llu) handed off via region %d to (%d,%d)\n", ci, cc->connId, g_region + (side ? 1 : -1), wx, wy);
+    fflush(stdout);
+    disconnect_client(ci); // closes this process's copy of the socket only
+    return 1;
+}
+
+// Respawn for a player who died here while the spawn map belongs to another region. This region
+// only has a copy of that map (no enemies, not stepped), so the player goes to the spawn's region
+// (neighbors pass the handoff along). A client that cannot be handed off starts over on the open
+// tile nearest the center of this region's map closest to the spawn instead.
+static void respawn_in_region(int ci) {
+    Vec2 t = spawn_pick();
+    if (region_handoff(ci, g_inst->spawnMX, g_inst->spawnMY, t.x, t.y)) return;
+    Client *c = &clients[ci];
+    int oldWX = c->worldX, oldWY = c->worldY;
+    int wx = g_inst->spawnMX < g_regionX0 ? g_regionX0 : g_regionX1 - 1, wy = g_inst->spawnMY;
+    Map *m = map_get(wx, wy);
+    if (!m) { wx = oldWX; wy = oldWY; m = map_loaded(wx, wy); }
+    int cx = MAP_WIDTH / 2, cy = MAP_HEIGHT / 2;
+    for (int r = 0; r < MAP_WIDTH; ++r) {
+        for (int y = cy - r; y <= cy + r; ++y) {
+            for (int x = cx - r; x <= cx + r; ++x) {
+                if (abs(x - cx) != r && abs(y - cy) != r) continue; // ring r only
+                if (!is_open(m->lay, x, y) || m->playerOcc[y][x] || m->enemyAt[y][x] >= 0) continue;
+                client_move(ci, wx, wy, x, y);
+                if (wx != oldWX || wy != oldWY) {
+                    send_state_frame(ci, 0);
+                    client_stream_map(ci, 0);
+                }
+                return;
+            }
+        }
+    }
+}
+
+// HANDOFF from a neighbor: take over the socket and player state at the position it walked to
+static void region_receive_handoff(const char *args, int fd, int from) {
+    char name[INSTANCE_NAME_LEN], addr[64], port[16];
+    int wx, wy, x, y, ws, color, facing, hp, inv, sup, shootIn, score, lag, nq, used = 0;
+    unsigned ack, last;
+    unsigned long long connId;
+    if (fd < 0) return;
+    int ok = sscanf(args, "%15s %d %d %d %d %d %d %d %d %d %d %d %d %u %u %d %llu %63s %15s %d%n",
+                    name, &wx, &wy, &x, &y, &ws, &color, &facing, &hp, &inv, &sup, &shootIn, &score,
+                    &ack, &last, &lag, &connId, addr, port, &nq, &used) == 20;
+    // Bound for a region further on (a respawn at a spawn two or more regions away): pass it along,
+    // never back where it came from
+    int side = ok && wx < g_regionX0 ? 0 : 1;
+    if (ok && wx >= 0 && wx < g_worldW && !region_owns(wx) && side != (from < g_region ? 0 : 1)) {
+        char line[1024];
+        int n = snprintf(line, sizeof(line), "HANDOFF %s\n", args);
+        if (n < (int)sizeof(line) && region_send(side, line, n, fd)) {
+#ifndef _WIN32
+            close(fd);
+#endif
+            printf("[srv] Handoff from region %d passed on to region %d\n", from, g_region + (side ? 1 : -1));
+            fflush(stdout);
+            return;
+        }
+    }
+    ok = ok && wy >= 0 && wy < g_worldH && region_owns(wx) && x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT;
+    int ci = ok ? client_alloc((sock_t)fd, ws != 0) : -1;
+    Instance *in = ci >= 0 ? region_instance(name) : NULL;
+    if (in) {
+        g_inst = in;
+        if (!map_get(wx, wy)) in = NULL;
+    }
+    if (!in) {
+        if (ci >= 0) clients[ci].connected = 0;
+#ifndef _WIN32
+        close(fd);
+#endif
+        printf("[srv] Handoff from region %d refused (%s)\n", from, ok ? "server full" : "malformed");
+        fflush(stdout);
+        return;
+    }
+    Client *c = &clients[ci];
+    ClientConn *cc = &conns[ci];
+    c->wsHandshakeDone = (unsigned char)(ws != 0);
+    instance_link(ci, in);
+    client_move(ci, wx, wy, x, y);
+    client_reset_player(ci);
+    c->color = color;
+    c->facing = (Direction)facing;
+    c->hp = hp;
+    c->invincibleUntil = g_tick_counter + inv;
+    c->superUntil = g_tick_counter + sup;
+    c->shootReadyAt = g_tick_counter + shootIn;
+    c->score = score;
+    c->ackSeq = ack; // ackSent stays 0: the first ACK rebases the client's prediction here
+    cc->lastSeq = last;
+    cc->lagTicks8 = lag;
+    const char *p = args + used;
+    for (int k = 0, dx, dy, shoot, m; k < nq && c->inqCount < INPUT_QUEUE_LEN; ++k, p += m) {
+        unsigned seq;
+        if (sscanf(p, " %d %d %d %u%n", &dx, &dy, &shoot, &seq, &m) != 4) break;
+        InputCmd *q = &cc->inq[(cc->inqHead + c->inqCount++) % INPUT_QUEUE_LEN];
+        q->dx = (int8_t)dx; q->dy = (int8_t)dy; q->shoot = (int8_t)shoot;
+        q->seq = seq;
+        q->viewTick = -1; // ticks of the old region mean nothing here
+        q->arrivalTick = g_tick_counter;
+    }
+    cc->connId = connId;
+    snprintf(cc->addr, sizeof(cc->addr), "%s", addr);
+    snprintf(cc->port, sizeof(cc->port), "%s", port);
+    printf("[srv] Client %d (cid=%llu) arrived from region %d, instance %s, at (%d,%d)@(%d,%d)\n", ci, connId, from, in->name, wx, wy, x, y);
+    fflush(stdout);
+    send_you_line(ci);
+    // Every slot outside this region goes inactive on the client, then the new map
+    send_state_frame(ci, 1);
+    client_stream_map(ci, 0);
+}
+
+// TILE from a neighbor: an edge tile of one of its maps changed
+static void region_receive_tile(const char *args) {
+    char name[INSTANCE_NAME_LEN], ch;
+    int wx, wy, x, y;
+    if (sscanf(args, "%15s %d %d %d %d %c", name, &wx, &wy, &x, &y, &ch) != 6) return;
+    if (wx < 0 || wx >= g_worldW || wy < 0 || wy >= g_worldH || region_owns(wx) || x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) return;
+    Instance *in = region_instance(name);
+    if (!in) return;
+    g_inst = in;
+    // The edit makes the map its own layout, so it stays loaded; out of memory it is dropped
+    if (map_get(wx, wy)) map_set_tile(wx, wy, x, y, ch);
+}
+
+// Read what a neighbor sent and act on every complete line. Returns 0 once the link is closed.
+static int region_read(int side) {
+#ifdef _WIN32
+    (void)side;
+    return 0;
+#else
+    RegionLink *l = &g_links[side];
+    if (l->len == (int)sizeof(l->buf) - 1) l->len = 0; // no line is this long; resync
+    struct iovec iov = { l->buf + l->len, sizeof(l->buf) - 1 - (size_t)l->len };
+    union { struct cmsghdr h; char b[CMSG_SPACE(sizeof(int) * 8)]; } ctl;
+    struct msghdr msg; memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov; msg.msg_iovlen = 1;
+    msg.msg_control = ctl.b; msg.msg_controllen = sizeof(ctl.b);
+    int n = (int)recvmsg(l->fd, &msg, 0);
+    if (n == 0) return 0;
+    if (n < 0) return 1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int k = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int j = 0; j < k; ++j) {
+            int fd; memcpy(&fd, CMSG_DATA(cm) + (size_t)j * sizeof(int), sizeof(int));
+            if (l->numFds < (int)(sizeof(l->fds) / sizeof(l->fds[0]))) l->fds[l->numFds++] = fd; else close(fd);
+        }
+    }
+    l->len += n;
+    l->buf[l->len] = '\0';
+    int from = g_region + (side ? 1 : -1);
+    char *p = l->buf, *eol;
+    while ((eol = strchr(p, '\n')) != NULL) {
+        *eol = '\0';
+        if (strncmp(p, "HANDOFF ", 8) == 0) {
+            int fd = -1;
+            if (l->numFds > 0) { fd = l->fds[0]; memmove(l->fds, l->fds + 1, (size_t)--l->numFds * sizeof(int)); }
+            region_receive_handoff(p + 8, fd, from);
+        } else if (strncmp(p, "TILE ", 5) == 0) {
+            region_receive_tile(p + 5);
+        }
+        p = eol + 1;
+    }
+    l->len -= (int)(p - l->buf);
+    memmove(l->buf, p, (size_t)l->len);
+    return 1;
+#endif
+}
+
+// Fork one process per region once the listeners are bound; the parent goes on as region 0.
+// Region k and k + 1 share a socket pair. Must run before any thread is started.
+static int region_start(void) {
+#ifdef _WIN32
+    fprintf(stderr, "--regions needs fork() and AF_UNIX socket pairs\n");
+    return 0;
+#else
+    int pairs[g_numRegions][2]; // pairs[k][0] belongs to region k, pairs[k][1] to region k + 1
+    for (int k = 0; k + 1 < g_numRegions; ++k) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[k]) != 0) { fprintf(stderr, "socketpair failed\n"); return 0; }
+    }
+    fflush(stdout); // nothing buffered may be printed twice
+    for (int k = 1; k < g_numRegions; ++k) {
+        pid_t pid = fork();
+        if (pid < 0) { fprintf(stderr, "fork failed\n"); return 0; }
+        if (pid == 0) { g_region = k; break; }
+    }
+    for (int k = 0; k + 1 < g_numRegions; ++k) {
+        if (k == g_region) g_links[1].fd = pairs[k][0]; else close(pairs[k][0]);
+        if (k + 1 == g_region) g_links[0].fd = pairs[k][1]; else close(pairs[k][1]);
+    }
+    g_regionX0 = g_region * g_worldW / g_numRegions;
+    g_regionX1 = (g_region + 1) * g_worldW / g_numRegions;
+    return 1;
+#endif
+}
+
+// Snapshot of g_inst for its members: PLAYER deltas of the members, inactive lines for clients
+// that left, then its bullets and enemies on occupied maps
+static void broadcast_instance(void) {
+    static OutBuf buf, ents, full; // reused every tick and instance
+    Instance *in = g_inst;
+    char line[128];
+    buf.len = ents.len = 0;
+    // Prepend a tick marker so clients can align updates
+    outbuf_append(&buf, line, snprintf(line, sizeof(line), "TICK %d\n", g_tick_counter));
+    for (int i = in->memberHead; i >= 0; i = clients[i].instNext) {
+        Client *c = &clients[i];
+        int need = 0;
+        if (!c->lastSentActive) need = 1;
+        else if (c->lastSentWorldX != c->worldX) need = 1;
+        else if (c->lastSentWorldY != c->worldY) need = 1;
+        else if (c->lastSentPosX != c->pos.x) need = 1;
+        else if (c->lastSentPosY != c->pos.y) need = 1;
+        else if (c->lastSentHp != c->hp) need = 1;
+        else if (c->lastSentInv != ticks_left(c->invincibleUntil)) need = 1;
+        else if (c->lastSentSup != ticks_left(c->superUntil)) need = 1;
+        else if (c->lastSentScore != c->score) need = 1;
+        else if (c->lastSentColor != c->color) need = 1;
+        if (need) {
+            append_player_line(&buf, i);
+            c->lastSentActive = 1;
+            c->lastSentWorldX = c->worldX;
+            c->lastSentWorldY = c->worldY;
+            c->lastSentPosX = c->pos.x;
+            c->lastSentPosY = c->pos.y;
+            c->lastSentHp = c->hp;
+            c->lastSentInv = ticks_left(c->invincibleUntil);
+            c->lastSentSup = ticks_left(c->superUntil);
+            c->lastSentScore = c->score;
+            c->lastSentColor = c->color;
+        }
+    }
+    // Slots that left (a slot taken again by a new member already got its real line above)
+    for (int k = in->departedNew; k < in->numDeparted; ++k) {
+        int i = in->departed[k];
+        if (!(clients[i].connected && clients[i].inst == in && !clients[i].spectator)) append_player_line(&buf, i);
+    }
+    // Bullets and enemies are kept apart so the full snapshot below can reuse them
+    // broadcast bullets (include owner id), only on maps that currently have players
+    for (int a = 0; a < in->numActiveMaps; ++a) {
+        int wx = in->activeMaps[a] % g_worldW, wy = in->activeMaps[a] / g_worldW;
+        for (int b = in->maps[in->activeMaps[a]]->bulletHead; b >= 0; b = in->bullets.next[b]) {
+            int n = snprintf(line, sizeof(line), "BULLET %d %d %d %d %d %d\n", wx, wy, in->bullets.x[b], in->bullets.y[b], 1, client_ref_slot(in->bullets.owner[b]));
+            outbuf_append(&ents, line, n);
+        }
+    }
+    // broadcast enemies (only maps with active players)
+    for (int a = 0; a < in->numActiveMaps; ++a) {
+        int wx = in->activeMaps[a] % g_worldW, wy = in->activeMaps[a] / g_worldW;
+        const MapEnemies *me = &in->maps[in->activeMaps[a]]->enemies;
+        for (int i = 0; i < me->count; ++i) {
+            int n = snprintf(line, sizeof(line), "ENEMY %d %d %d %d %d\n", wx, wy, me->x[i], me->y[i], me->hp[i]);
+            outbuf_append(&ents, line, n);
+        }
+    }
+    outbuf_append(&buf, ents.data, ents.len);
+    // While thinning, idle clients only get every SNAPSHOT_THIN_EVERY-th snapshot (staggered by
+    // slot). The delta PLAYER lines they missed are replaced by a full set in the next one.
+    int thin = g_load.level >= LOAD_THIN_SNAPSHOTS;
+    time_t now = time(NULL);
+    int fullBuilt = 0, waiting = 0;
+    for (int i = in->memberHead; i >= 0; i = clients[i].instNext) {
+        Client *c = &clients[i];
+        if (thin && now - c->lastActive >= SNAPSHOT_IDLE_SEC && (g_tick_counter + i) % SNAPSHOT_THIN_EVERY != 0) {
+            c->snapSkipped = 1;
+            g_load.thinnedSnapshots++;
+            waiting = 1;
+            continue;
+        }
+        const OutBuf *out = &buf;
+        // UDP snapshots may be lost, so each carries the whole player set and stands on its own
+        if (c->snapSkipped || c->isUdp) {
+            if (!fullBuilt) {
+                full.len = 0;
+                append_player_set(&full);
+                outbuf_append(&full, ents.data, ents.len);
+                fullBuilt = 1;
+            }
+            out = &full;
+            c->snapSkipped = 0;
+        }
+        if (c->isWebSocket) ws_send_text_frame(c->sock, out->data, out->len);
+        else if (c->isUdp) udp_send_unreliable(conns[i].udp, (uint32_t)g_tick_counter, out->data, out->len, udp_send_datagram, &conns[i]);
+#ifdef SHM_TRANSPORT
+        else if (c->isShm) shm_client_send(i, out->data, out->len);
+#endif
+        else send(c->sock, out->data, out->len, 0);
+    }
+    // Spectators are never thinned: a relay serves viewers in every state
+    send_to_spectators(in, buf.data, buf.len);
+    // Thinned members learn of these departures in their next full snapshot
+    if (!waiting) in->numDeparted = 0;
+    in->departedNew = in->numDeparted;
+    // Entrance flags changed since the last tick: residents of the affected maps and spectators
+    // need them, whether or not anyone is on the map
+    for (int a = 0; a < in->numEntrPending; ++a) {
+        int wx = in->entrPendingMaps[a] % g_worldW, wy = in->entrPendingMaps[a] / g_worldW;
+        Map *m = in->maps[in->entrPendingMaps[a]];
+        m->entrPending = 0;
+        int n = format_entr_line(line, sizeof(line), wx, wy);
+        for (int ci = m->residentHead; ci >= 0; ci = clients[ci].mapNext) send_text_to_client(ci, line, n);
+        send_to_spectators(in, line, n);
+    }
+    in->numEntrPending = 0;
+}
+
+// Parked instances have no members and send nothing
+static void broadcast_state(void) {
+    for (int r = 0; r < g_numRunning; ++r) {
+        g_inst = g_running[r];
+        broadcast_instance();
+    }
+    // Clients that left have now been reported to their old instance; trailing free slots no
+    // longer need to be visited
+    while (g_clientHigh > 0 && !clients[g_clientHigh - 1].connected) g_clientHigh--;
+}
+
+// TILE edit on a map of g_inst, for its members and spectators
+static void broadcast_tile(int wx, int wy, int x, int y, char ch) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", wx, wy, x, y, ch);
+    for (int i = g_inst->memberHead; i >= 0; i = clients[i].instNext) send_text_to_client(i, line, n);
+    send_to_spectators(g_inst, line, n);
+}
+
+// Trace up to `cells` tiles from (x,y) along dir through the map's wall, enemy and player
+// bitboards. Returns the distance (1..cells) to the first blocking tile, or 0 if none is in
+// reach; *reach receives how many of the `cells` tiles lie inside the map.
+static int bullet_ray(const Map *m, int x, int y, Direction dir, int cells, int *reach) {
+    uint64_t line, window;
+    int r;
+    switch (dir) {
+    case DIR_RIGHT:
+        r = MAP_WIDTH - 1 - x; if (r > cells) r = cells; *reach = r;
+        if (r <= 0) return 0;
+        line = m->lay->wallRows[y] | m->enemyRows[y] | m->playerRows[y];
+        window = (line >> (x + 1)) & ((1ULL << r) - 1);
+        return window ? bit_lowest(window) + 1 : 0;
+    case DIR_LEFT:
+        r = x; if (r > cells) r = cells; *reach = r;
+        if (r <= 0) return 0;
+        line = m->lay->wallRows[y] | m->enemyRows[y] | m->playerRows[y];
+        window = (line >> (x - r)) & ((1ULL << r) - 1);
+        return window ? r - bit_highest(window) : 0;
+    case DIR_DOWN:
+        r = MAP_HEIGHT - 1 - y; if (r > cells) r = cells; *reach = r;
+        if (r <= 0) return 0;
+        line = (uint64_t)(m->lay->wallCols[x] | m->enemyCols[x] | m->playerCols[x]);
+        window = (line >> (y + 1)) & ((1ULL << r) - 1);
+        return window ? bit_lowest(window) + 1 : 0;
+    case DIR_UP:
+        r = y; if (r > cells) r = cells; *reach = r;
+        if (r <= 0) return 0;
+        line = (uint64_t)(m->lay->wallCols[x] | m->enemyCols[x] | m->playerCols[x]);
+        window = (line >> (y - r)) & ((1ULL << r) - 1);
+        return window ? r - bit_highest(window) : 0;
+    }
+    *reach = 0;
+    return 0;
+}
+
+static void sim_event(Map *m, int type, int x, int y, int a, int b) {
+    SimEventList *el = &m->events;
+    if (el->count == el->cap) {
+        int ncap = el->cap ? el->cap * 2 : 64;
+        SimEvent *nev = (SimEvent*)realloc(el->ev, (size_t)ncap * sizeof(SimEvent));
+        if (!nev) {
+            // Out of memory: other effects are lost, but an unlinked bullet must still reach the
+            // free stack. Its own next link is unused now, so it chains the slot to the merge.
+            if (type == EV_FREE_BULLET) { g_inst->bullets.next[a] = m->unstoredFree; m->unstoredFree = a; }
+            return;
+        }
+        el->ev = nev; el->cap = ncap;
+    }
+    SimEvent *e = &el->ev[el->count++];
+    e->type = (unsigned char)type; e->x = (int16_t)x; e->y = (int16_t)y; e->a = a; e->b = b;
+}
+
+// Trace and advance bullet slots [lo, hi) against their maps' bitboards. Maps are not modified
+// while this runs, so disjoint ranges can go to different workers.
+static void bullets_trace_range(int lo, int hi) {
+    BulletPool *bp = &g_inst->bullets;
+    for (int i = lo; i < hi; ++i) {
+        if (!bp->active[i]) continue;
+        const Map *m = g_inst->maps[bp->map[i]];
+        int reach = 0;
+        int hit = bullet_ray(m, bp->x[i], bp->y[i], (Direction)bp->dir[i], BULLET_CELLS_PER_STEP, &reach);
+        bp->hit[i] = hit ? 1 : 0;
+        bp->adv[i] = (unsigned char)(hit ? hit : reach);
+    }
+    // Advance; adv is 0 for free slots, so this stays a straight vectorizable loop
+    for (int i = lo; i < hi; ++i) {
+        bp->x[i] = (int16_t)(bp->x[i] + bp->dx[i] * bp->adv[i]);
+        bp->y[i] = (int16_t)(bp->y[i] + bp->dy[i] * bp->adv[i]);
+    }
+}
+
+// One bullet hit on enemy ei; returns 1 if it died (and was despawned)
+static int enemy_take_hit(Map *m, int ei) {
+    if (m->enemies.hp[ei] > 0) m->enemies.hp[ei]--;
+    if (m->enemies.hp[ei] > 0) return 0;
+    enemy_despawn(m, ei);
+    m->killed = 1;
+    return 1;
+}
+
+// Resolve map exits and hits for one map's traced bullets, keeping the old priority: enemy,
+// then player, then wall. Anything reaching beyond this map is recorded as an event.
+static void bullets_resolve_map(int wx, int wy) {
+    BulletPool *bp = &g_inst->bullets;
+    Map *m = map_loaded(wx, wy);
+    int next;
+    for (int i = m->bulletHead; i >= 0; i = next) {
+        next = bp->next[i];
+        if (!bp->hit[i]) {
+            // Clear path; the map edge came first if the bullet fell short
+            if (bp->adv[i] < BULLET_CELLS_PER_STEP) { bullet_unlink(i); sim_event(m, EV_FREE_BULLET, 0, 0, i, 0); }
+            continue;
+        }
+        int nx = bp->x[i], ny = bp->y[i];
+        int owner = client_from_ref(bp->owner[i]); // -1 once the shooter left this instance
+        // Enemy hit
+        int ei = m->enemyAt[ny][nx];
+        if (ei >= 0) {
+            bullet_unlink(i); sim_event(m, EV_FREE_BULLET, 0, 0, i, 0);
+            if (enemy_take_hit(m, ei)) sim_event(m, EV_SCORE, 0, 0, owner, 1);
+            continue;
+        }
+        // Player hit (PvP)
+        int ci = map_client_at(wx, wy, nx, ny);
+        if (ci >= 0) {
+            bullet_unlink(i); sim_event(m, EV_FREE_BULLET, 0, 0, i, 0);
+            if (!map_has_spawn(wx, wy)) sim_event(m, EV_HIT_PLAYER, nx, ny, ci, owner);
+            continue;
+        }
+        // Wall hit
+        if (m->lay->tiles[ny][nx] == '#') {
+            bullet_unlink(i); sim_event(m, EV_FREE_BULLET, 0, 0, i, 0);
+            if (m->lay->wallDmg[ny][nx] >= 4) sim_event(m, EV_BREAK_WALL, nx, ny, 0, 0);
+            else { MapLayout *l = map_layout_mut(m); if (l) l->wallDmg[ny][nx]++; }
+        }
+        // Otherwise an earlier bullet already cleared the obstacle this step; keep flying
+    }
+}
+
+// One random step for enemy i (blocked moves are skipped)
+static void enemy_wander(Map *m, int i) {
+    MapEnemies *me = &m->enemies;
+    int dir = (int)rng_below(&m->rng, 4);
+    int dx = 0, dy = 0;
+    switch (dir) { case 0: dy = -1; break; case 1: dy = 1; break; case 2: dx = -1; break; case 3: dx = 1; break; }
+    int nx = me->x[i] + dx;
+    int ny = me->y[i] + dy;
+    if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT) return;
+    if (!is_open(m->lay, nx, ny)) return;
+    if (m->enemyAt[ny][nx] >= 0) return;
+    enemy_move(m, i, nx, ny);
+}
+
+// Replay the enemy steps a map missed while nobody was there (random walk, nobody to chase),
+// at most ENEMY_CATCHUP_MAX_STEPS per call so one batch stays cheap
+static void enemies_catch_up(Map *m) {
+    int missed = (g_tick_counter - m->enemyTick) / ENEMY_STEP_TICKS;
+    if (missed > ENEMY_CATCHUP_MAX_STEPS) missed = ENEMY_CATCHUP_MAX_STEPS;
+    for (int s = 0; s < missed; ++s)
+        for (int i = 0; i < m->enemies.count; ++i) enemy_wander(m, i);
+    m->enemyTick = g_tick_counter;
+}
+
+// Move every enemy on one map one step down the shared flow field toward the nearest player
+// (ties broken randomly). Enemies that cannot reach a player wander randomly.
+static void step_enemies_map(int wx, int wy) {
+    static const int ddx[4] = { 0, 0, -1, 1 }, ddy[4] = { -1, 1, 0, 0 };
+    Map *m = map_loaded(wx, wy);
+    MapEnemies *me = &m->enemies;
+    if (me->count == 0) return;
+    if (m->flowDirty) flow_rebuild(m);
+    for (int i = 0; i < me->count; ++i) {
+        uint16_t here = m->flowDist[me->y[i]][me->x[i]];
+        if (here == 0) continue; // already on a player
+        if (here != FLOW_UNREACHABLE) {
+            int start = (int)rng_below(&m->rng, 4), bx = -1, by = -1;
+            uint16_t best = here;
+            for (int k = 0; k < 4; ++k) {
+                int d = (start + k) & 3;
+                int nx = me->x[i] + ddx[d], ny = me->y[i] + ddy[d];
+                if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT) continue;
+                if (m->flowDist[ny][nx] >= best || m->enemyAt[ny][nx] >= 0) continue;
+                best = m->flowDist[ny][nx]; bx = nx; by = ny;
+            }
+            if (bx >= 0) enemy_move(m, i, bx, by);
+            continue;
+        }
+        enemy_wander(m, i);
+    }
+}
+
+// Residents standing on an enemy or on a pickup; the effects are applied in the merge
+static void residents_touch_map(int wx, int wy) {
+    Map *m = map_loaded(wx, wy);
+    // Skip damage on spawn map
+    int hurt = !map_has_spawn(wx, wy);
+    for (int ci = m->residentHead; ci >= 0; ci = clients[ci].mapNext) {
+        int x = clients[ci].pos.x, y = clients[ci].pos.y;
+        // at most one enemy per tile
+        if (hurt && m->enemyAt[y][x] >= 0) sim_event(m, EV_CONTACT, x, y, ci, 0);
+        if (m->lay->meta.numPickups > 0 && m->lay->tiles[y][x] == 'X') sim_event(m, EV_PICKUP, x, y, ci, 0);
+    }
+}
+
+static void damage_client(int ci, int killer, int killScore) {
+    if (ticks_left(clients[ci].invincibleUntil) > 0 || clients[ci].hp <= 0) return;
+    clients[ci].hp--;
+    clients[ci].invincibleUntil = g_tick_counter + 60; // ~3s at 50ms tick
+    if (clients[ci].hp <= 0) {
+        if (killer >= 0 && killer < g_clientCap && clients[killer].connected) clients[killer].score += killScore;
+        clients[ci].hp = 3;
+        clients[ci].superUntil = 0;
+        clients[ci].shootReadyAt = 0;
+        clients[ci].invincibleUntil = g_tick_counter + 60;
+        // Last: a handoff frees the slot
+        if (region_owns(g_inst->spawnMX)) place_near_spawn(&clients[ci]);
+        else respawn_in_region(ci);
+    }
+}
+
+// Serial merge: apply one map's recorded events in order, then clear them
+static void apply_map_events(int wx, int wy) {
+    Map *m = map_loaded(wx, wy);
+    for (int k = 0; k < m->events.count; ++k) {
+        const SimEvent *e = &m->events.ev[k];
+        Client *c = (e->type != EV_FREE_BULLET && e->a >= 0 && e->a < g_clientCap) ? &clients[e->a] : NULL;
+        // Contact and pickup only count if an earlier event did not move the client away
+        int stillHere = c && c->connected && c->worldX == wx && c->worldY == wy && c->pos.x == e->x && c->pos.y == e->y;
+        switch (e->type) {
+        case EV_FREE_BULLET: bullet_release(e->a); break;
+        case EV_SCORE: if (c && c->connected) c->score += e->b; break;
+        case EV_HIT_PLAYER: if (stillHere) damage_client(e->a, e->b, 10); break;
+        case EV_CONTACT: if (stillHere) damage_client(e->a, -1, 0); break;
+        case EV_PICKUP:
+            if (stillHere && m->lay->tiles[e->y][e->x] == 'X') {
+                if (c->hp < 3) c->hp = 3;
+                c->superUntil = g_tick_counter + 100; // 5s at 20 ticks/sec
+                c->invincibleUntil = g_tick_counter + 60; // 3s at 20 ticks/sec
+                if (map_set_tile(wx, wy, e->x, e->y, '.')) broadcast_tile(wx, wy, e->x, e->y, '.');
+            }
+            break;
+        case EV_BREAK_WALL:
+            if (m->lay->tiles[e->y][e->x] == '#') {
+                if (map_set_tile(wx, wy, e->x, e->y, '.')) broadcast_tile(wx, wy, e->x, e->y, '.');
+            }
+            break;
+        }
+    }
+    m->events.count = 0;
+    while (m->unstoredFree >= 0) {
+        int b = m->unstoredFree;
+        m->unstoredFree = g_inst->bullets.next[b];
+        bullet_release(b);
+    }
+}
+
+// --- Simulation worker pool ---
+// A parallel section publishes a job count; the main thread and the workers claim job indices
+// from a shared atomic counter until none are left, so a worker that finishes a light map
+// immediately takes the next one.
+typedef void (*SimJobFn)(int job);
+static int g_simWorkers = 1; // threads stepping maps, including the main thread
+#ifdef SIM_THREADS
+static pthread_mutex_t g_simLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_simWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_simDone = PTHREAD_COND_INITIALIZER;
+static SimJobFn g_simFn;
+static int g_simJobs, g_simNext, g_simBusy;
+static unsigned g_simGeneration;
+
+static void sim_drain(SimJobFn fn, int jobs) {
+    for (;;) {
+        int j = __atomic_fetch_add(&g_simNext, 1, __ATOMIC_RELAXED);
+        if (j >= jobs) break;
+        fn(j);
+    }
+}
+
+static void *sim_worker(void *arg) {
+    (void)arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&g_simLock);
+    for (;;) {
+        while (g_simGeneration == seen) pthread_cond_wait(&g_simWake, &g_simLock);
+        seen = g_simGeneration;
+        SimJobFn fn = g_simFn; int jobs = g_simJobs;
+        pthread_mutex_unlock(&g_simLock);
+        sim_drain(fn, jobs);
+        pthread_mutex_lock(&g_simLock);
+        if (--g_simBusy == 0) pthread_cond_signal(&g_simDone);
+    }
+    return NULL;
+}
+#endif
+
+// Start workers - 1 helper threads (clamped to SIM_MAX_WORKERS); stays serial if unsupported
+static void sim_start(int workers) {
+    if (workers > SIM_MAX_WORKERS) workers = SIM_MAX_WORKERS;
+    g_simWorkers = 1;
+#ifdef SIM_THREADS
+    for (int t = 1; t < workers; ++t) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, sim_worker, NULL) != 0) break;
+        pthread_detach(th);
+        g_simWorkers++;
+    }
+#else
+    (void)workers;
+#endif
+}
+
+// Run fn(0..jobs-1) across the pool and return once every job has finished
+static void sim_parallel_for(SimJobFn fn, int jobs) {
+#ifdef SIM_THREADS
+    if (g_simWorkers > 1 && jobs > 1) {
+        pthread_mutex_lock(&g_simLock);
+        g_simFn = fn; g_simJobs = jobs; g_simNext = 0;
+        g_simBusy = g_simWorkers - 1;
+        g_simGeneration++;
+        pthread_cond_broadcast(&g_simWake);
+        pthread_mutex_unlock(&g_simLock);
+        sim_drain(fn, jobs);
+        pthread_mutex_lock(&g_simLock);
+        while (g_simBusy > 0) pthread_cond_wait(&g_simDone, &g_simLock);
+        pthread_mutex_unlock(&g_simLock);
+        return;
+    }
+#endif
+    for (int j = 0; j < jobs; ++j) fn(j);
+}
+
+// One tick's parallel work across the running instances: each job is a loaded map (packed as
+// wy * g_worldW + wx) or a bullet slot chunk of one instance. Map jobs are listed instance by
+// instance in loadedMaps order, which only changes in serial code, so the merge applies events
+// deterministically.
+typedef struct {
+    Instance *inst;
+    int k;
+} SimJob;
+typedef struct {
+    SimJob *jobs;
+    int count, cap;
+} SimJobList;
+static SimJobList g_simMapJobs, g_simChunkJobs;
+static int g_simBulletsDue = 0, g_simEnemiesDue = 0;
+
+static void sim_job_push(SimJobList *l, Instance *in, int k) {
+    if (l->count == l->cap) {
+        int ncap = l->cap ? l->cap * 2 : 256;
+        SimJob *nj = (SimJob*)realloc(l->jobs, (size_t)ncap * sizeof(SimJob));
+        if (!nj) return; // the work waits for the next tick
+        l->jobs = nj; l->cap = ncap;
+    }
+    l->jobs[l->count].inst = in;
+    l->jobs[l->count].k = k;
+    l->count++;
+}
+
+static void sim_bullet_chunk_job(int j) {
+    g_inst = g_simChunkJobs.jobs[j].inst;
+    int lo = g_simChunkJobs.jobs[j].k * SIM_BULLET_CHUNK, hi = lo + SIM_BULLET_CHUNK;
+    if (hi > g_inst->bullets.high) hi = g_inst->bullets.high;
+    bullets_trace_range(lo, hi);
+}
+
+static void sim_map_job(int j) {
+    g_inst = g_simMapJobs.jobs[j].inst;
+    int wx = g_simMapJobs.jobs[j].k % g_worldW, wy = g_simMapJobs.jobs[j].k / g_worldW;
+    Map *m = map_loaded(wx, wy);
+    if (g_simBulletsDue && m->bulletHead >= 0) bullets_resolve_map(wx, wy);
+    if (m->idleDue) { m->idleDue = 0; enemies_catch_up(m); }
+    if (m->numResidents == 0) return; // full-rate simulation only on maps with players
+    if (g_simEnemiesDue) {
+        // First step after players arrive: replay what the map missed since its last step
+        if (g_tick_counter - m->enemyTick > ENEMY_STEP_TICKS) { m->enemyTick += ENEMY_STEP_TICKS; enemies_catch_up(m); }
+        step_enemies_map(wx, wy);
+        m->enemyTick = g_tick_counter;
+    }
+    residents_touch_map(wx, wy);
+}
+
+// --- Lag compensation ---
+// Occupied maps record their enemies and players at the end of every tick. A shot is then traced
+// through the frames of the ticks between the shooter's view and now (see bullet_rewind).
+static void map_record_frame(int wx, int wy) {
+    Map *m = map_loaded(wx, wy);
+    MapFrame *f = &m->frames[g_tick_counter % REWIND_MAX_TICKS];
+    f->tick = g_tick_counter;
+    memset(f->enemyIdAt, 0, sizeof(f->enemyIdAt));
+    memset(f->playerAt, 0, sizeof(f->playerAt));
+    for (int i = 0; i < m->enemies.count; ++i) f->enemyIdAt[m->enemies.y[i]][m->enemies.x[i]] = m->enemies.id[i];
+    for (int ci = m->residentHead; ci >= 0; ci = clients[ci].mapNext) f->playerAt[clients[ci].pos.y][clients[ci].pos.x] = client_ref(ci);
+}
+
+static int enemy_find(const Map *m, uint16_t id) {
+    for (int i = 0; i < m->enemies.count; ++i) if (m->enemies.id[i] == id) return i;
+    return -1;
+}
+
+// Ticks to rewind a shot taken by ci in `in`: how far behind the client's view was, limited by
+// what its measured lag (plus time spent in the input queue) allows and by --rewind
+static int input_rewind_ticks(const ClientConn *c, const InputCmd *in) {
+    if (in->viewTick < 0 || g_rewindCap <= 0) return 0;
+    int claimed = g_tick_counter - in->viewTick;
+    int bound = (c->lagTicks8 >> 3) + 1 + (g_tick_counter - in->arrivalTick);
+    if (claimed > bound) claimed = bound;
+    if (claimed > g_rewindCap) claimed = g_rewindCap;
+    return claimed > 0 ? claimed : 0;
+}
+
+// The shooter saw tick g_tick_counter - rewind, so on its screen bullet b has already flown one
+// tile per tick since then. Replay those tiles against the frames of the matching ticks: a target
+// is hit where the shooter saw it. Walls and the map edge are left to the regular step.
+static void bullet_rewind(int b, int rewind) {
+    BulletPool *bp = &g_inst->bullets;
+    int wx = bp->map[b] % g_worldW, wy = bp->map[b] / g_worldW;
+    Map *m = map_loaded(wx, wy);
+    int owner = client_from_ref(bp->owner[b]);
+    for (int t = g_tick_counter - rewind + 1; t < g_tick_counter; ++t) {
+        const MapFrame *f = &m->frames[t % REWIND_MAX_TICKS];
+        if (f->tick != t) break; // map was unoccupied then
+        int nx = bp->x[b] + bp->dx[b], ny = bp->y[b] + bp->dy[b];
+        if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT || m->lay->tiles[ny][nx] == '#') break;
+        bp->x[b] = (int16_t)nx; bp->y[b] = (int16_t)ny;
+        int ei = f->enemyIdAt[ny][nx] ? enemy_find(m, f->enemyIdAt[ny][nx]) : -1;
+        if (ei >= 0) {
+            bullet_unlink(b); bullet_release(b);
+            if (enemy_take_hit(m, ei) && owner >= 0) clients[owner].score += 1;
+            return;
+        }
+        int ci = client_from_ref(f->playerAt[ny][nx]);
+        if (ci >= 0 && ci != owner && clients[ci].worldX == wx && clients[ci].worldY == wy) {
+            bullet_unlink(b); bullet_release(b);
+            if (!map_has_spawn(wx, wy)) damage_client(ci, owner, 10);
+            return;
+        }
+    }
+}
+
+// One simulation tick for every running instance: trace bullets in slot chunks, step every busy
+// map as its own job (all instances share the worker pool), then apply the recorded cross-map
+// effects serially. Parked instances are not visited; their maps catch up once players return.
+static void step_world(int bulletsDue, int enemiesDue) {
+    g_simBulletsDue = bulletsDue;
+    g_simEnemiesDue = enemiesDue;
+    g_simMapJobs.count = g_simChunkJobs.count = 0;
+    if (enemiesDue && g_load.level >= LOAD_SKIP_IDLE_MAPS) g_load.skippedIdleMaps++;
+    for (int r = 0; r < g_numRunning; ++r) {
+        Instance *in = g_running[r];
+        // Background: a few unoccupied maps per enemy step are caught up, so the loaded world keeps
+        // moving at a low rate (each idle map roughly every numLoaded / IDLE_MAPS_PER_STEP steps)
+        if (enemiesDue && g_load.level < LOAD_SKIP_IDLE_MAPS) {
+            for (int n = 0, k = 0; n < IDLE_MAPS_PER_STEP && k < in->numLoaded; ++k) {
+                if (in->idleCursor >= in->numLoaded) in->idleCursor = 0;
+                Map *m = in->maps[in->loadedMaps[in->idleCursor++]];
+                if (m->numResidents == 0 && m->enemies.count > 0) { m->idleDue = 1; n++; }
+            }
         }
-        // Up neighbor
-        if (wy > 0) {
-            bu = (world[wy - 1][wx].tiles[MAP_HEIGHT - 1][midX] == '#') ? 1 : 0;
+        for (int k = 0; k < in->numLoaded; ++k) {
+            const Map *m = in->maps[in->loadedMaps[k]];
+            if (m->numResidents > 0 || m->idleDue || (bulletsDue && m->bulletHead >= 0)) sim_job_push(&g_simMapJobs, in, in->loadedMaps[k]);
         }
-        // Down neighbor
-        if (wy < WORLD_H - 1) {
-            bd = (world[wy + 1][wx].tiles[0][midX] == '#') ? 1 : 0;
+        if (bulletsDue)
+            for (int c = 0; c * SIM_BULLET_CHUNK < in->bullets.high; ++c) sim_job_push(&g_simChunkJobs, in, c);
+    }
+    if (bulletsDue) sim_parallel_for(sim_bullet_chunk_job, g_simChunkJobs.count);
+    sim_parallel_for(sim_map_job, g_simMapJobs.count);
+    for (int j = 0; j < g_simMapJobs.count; ++j) {
+        g_inst = g_simMapJobs.jobs[j].inst;
+        apply_map_events(g_simMapJobs.jobs[j].k % g_worldW, g_simMapJobs.jobs[j].k / g_worldW);
+    }
+    if (g_rewindCap > 0) {
+        for (int r = 0; r < g_numRunning; ++r) {
+            g_inst = g_running[r];
+            for (int k = 0; k < g_inst->numActiveMaps; ++k) map_record_frame(g_inst->activeMaps[k] % g_worldW, g_inst->activeMaps[k] / g_worldW);
         }
-        int n = snprintf(line, sizeof(line), "ENTR %d %d %d %d %d %d\n", wx, wy, bl, br, bu, bd);
-        send_text_to_client(clientIdx, line, n);
     }
+}
 
-    // Send neighbor edge strips so clients can color border dots for any row/col, not just center
-    // Left neighbor: its rightmost column (x = MAP_WIDTH-1)
-    if (wx > 0) {
-        int nwx = wx - 1, nwy = wy;
-        for (int y = 0; y < MAP_HEIGHT; ++y) {
-            char ch = world[nwy][nwx].tiles[y][MAP_WIDTH - 1];
-            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, MAP_WIDTH - 1, y, ch);
-            send_text_to_client(clientIdx, line, n);
+// --- Input queue ---
+// INPUT lines are queued when parsed and applied here at INPUTS_PER_TICK per client per tick,
+// so movement speed does not depend on how many lines arrive in one poll() wakeup.
+static int g_inputCursor = 0; // client that drains first this tick (rotates for fairness)
+
+static void client_queue_input(int ci, int dx, int dy, int shoot, uint32_t seq, int viewTick) {
+    Client *c = &clients[ci];
+    ClientConn *cc = &conns[ci];
+    // The reported TICK may not be in the future or older than one already reported
+    if (viewTick > g_tick_counter || viewTick < cc->viewTick) viewTick = -1;
+    if (viewTick >= 0) {
+        cc->viewTick = viewTick;
+        cc->lagTicks8 += ((g_tick_counter - viewTick) * 8 - cc->lagTicks8) / 4;
+    }
+    if (seq != 0) {
+        if ((int32_t)(seq - cc->lastSeq) <= 0) return; // duplicate or reordered
+        cc->lastSeq = seq;
+    }
+    if (dx == 0 && dy == 0 && !shoot && c->inqCount > 0) {
+        // Idle keep-alive behind queued actions: fold it into the last one instead of adding a tick
+        if (seq != 0) cc->inq[(cc->inqHead + c->inqCount - 1) % INPUT_QUEUE_LEN].seq = seq;
+        return;
+    }
+    if (c->inqCount == INPUT_QUEUE_LEN) return; // client is far ahead of the tick rate; drop
+    InputCmd *in = &cc->inq[(cc->inqHead + c->inqCount++) % INPUT_QUEUE_LEN];
+    in->dx = (int8_t)(dx < 0 ? -1 : dx > 0 ? 1 : 0);
+    in->dy = (int8_t)(dy < 0 ? -1 : dy > 0 ? 1 : 0);
+    in->shoot = (int8_t)(shoot != 0);
+    in->seq = seq;
+    in->viewTick = viewTick;
+    in->arrivalTick = g_tick_counter;
+}
+
+// Facing, movement (with map transitions) and shooting for one INPUT action
+static void client_apply_input(int ci, int dx, int dy, int shoot, int rewind) {
+    Client *c = &clients[ci];
+    // update facing if a directional input was provided, even if movement is blocked
+    if (dx < 0) c->facing = DIR_LEFT; else if (dx > 0) c->facing = DIR_RIGHT; else if (dy < 0) c->facing = DIR_UP; else if (dy > 0) c->facing = DIR_DOWN;
+    int oldWX = c->worldX;
+    int oldWY = c->worldY;
+    int nwx = oldWX, nwy = oldWY;
+    int curx = c->pos.x;
+    int cury = c->pos.y;
+    int nx = curx + dx;
+    int ny = cury + dy;
+    // Preserve orthogonal axis on world transitions and avoid double-crossing on diagonals
+    int crossedX = 0;
+    if (nx < 0) {
+        int entryY = cury;
+        if (nwx > 0 && is_open(map_layout_at(nwx-1, nwy), MAP_WIDTH-1, entryY)) {
+            nwx--;
+            nx = MAP_WIDTH - 1;
+            ny = entryY;
+            crossedX = 1;
+        }
+    } else if (nx >= MAP_WIDTH) {
+        int entryY = cury;
+        if (nwx < g_worldW - 1 && is_open(map_layout_at(nwx+1, nwy), 0, entryY)) {
+            nwx++;
+            nx = 0;
+            ny = entryY;
+            crossedX = 1;
         }
     }
-    // Right neighbor: its leftmost column (x = 0)
-    if (wx < WORLD_W - 1) {
-        int nwx = wx + 1, nwy = wy;
-        for (int y = 0; y < MAP_HEIGHT; ++y) {
-            char ch = world[nwy][nwx].tiles[y][0];
-            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, 0, y, ch);
-            send_text_to_client(clientIdx, line, n);
+    if (!crossedX) {
+        if (ny < 0) {
+            int entryX = curx;
+            if (nwy > 0 && is_open(map_layout_at(nwx, nwy-1), entryX, MAP_HEIGHT-1)) {
+                nwy--;
+                ny = MAP_HEIGHT - 1;
+                nx = entryX;
+            }
+        } else if (ny >= MAP_HEIGHT) {
+            int entryX = curx;
+            if (nwy < g_worldH - 1 && is_open(map_layout_at(nwx, nwy+1), entryX, 0)) {
+                nwy++;
+                ny = 0;
+                nx = entryX;
+            }
         }
     }
-    // Up neighbor: its bottom row (y = MAP_HEIGHT-1)
-    if (wy > 0) {
-        int nwx = wx, nwy = wy - 1;
-        for (int x = 0; x < MAP_WIDTH; ++x) {
-            char ch = world[nwy][nwx].tiles[MAP_HEIGHT - 1][x];
-            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, x, MAP_HEIGHT - 1, ch);
-            send_text_to_client(clientIdx, line, n);
+    if (nx >= 0 && nx < MAP_WIDTH && ny >= 0 && ny < MAP_HEIGHT && is_open(map_layout_at(nwx, nwy), nx, ny)) {
+        if (!region_owns(nwx)) {
+            // Another region's map: the player continues there (a shot in this input is dropped);
+            // if the neighbor is unreachable it stays put
+            if (region_handoff(ci, nwx, nwy, nx, ny)) return;
+        } else if (map_get(nwx, nwy)) {
+            // The map is loaded on entry; without memory for it the player stays put.
+            // Disallow stepping into a tile occupied by another player in the same map
+            int occ = map_client_at(nwx, nwy, nx, ny);
+            if (occ < 0 || occ == ci) client_move(ci, nwx, nwy, nx, ny);
         }
     }
-    // Down neighbor: its top row (y = 0)
-    if (wy < WORLD_H - 1) {
-        int nwx = wx, nwy = wy + 1;
-        for (int x = 0; x < MAP_WIDTH; ++x) {
-            char ch = world[nwy][nwx].tiles[0][x];
-            int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", nwx, nwy, x, 0, ch);
-            send_text_to_client(clientIdx, line, n);
+    // If world tile changed, send the new map snapshot to this client
+    if (c->worldX != oldWX || c->worldY != oldWY) {
+        // send state first so client can show entities immediately
+        send_state_frame(ci, 0);
+        client_stream_map(ci, 0);
+    }
+    if (shoot) {
+        // spawn a server bullet in player's facing; if dx/dy provided, infer and override
+        int allow = 0;
+        if (ticks_left(c->superUntil) > 0) {
+            allow = 1; // spammable during super
+        } else if (ticks_left(c->shootReadyAt) <= 0) {
+            allow = 1;
+            c->shootReadyAt = g_tick_counter + 8; // ~400ms at 50ms tick (reduced fire rate)
+        }
+        if (allow) {
+            Direction dir = c->facing;
+            if (dx < 0) dir = DIR_LEFT; else if (dx > 0) dir = DIR_RIGHT; else if (dy < 0) dir = DIR_UP; else if (dy > 0) dir = DIR_DOWN;
+            int b = bullet_alloc(c->worldX, c->worldY, c->pos, dir, client_ref(ci));
+            if (b >= 0 && rewind > 0) bullet_rewind(b, rewind);
         }
     }
 }
 
-static void broadcast_entr(int wx, int wy) {
-    if (wx < 0 || wx >= WORLD_W || wy < 0 || wy >= WORLD_H) return;
-    int midX = MAP_WIDTH / 2;
-    int midY = MAP_HEIGHT / 2;
-    int bl = 0, br = 0, bu = 0, bd = 0;
-    if (wx > 0) bl = (world[wy][wx - 1].tiles[midY][MAP_WIDTH - 1] == '#') ? 1 : 0;
-    if (wx < WORLD_W - 1) br = (world[wy][wx + 1].tiles[midY][0] == '#') ? 1 : 0;
-    if (wy > 0) bu = (world[wy - 1][wx].tiles[MAP_HEIGHT - 1][midX] == '#') ? 1 : 0;
-    if (wy < WORLD_H - 1) bd = (world[wy + 1][wx].tiles[0][midX] == '#') ? 1 : 0;
-    char line[64];
-    int n = snprintf(line, sizeof(line), "ENTR %d %d %d %d %d %d\n", wx, wy, bl, br, bu, bd);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].connected) continue;
-        if (clients[i].isWebSocket && !clients[i].wsHandshakeDone) continue;
-        send_text_to_client(i, line, n);
+// Apply queued inputs, starting at a different client each tick so nobody always moves first
+static void drain_inputs(void) {
+    if (g_clientHigh == 0) return;
+    if (g_inputCursor >= g_clientHigh) g_inputCursor = 0;
+    for (int k = 0; k < g_clientHigh; ++k) {
+        int ci = (g_inputCursor + k) % g_clientHigh;
+        Client *c = &clients[ci];
+        g_inst = c->inst;
+        for (int n = 0; n < INPUTS_PER_TICK && c->connected && c->inqCount > 0; ++n) {
+            ClientConn *cc = &conns[ci];
+            InputCmd in = cc->inq[cc->inqHead];
+            cc->inqHead = (cc->inqHead + 1) % INPUT_QUEUE_LEN;
+            c->inqCount--;
+            if (in.seq != 0) c->ackSeq = in.seq; // before applying: a handoff takes it along
+            client_apply_input(ci, in.dx, in.dy, in.shoot, input_rewind_ticks(cc, &in));
+        }
     }
+    g_inputCursor = (g_inputCursor + 1) % g_clientHigh;
 }
 
-static void maybe_broadcast_entr_due_to_tile_change(int wx, int wy, int x, int y) {
-    int midX = MAP_WIDTH / 2;
-    int midY = MAP_HEIGHT / 2;
-    // Always refresh ENTR for this map to re-mark entrances after TILE updates overwrite ':'
-    broadcast_entr(wx, wy);
-    // If a border-center tile changed in this map, update the neighbor's ENTR status
-    if (x == 0 && y == midY) {
-        // This is left edge center of (wx,wy) -> affects right entrance of neighbor to the left (wx-1,wy)
-        if (wx > 0) broadcast_entr(wx - 1, wy);
-    } else if (x == MAP_WIDTH - 1 && y == midY) {
-        // Right edge center -> affects left entrance of neighbor to the right
-        if (wx < WORLD_W - 1) broadcast_entr(wx + 1, wy);
-    } else if (y == 0 && x == midX) {
-        // Top edge center -> affects bottom entrance of neighbor above
-        if (wy > 0) broadcast_entr(wx, wy - 1);
-    } else if (y == MAP_HEIGHT - 1 && x == midX) {
-        // Bottom edge center -> affects top entrance of neighbor below
-        if (wy < WORLD_H - 1) broadcast_entr(wx, wy + 1);
+// Tell each client which of its inputs the simulation has applied and where that left it, so
+// a predicting client can rebase onto the server position and replay the rest
+static void send_input_acks(void) {
+    for (int ci = 0; ci < g_clientHigh; ++ci) {
+        Client *c = &clients[ci];
+        if (!c->connected || c->ackSeq == c->ackSent) continue;
+        if (c->isWebSocket && !c->wsHandshakeDone) continue;
+        char line[96];
+        int n = snprintf(line, sizeof(line), "ACK %u %d %d %d %d\n", (unsigned)c->ackSeq, c->worldX, c->worldY, c->pos.x, c->pos.y);
+        send_text_to_client(ci, line, n);
+        c->ackSent = c->ackSeq;
     }
 }
 
-static FILE *try_open_map(const char *prefix, int mx, int my) {
-    char path[256]; snprintf(path, sizeof(path), "%smaps/x%d-y%d.txt", prefix, mx, my);
-    return fopen(path, "rb");
+static double srv_now_ms(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    static int initialized = 0;
+    if (!initialized) { QueryPerformanceFrequency(&freq); initialized = 1; }
+    LARGE_INTEGER counter; QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
 }
 
-static void load_map_file(int mx, int my) {
-    FILE *f = NULL;
-    f = try_open_map("", mx, my);
-    if (!f) f = try_open_map("../", mx, my);
-    if (!f) f = try_open_map("../../", mx, my);
-    Map *m = &world[my][mx];
-    if (!f) {
-        // Generate an all-dots map (including edges)
-        for (int y = 0; y < MAP_HEIGHT; ++y) {
-            for (int x = 0; x < MAP_WIDTH; ++x) m->tiles[y][x] = '.';
-            m->tiles[y][MAP_WIDTH] = '\0';
-        }
-        memset(m->wallDmg, 0, sizeof(m->wallDmg));
-        // Ensure inter-map connectivity on interior edges
-        int midX = MAP_WIDTH / 2;
-        int midY = MAP_HEIGHT / 2;
-        if (mx > 0) m->tiles[midY][0] = '.';
-        if (mx < WORLD_W - 1) m->tiles[midY][MAP_WIDTH - 1] = '.';
-        if (my > 0) m->tiles[0][midX] = '.';
-        if (my < WORLD_H - 1) m->tiles[MAP_HEIGHT - 1][midX] = '.';
-        // Ensure a central spawn exists at world center
-        if (mx == WORLD_W / 2 && my == WORLD_H / 2) {
-            m->tiles[midY][midX] = 'S';
-        }
-        return;
+// Tick watchdog: smooth the per-tick work time and climb one rung of the degradation ladder at
+// a time while it stays near the budget; step back down after LOAD_CALM_TICKS calm ticks
+static void load_update(double workMs) {
+    LoadStats *L = &g_load;
+    L->workMs += (workMs - L->workMs) * 0.2;
+    if (workMs > L->budgetMs) L->overruns++;
+    int step = 0;
+    if (L->workMs > L->budgetMs * 0.8) {
+        L->calmTicks = 0;
+        if (L->level < LOAD_LEVELS - 1 && g_tick_counter - L->lastStepTick >= LOAD_STEP_GAP_TICKS) step = 1;
+    } else if (L->workMs < L->budgetMs * 0.5 && L->level > LOAD_NORMAL) {
+        if (++L->calmTicks >= LOAD_CALM_TICKS) step = -1;
+    } else {
+        L->calmTicks = 0;
     }
-    char line[512];
-    for (int y = 0; y < MAP_HEIGHT; ++y) {
-        if (!fgets(line, sizeof(line), f)) { for (; y < MAP_HEIGHT; ++y) { for (int x = 0; x < MAP_WIDTH; ++x) m->tiles[y][x] = '#'; m->tiles[y][MAP_WIDTH] = '\0'; } break; }
-        int len = (int)strcspn(line, "\r\n");
-        for (int x = 0; x < MAP_WIDTH; ++x) { char c = (x < len) ? line[x] : '#'; if (c!='#'&&c!='.'&&c!='X'&&c!='W'&&c!='@'&&c!='S'&&c!='M') c='.'; m->tiles[y][x] = c; }
-        m->tiles[y][MAP_WIDTH] = '\0';
+    if (!step) return;
+    L->level += step;
+    L->lastStepTick = g_tick_counter;
+    L->calmTicks = 0;
+    if (step > 0) L->entered[L->level]++;
+    printf("[srv] Tick load %.1f/%.1fms (sim %.1f, send %.1f): %s to level %d (%s); overruns %llu, late ticks %llu, idle map skips %llu, thinned snapshots %llu, deferred streams %llu\n",
+           L->workMs, L->budgetMs, L->simMs, L->sendMs, step > 0 ? "degrading" : "recovering", L->level, g_loadLevelNames[L->level],
+           L->overruns, L->lateTicks, L->skippedIdleMaps, L->thinnedSnapshots, L->deferredStreams);
+    fflush(stdout);
+}
+
+// `server --bench-enemies`: time step_enemies_map on the roomiest non-spawn map while the
+// enemy count doubles up to every open tile. A stand-in player sits on the first open tile and
+// the flow field is rebuilt every step, as if it moved. us/step should be a fixed rebuild
+// cost plus a part linear in the enemy count.
+static int run_enemy_benchmark(void) {
+    int bx = -1, by = -1, open = 0;
+    for (int y = 0; y < g_worldH; ++y) for (int x = 0; x < g_worldW; ++x) {
+        if (map_has_spawn(x, y)) continue;
+        if (map_template(x, y)->meta.numOpen > open) { open = map_template(x, y)->meta.numOpen; bx = x; by = y; }
     }
-    fclose(f);
-    memset(m->wallDmg, 0, sizeof(m->wallDmg));
-    // Preserve map-defined entrance openness; do not force interior edges open
-    int midX = MAP_WIDTH / 2;
-    int midY = MAP_HEIGHT / 2;
-    // Ensure a central spawn exists at world center if none provided by files
-    if (mx == WORLD_W / 2 && my == WORLD_H / 2) {
-        int hasS = 0;
-        for (int y = 0; y < MAP_HEIGHT && !hasS; ++y) {
-            for (int x = 0; x < MAP_WIDTH && !hasS; ++x) {
-                if (m->tiles[y][x] == 'S') hasS = 1;
-            }
-        }
-        if (!hasS) m->tiles[midY][midX] = 'S';
+    Map *m = bx >= 0 ? map_get(bx, by) : NULL;
+    if (!m) { fprintf(stderr, "no map to benchmark\n"); return 1; }
+    for (int k = 0; k < MAP_WIDTH * MAP_HEIGHT; ++k) {
+        if (is_open(m->lay, k % MAP_WIDTH, k / MAP_WIDTH)) { map_occ_inc(m, k % MAP_WIDTH, k / MAP_WIDTH); break; }
     }
+    printf("map (%d,%d), %d open tiles\n", bx, by, open);
+    printf("%8s %12s %12s\n", "enemies", "us/step", "ns/enemy");
+    const int steps = 20000;
+    for (int count = 8; ; count *= 2) {
+        if (count > open) count = open;
+        spawn_enemies_for_map(bx, by, count);
+        int n = m->enemies.count;
+        double t0 = srv_now_ms();
+        for (int s = 0; s < steps; ++s) { m->flowDirty = 1; step_enemies_map(bx, by); }
+        double ms = srv_now_ms() - t0;
+        printf("%8d %12.3f %12.2f\n", n, ms * 1000.0 / steps, n ? ms * 1e6 / ((double)steps * n) : 0.0);
+        if (count >= open) break;
+    }
+    return 0;
 }
 
-static int is_open(Map *m, int x, int y) { if (x<0||x>=MAP_WIDTH||y<0||y>=MAP_HEIGHT) return 0; return m->tiles[y][x] != '#'; }
-static int map_has_spawn(int mx, int my) { for (int y = 0; y < MAP_HEIGHT; ++y) for (int x = 0; x < MAP_WIDTH; ++x) if (world[my][mx].tiles[y][x] == 'S') return 1; return 0; }
-static int find_spawn_in_map(int mx, int my, int *sx, int *sy) { for (int y = 0; y < MAP_HEIGHT; ++y) for (int x = 0; x < MAP_WIDTH; ++x) if (world[my][mx].tiles[y][x] == 'S') { *sx = x; *sy = y; return 1; } return 0; }
+static void bench_world_job(int j) {
+    g_inst = g_instances[0];
+    g_inst->maps[g_inst->loadedMaps[j]]->flowDirty = 1;
+    step_enemies_map(g_inst->loadedMaps[j] % g_worldW, g_inst->loadedMaps[j] / g_worldW);
+}
 
-static void spawn_enemies_for_map(int mx, int my, int count) {
-    if (map_has_spawn(mx, my)) { for (int i = 0; i < MAX_ENEMIES; ++i) enemies[my][mx][i].active = 0; return; }
-    if (count > MAX_ENEMIES) count = MAX_ENEMIES;
-    for (int i = 0; i < MAX_ENEMIES; ++i) enemies[my][mx][i].active = 0;
+// `server --bench-world`: every map is loaded, every non-spawn map gets a stand-in player and up
+// to 300 enemies, and all are stepped (flow field rebuilt each time) serially and then on the
+// worker pool.
+static int run_world_benchmark(void) {
+    for (int y = 0; y < g_worldH; ++y) for (int x = 0; x < g_worldW; ++x) {
+        Map *m = map_get(x, y);
+        if (!m) { fprintf(stderr, "out of memory\n"); return 1; }
+        if (map_has_spawn(x, y)) continue;
+        for (int k = 0; k < MAP_WIDTH * MAP_HEIGHT; ++k) {
+            if (is_open(m->lay, k % MAP_WIDTH, k / MAP_WIDTH)) { map_occ_inc(m, k % MAP_WIDTH, k / MAP_WIDTH); break; }
+        }
+        spawn_enemies_for_map(x, y, 300);
+    }
+    const int ticks = 2000;
+    int workers = g_simWorkers;
+    double serialMs = 0.0;
+    for (int pass = 0; pass < 2; ++pass) {
+        g_simWorkers = pass == 0 ? 1 : workers;
+        double t0 = srv_now_ms();
+        for (int t = 0; t < ticks; ++t) sim_parallel_for(bench_world_job, g_inst->numLoaded);
+        double ms = (srv_now_ms() - t0) / ticks;
+        if (pass == 0) serialMs = ms;
+        printf("%2d worker(s): %8.3f ms/tick  speedup %.2fx\n", g_simWorkers, ms, serialMs / ms);
+        if (workers == 1) break;
+    }
+    return 0;
+}
 
-    // Collect all open tiles on this map
-    Vec2 candidates[MAP_HEIGHT * MAP_WIDTH];
-    int numCandidates = 0;
-    for (int y = 0; y < MAP_HEIGHT; ++y) {
-        for (int x = 0; x < MAP_WIDTH; ++x) {
-            if (is_open(&world[my][mx], x, y)) {
-                candidates[numCandidates].x = x;
-                candidates[numCandidates].y = y;
-                numCandidates++;
+// --- Client commands ---
+// Lines from client i, NUL-terminated: INPUT dx dy shoot | PING t | HELLO [lobby] | SPECTATE key [lobby]
+// | BUILD | BYE. Every transport ends up here once it has whole lines.
+static void client_handle_lines(int i, char *p) {
+    g_inst = clients[i].inst;
+    while (*p) {
+        char *eol = strchr(p, '\n'); if (eol) *eol = '\0';
+        int dx, dy, shoot, viewTick = -1; unsigned seq = 0;
+        if (strcmp(p, "BYE") == 0) {
+            printf("[srv] Client %d (cid=%llu) disconnected (BYE) %s:%s\n", i, conns[i].connId, conns[i].addr, conns[i].port);
+            fflush(stdout);
+            disconnect_client(i);
+        } else if (strncmp(p, "PING ", 5) == 0) {
+            // Reflect back the timestamp/token for RTT measurement
+            char line[128]; int rn = snprintf(line, sizeof(line), "PONG %s\n", p + 5);
+            send_text_to_client(i, line, rn);
+        } else if (clients[i].spectator) {
+            // read-only: everything else is a player command
+        } else if (strncmp(p, "SPECTATE ", 9) == 0) {
+            client_spectate(i, p + 9);
+        } else if (strncmp(p, "HELLO", 5) == 0) {
+            // Optional lobby name; a plain HELLO keeps the matchmade instance
+            char lobby[INSTANCE_NAME_LEN];
+            if (lobby_name_parse(p + 5, lobby) > 0) client_switch_instance(i, lobby);
+        } else if (sscanf(p, "INPUT %d %d %d %u %d", &dx, &dy, &shoot, &seq, &viewTick) >= 3) {
+            clients[i].lastActive = time(NULL);
+            // Rate limit: consume one token per INPUT; if none, drop and optionally warn
+            if (!client_take_token(&conns[i])) {
+                // send minimal soft warning once in a while
+                // (not strictly necessary for gameplay; keeps bandwidth tiny)
+                // char warn[] = "WARN slow down\n"; send(clients[i].sock, warn, (int)strlen(warn), 0);
+                goto parsed_continue;
+            }
+            client_queue_input(i, dx, dy, shoot, (uint32_t)seq, viewTick);
+        } else if (strncmp(p, "BUILD", 5) == 0) {
+            // Player requests to build a wall in front of them
+            clients[i].lastActive = time(NULL);
+            int wx = clients[i].worldX;
+            int wy = clients[i].worldY;
+            int x = clients[i].pos.x;
+            int y = clients[i].pos.y;
+            int fdx = 0, fdy = 0;
+            switch (clients[i].facing) {
+                case DIR_LEFT: fdx = -1; break; case DIR_RIGHT: fdx = 1; break; case DIR_UP: fdy = -1; break; case DIR_DOWN: fdy = 1; break;
+            }
+            int tx = x + fdx;
+            int ty = y + fdy;
+            if (tx >= 0 && tx < MAP_WIDTH && ty >= 0 && ty < MAP_HEIGHT) {
+                Map *m = map_loaded(wx, wy);
+                char cur = m->lay->tiles[ty][tx];
+                if (cur == '.') {
+                    // avoid building on players or enemies
+                    int occupied = (map_client_at(wx, wy, tx, ty) >= 0) || m->enemyAt[ty][tx] >= 0;
+                    if (!occupied) {
+                        if (map_set_tile(wx, wy, tx, ty, '#')) broadcast_tile(wx, wy, tx, ty, '#');
+                    }
+                }
             }
         }
+parsed_continue:
+        // BYE, a refused SPECTATE or a failed send may have dropped the client; the rest is moot
+        if (!eol || !clients[i].connected) break;
+        p = eol + 1;
     }
+}
 
-    if (numCandidates == 0) return;
+// --- Shared-memory clients ---
+#ifdef SHM_TRANSPORT
+static sock_t shm_listen(const char *path) {
+    struct sockaddr_un sa; memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) return (sock_t)-1;
+    strcpy(sa.sun_path, path);
+    unlink(path); // left over from an earlier run
+    sock_t s = (sock_t)socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) return (sock_t)-1;
+    if (bind(s, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(s, SOMAXCONN) != 0) { close(s); return (sock_t)-1; }
+    return s;
+}
 
-    // Cap the number of enemies by available open tiles
-    if (count > numCandidates) count = numCandidates;
+// A zeroed ShmLink in a new memfd, mapped here; *fd is the memfd to pass on
+static ShmLink *shm_link_create(int *fd) {
+    *fd = memfd_create("dungeon-shm", MFD_CLOEXEC);
+    if (*fd < 0) return NULL;
+    ShmLink *l = ftruncate(*fd, (off_t)sizeof(ShmLink)) == 0
+        ? (ShmLink*)mmap(NULL, sizeof(ShmLink), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0) : (ShmLink*)MAP_FAILED;
+    if (l == MAP_FAILED) { close(*fd); *fd = -1; return NULL; }
+    l->magic = SHM_MAGIC;
+    return l;
+}
 
-    // Shuffle candidates (Fisher–Yates)
-    for (int i = numCandidates - 1; i > 0; --i) {
-        int j = rand() % (i + 1);
-        Vec2 tmp = candidates[i];
-        candidates[i] = candidates[j];
-        candidates[j] = tmp;
+// A client on the --shm socket gets its rings, its wake eventfd and the doorbell in one SHM
+// line, then the greeting a TCP client gets, through the ring. The socket itself carries nothing
+// more; it stays in the poll set so a client that exits or dies is noticed as a hangup.
+static void shm_accept(sock_t ls) {
+    sock_t cs = accept(ls, NULL, NULL);
+    if (cs < 0) return;
+    int idx = client_alloc(cs, 0);
+    Instance *in = idx >= 0 ? instance_match() : NULL;
+    int memfd = -1;
+    ShmLink *l = in ? shm_link_create(&memfd) : NULL;
+    int wake = l ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+    int fds[3] = { memfd, wake, g_shmBell };
+    if (wake < 0 || !shm_send_fds(cs, "SHM\n", fds)) {
+        if (l) munmap(l, sizeof(ShmLink));
+        if (memfd >= 0) close(memfd);
+        if (wake >= 0) close(wake);
+        if (idx >= 0) clients[idx].connected = 0;
+        const char *full = "FULL\n"; send(cs, full, (int)strlen(full), 0);
+        close(cs);
+        printf("[srv] Shared-memory connection refused (%s)\n", in ? "no segment" : "server full");
+        fflush(stdout);
+        return;
     }
+    close(memfd); // the client maps its own copy
+    clients[idx].isShm = 1;
+    conns[idx].shm = l;
+    conns[idx].shmWake = wake;
+    instance_join(idx, in);
+    client_reset_player(idx);
+    strncpy(conns[idx].addr, "shm", sizeof(conns[idx].addr)-1);
+    strncpy(conns[idx].port, "-", sizeof(conns[idx].port)-1);
+    conns[idx].connId = g_nextConnId++;
+    printf("[srv] Client %d (cid=%llu) connected over shared memory, color=%d, instance %s, spawn=(%d,%d)@(%d,%d)\n",
+           idx, conns[idx].connId, clients[idx].color, in->name,
+           clients[idx].worldX, clients[idx].worldY, clients[idx].pos.x, clients[idx].pos.y);
+    fflush(stdout);
+    send_you_line(idx);
+    send_lobby_line(idx);
+    send_state_frame(idx, 1);
+    client_stream_map(idx, 1);
+}
+#endif
 
-    for (int i = 0; i < count; ++i) {
-        enemies[my][mx][i].active = 1;
-        enemies[my][mx][i].worldX = mx;
-        enemies[my][mx][i].worldY = my;
-        enemies[my][mx][i].pos.x = candidates[i].x;
-        enemies[my][mx][i].pos.y = candidates[i].y;
-        enemies[my][mx][i].hp = 2;
+// --- UDP clients ---
+// Token a client must echo in CONNECT: a keyed hash (FNV-1a) of its address, so only a sender
+// that can receive at that address gets a session and the stream that follows
+// A fresh 128-bit key from the OS. Where there is none (Windows), the clock and an address stand
+// in, which keeps tokens unguessable only to someone who cannot time the server's start.
+static void udp_key_draw(uint64_t key[2]) {
+    int ok = 0;
+#ifndef _WIN32
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f) { ok = fread(key, sizeof(uint64_t), 2, f) == 2; fclose(f); }
+#endif
+    if (!ok) {
+        uint64_t t = (uint64_t)time(NULL) * 6364136223846793005ull ^ (uint64_t)(srv_now_ms() * 1000.0) ^ (uint64_t)(uintptr_t)&ok;
+        key[0] = udp_siphash(key, &t, sizeof(t));
+        key[1] = udp_siphash(key, &key[0], sizeof(key[0])) ^ t;
     }
 }
 
-static void place_near_spawn(Client *c) {
-    int smx = 0, smy = 0, sx = 1, sy = 1; int foundMap = 0;
-    for (int my = 0; my < WORLD_H && !foundMap; ++my) {
-        for (int mx = 0; mx < WORLD_W && !foundMap; ++mx) {
-            int tx, ty; if (find_spawn_in_map(mx, my, &tx, &ty)) { smx = mx; smy = my; sx = tx; sy = ty; foundMap = 1; }
-        }
-    }
-    int bestx = sx, besty = sy;
-    for (int r = 0; r <= MAP_WIDTH + MAP_HEIGHT; ++r) {
-        for (int dy = -r; dy <= r; ++dy) {
-            int dxs[2] = { -r, r };
-            for (int k = 0; k < 2; ++k) {
-                int dx = dxs[k]; int tx = sx + dx; int ty = sy + dy;
-                if (tx < 0 || tx >= MAP_WIDTH || ty < 0 || ty >= MAP_HEIGHT) continue;
-                if (!is_open(&world[smy][smx], tx, ty)) continue;
-                int occupied = 0; for (int i = 0; i < MAX_CLIENTS; ++i) { if (!clients[i].connected) continue; if (clients[i].worldX == smx && clients[i].worldY == smy && clients[i].pos.x == tx && clients[i].pos.y == ty) { occupied = 1; break; } }
-                if (!occupied) { bestx = tx; besty = ty; goto found; }
-            }
-        }
-        for (int dx = -r+1; dx <= r-1; ++dx) {
-            int dys[2] = { -r, r };
-            for (int k = 0; k < 2; ++k) {
-                int dy = dys[k]; int tx = sx + dx; int ty = sy + dy;
-                if (tx < 0 || tx >= MAP_WIDTH || ty < 0 || ty >= MAP_HEIGHT) continue;
-                if (!is_open(&world[smy][smx], tx, ty)) continue;
-                int occupied = 0; for (int i = 0; i < MAX_CLIENTS; ++i) { if (!clients[i].connected) continue; if (clients[i].worldX == smx && clients[i].worldY == smy && clients[i].pos.x == tx && clients[i].pos.y == ty) { occupied = 1; break; } }
-                if (!occupied) { bestx = tx; besty = ty; goto found; }
-            }
-        }
-    }
-found:
-    c->worldX = smx; c->worldY = smy; c->pos.x = bestx; c->pos.y = besty;
+// Draw a new key every UDP_KEY_ROTATE_MS. The one before stays valid, so a CHALLENGE answered
+// across a rotation still works; anything older no longer does.
+static void udp_keys_rotate(void) {
+    double now = srv_now_ms();
+    if (g_udpKeyMs > 0.0 && now - g_udpKeyMs < UDP_KEY_ROTATE_MS) return;
+    if (g_udpKeyMs > 0.0 && now - g_udpKeyMs < 2 * UDP_KEY_ROTATE_MS) memcpy(g_udpKeys[1], g_udpKeys[0], sizeof(g_udpKeys[0]));
+    else udp_key_draw(g_udpKeys[1]);
+    udp_key_draw(g_udpKeys[0]);
+    g_udpKeyMs = now;
 }
 
-static void broadcast_state(void) {
-    char line[128]; char buf[8192]; int off = 0;
-    // Prepend a tick marker so clients can align updates
-    {
-        int n0 = snprintf(line, sizeof(line), "TICK %d\n", g_tick_counter);
-        if (n0 > 0 && off + n0 < (int)sizeof(buf)) { memcpy(buf + off, line, n0); off += n0; }
-    }
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        int active = clients[i].connected ? 1 : 0;
-        int need = 0;
-        if (clients[i].lastSentActive != active) need = 1;
-        else if (active) {
-            if (clients[i].lastSentWorldX != clients[i].worldX) need = 1;
-            else if (clients[i].lastSentWorldY != clients[i].worldY) need = 1;
-            else if (clients[i].lastSentPosX != clients[i].pos.x) need = 1;
-            else if (clients[i].lastSentPosY != clients[i].pos.y) need = 1;
-            else if (clients[i].lastSentHp != clients[i].hp) need = 1;
-            else if (clients[i].lastSentInv != clients[i].invincibleTicks) need = 1;
-            else if (clients[i].lastSentSup != clients[i].superTicks) need = 1;
-            else if (clients[i].lastSentScore != clients[i].score) need = 1;
-            else if (clients[i].lastSentColor != clients[i].color) need = 1;
-        }
-        if (need) {
-            int n = snprintf(line, sizeof(line), "PLAYER %d %d %d %d %d %d %d %d %d %d %d\n", i, clients[i].worldX, clients[i].worldY, clients[i].pos.x, clients[i].pos.y, clients[i].color, active, clients[i].hp, clients[i].invincibleTicks, clients[i].superTicks, clients[i].score);
-            if (off + n < (int)sizeof(buf)) { memcpy(buf + off, line, n); off += n; }
-            clients[i].lastSentActive = active;
-            clients[i].lastSentWorldX = clients[i].worldX;
-            clients[i].lastSentWorldY = clients[i].worldY;
-            clients[i].lastSentPosX = clients[i].pos.x;
-            clients[i].lastSentPosY = clients[i].pos.y;
-            clients[i].lastSentHp = clients[i].hp;
-            clients[i].lastSentInv = clients[i].invincibleTicks;
-            clients[i].lastSentSup = clients[i].superTicks;
-            clients[i].lastSentScore = clients[i].score;
-            clients[i].lastSentColor = clients[i].color;
-        }
+static uint64_t udp_token(const uint64_t key[2], const struct sockaddr_storage *ss, int len) {
+    uint64_t h = udp_siphash(key, ss, (size_t)len);
+    return h ? h : 1;
+}
+
+static void udp_reply(const char *text, const struct sockaddr_storage *ss, int len) {
+    sendto(g_udpSock, text, (int)strlen(text), 0, (const struct sockaddr*)ss, len);
+}
+
+// CONNECT [token] from ss. Without the right token the answer is CHALLENGE; with it the sender
+// gets a slot, WELCOME with its ClientRef and the greeting a TCP client gets, on the reliable
+// channel. A repeated CONNECT (WELCOME was lost) gets WELCOME again.
+static void udp_connect(const char *pkt, int n, const struct sockaddr_storage *ss, int slen) {
+    if (n < UDP_CONNECT_LEN) return; // unpadded: never answer with more than was sent
+    char line[64];
+    unsigned long long tok = 0;
+    udp_keys_rotate();
+    if (sscanf(pkt + 7, "%llu", &tok) != 1 || (tok != udp_token(g_udpKeys[0], ss, slen) && tok != udp_token(g_udpKeys[1], ss, slen))) {
+        snprintf(line, sizeof(line), "CHALLENGE %llu\n", (unsigned long long)udp_token(g_udpKeys[0], ss, slen));
+        udp_reply(line, ss, slen);
+        return;
     }
-    // Broadcast entrance blocked flags for maps that currently have players
-    for (int wy = 0; wy < WORLD_H; ++wy) {
-        for (int wx = 0; wx < WORLD_W; ++wx) {
-            if (!is_map_active(wx, wy)) continue;
-            int midX = MAP_WIDTH / 2;
-            int midY = MAP_HEIGHT / 2;
-            int bl = 1, br = 1, bu = 1, bd = 1; // default blocked
-            if (wx > 0) {
-                char c = world[wy][wx-1].tiles[midY][MAP_WIDTH-1]; bl = (c == '#') ? 1 : 0;
-            }
-            if (wx < WORLD_W - 1) {
-                char c = world[wy][wx+1].tiles[midY][0]; br = (c == '#') ? 1 : 0;
-            }
-            if (wy > 0) {
-                char c = world[wy-1][wx].tiles[MAP_HEIGHT-1][midX]; bu = (c == '#') ? 1 : 0;
-            }
-            if (wy < WORLD_H - 1) {
-                char c = world[wy+1][wx].tiles[0][midX]; bd = (c == '#') ? 1 : 0;
-            }
-            int n = snprintf(line, sizeof(line), "ENTR %d %d %d %d %d %d\n", wx, wy, bl, br, bu, bd);
-            if (off + n < (int)sizeof(buf)) { memcpy(buf + off, line, n); off += n; }
-        }
+    for (int i = 0; i < g_clientHigh; ++i) {
+        if (!clients[i].connected || !clients[i].isUdp || conns[i].udpAddrLen != slen || memcmp(&conns[i].udpAddr, ss, (size_t)slen) != 0) continue;
+        snprintf(line, sizeof(line), "WELCOME %u\n", (unsigned)client_ref(i));
+        udp_reply(line, ss, slen);
+        return;
     }
-    // broadcast bullets (include owner id)
-    for (int b = 0; b < MAX_REMOTE_BULLETS; ++b) {
-        if (!bullets[b].active) continue;
-        // Only broadcast bullets on maps that currently have players
-        if (!is_map_active(bullets[b].worldX, bullets[b].worldY)) continue;
-        int n = snprintf(line, sizeof(line), "BULLET %d %d %d %d %d %d\n", bullets[b].worldX, bullets[b].worldY, bullets[b].pos.x, bullets[b].pos.y, 1, bullets[b].ownerId);
-        if (off + n < (int)sizeof(buf)) { memcpy(buf + off, line, n); off += n; }
-    }
-    // broadcast enemies
-    for (int wy = 0; wy < WORLD_H; ++wy) {
-        for (int wx = 0; wx < WORLD_W; ++wx) {
-            if (!is_map_active(wx, wy)) continue; // skip maps without active players
-            for (int i = 0; i < MAX_ENEMIES; ++i) {
-                SrvEnemy *e = &enemies[wy][wx][i];
-                if (!e->active) continue;
-                int n = snprintf(line, sizeof(line), "ENEMY %d %d %d %d %d\n", wx, wy, e->pos.x, e->pos.y, e->hp);
-                if (off + n < (int)sizeof(buf)) { memcpy(buf + off, line, n); off += n; }
-            }
-        }
+    int idx = client_alloc((sock_t)-1, 0);
+    Instance *in = idx >= 0 ? instance_match() : NULL;
+    UdpChannel *ch = in ? (UdpChannel*)malloc(sizeof(UdpChannel)) : NULL;
+    char host[64] = {0}, serv[16] = {0};
+    if (getnameinfo((const struct sockaddr*)ss, (socklen_t)slen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        strncpy(host, "?", sizeof(host)-1); strncpy(serv, "?", sizeof(serv)-1);
     }
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].connected) continue;
-        if (clients[i].isWebSocket && !clients[i].wsHandshakeDone) continue; // do not send before WS handshake
-        if (clients[i].isWebSocket) ws_send_text_frame(clients[i].sock, buf, off);
-        else send(clients[i].sock, buf, off, 0);
+    if (!ch) {
+        if (idx >= 0) clients[idx].connected = 0;
+        udp_reply("FULL\n", ss, slen);
+        printf("[srv] Connection refused (server full) from %s:%s (UDP)\n", host, serv);
+        fflush(stdout);
+        return;
     }
+    udp_channel_init(ch, 0);
+    clients[idx].isUdp = 1;
+    conns[idx].udp = ch;
+    memcpy(&conns[idx].udpAddr, ss, (size_t)slen);
+    conns[idx].udpAddrLen = slen;
+    conns[idx].udpHeardMs = srv_now_ms();
+    g_numUdp++;
+    instance_join(idx, in);
+    client_reset_player(idx);
+    snprintf(conns[idx].addr, sizeof(conns[idx].addr), "%s", host);
+    snprintf(conns[idx].port, sizeof(conns[idx].port), "%s", serv);
+    conns[idx].connId = g_nextConnId++;
+    printf("[srv] Client %d (cid=%llu) connected from %s:%s over UDP, color=%d, instance %s, spawn=(%d,%d)@(%d,%d)\n",
+           idx, conns[idx].connId, host, serv, clients[idx].color, in->name,
+           clients[idx].worldX, clients[idx].worldY, clients[idx].pos.x, clients[idx].pos.y);
+    fflush(stdout);
+    snprintf(line, sizeof(line), "WELCOME %u\n", (unsigned)client_ref(idx));
+    udp_reply(line, ss, slen);
+    send_you_line(idx);
+    send_lobby_line(idx);
+    send_state_frame(idx, 1);
+    client_stream_map(idx, 1);
 }
 
-static void broadcast_tile(int wx, int wy, int x, int y, char ch) {
-    char line[64];
-    int n = snprintf(line, sizeof(line), "TILE %d %d %d %d %c\n", wx, wy, x, y, ch);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].connected) continue;
-        if (clients[i].isWebSocket && !clients[i].wsHandshakeDone) continue; // wait for WS handshake
-        if (clients[i].isWebSocket) ws_send_text_frame(clients[i].sock, line, n);
-        else send(clients[i].sock, line, n, 0);
-    }
-    // If this tile change affects an entrance status for a neighbor map, broadcast ENTR for that neighbor now
-    maybe_broadcast_entr_due_to_tile_change(wx, wy, x, y);
-}
-
-static void step_bullets(void) {
-    for (int i = 0; i < MAX_REMOTE_BULLETS; ++i) {
-        if (!bullets[i].active) continue;
-        int dx = 0, dy = 0;
-        switch (bullets[i].dir) { case DIR_UP: dy = -1; break; case DIR_DOWN: dy = 1; break; case DIR_LEFT: dx = -1; break; case DIR_RIGHT: dx = 1; break; }
-        // Move bullet faster: two sub-steps per tick
-        for (int step = 0; step < 2 && bullets[i].active; ++step) {
-            int nx = bullets[i].pos.x + dx;
-            int ny = bullets[i].pos.y + dy;
-            if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT) { bullets[i].active = 0; break; }
-            Map *m = &world[bullets[i].worldY][bullets[i].worldX];
-            // Check enemy hit
-            for (int ei = 0; ei < MAX_ENEMIES; ++ei) {
-                SrvEnemy *e = &enemies[bullets[i].worldY][bullets[i].worldX][ei];
-                if (!e->active) continue;
-                if (e->pos.x == nx && e->pos.y == ny) {
-                    if (e->hp > 0) e->hp--;
-                    if (e->hp <= 0) {
-                        e->active = 0;
-                        int owner = bullets[i].ownerId;
-                        if (owner >= 0 && owner < MAX_CLIENTS && clients[owner].connected) {
-                            clients[owner].score += 1;
-                        }
-                    }
-                    bullets[i].active = 0;
-                    break;
-                }
-            }
-            if (!bullets[i].active) break;
-            // Check player hit (PvP)
-            for (int ci = 0; ci < MAX_CLIENTS; ++ci) {
-                if (!clients[ci].connected) continue;
-                if (clients[ci].worldX != bullets[i].worldX || clients[ci].worldY != bullets[i].worldY) continue;
-                if (clients[ci].pos.x == nx && clients[ci].pos.y == ny) {
-                    if (!map_has_spawn(clients[ci].worldX, clients[ci].worldY)) {
-                        if (clients[ci].invincibleTicks <= 0 && clients[ci].hp > 0) {
-                            clients[ci].hp--;
-                            clients[ci].invincibleTicks = 60;
-                            if (clients[ci].hp <= 0) {
-                                int owner = bullets[i].ownerId;
-                                if (owner >= 0 && owner < MAX_CLIENTS && clients[owner].connected) {
-                                    clients[owner].score += 10;
-                                }
-                                place_near_spawn(&clients[ci]);
-                                clients[ci].hp = 3;
-                                clients[ci].superTicks = 0;
-                                clients[ci].shootCooldown = 0;
-                                clients[ci].invincibleTicks = 60;
-                            }
-                        }
-                    }
-                    bullets[i].active = 0;
-                    break;
-                }
-            }
-            if (!bullets[i].active) break;
-            // Wall hit
-            if (m->tiles[ny][nx] == '#') {
-                if (m->wallDmg[ny][nx] < 4) {
-                    m->wallDmg[ny][nx]++;
-                } else {
-                    m->tiles[ny][nx] = '.';
-                    m->wallDmg[ny][nx] = 0;
-                    broadcast_tile(bullets[i].worldX, bullets[i].worldY, nx, ny, '.');
-                }
-                bullets[i].active = 0;
-                break;
-            }
-            bullets[i].pos.x = nx; bullets[i].pos.y = ny;
+// Datagrams waiting on g_udpSock, a bounded batch per wakeup so a flood cannot starve the tick.
+// Client datagrams name their slot (ClientRef); one from a stale session or another address is
+// ignored.
+static void udp_receive(void) {
+    char pkt[UDP_MTU + 1];
+    for (int k = 0; k < 256; ++k) {
+        struct sockaddr_storage ss; socklen_t slen = sizeof(ss);
+        int n = (int)recvfrom(g_udpSock, pkt, UDP_MTU, 0, (struct sockaddr*)&ss, &slen);
+        if (n <= 0) break;
+        pkt[n] = '\0';
+        if (n >= 7 && memcmp(pkt, "CONNECT", 7) == 0) { udp_connect(pkt, n, &ss, (int)slen); continue; }
+        uint32_t num, ref; int off;
+        char type = udp_parse_header(pkt, n, &num, &ref, &off);
+        int ci = (int)(ref & ((1u << CLIENT_SLOT_BITS) - 1));
+        if (!type || ci >= g_clientHigh || !clients[ci].connected || !clients[ci].isUdp || client_ref(ci) != ref) continue;
+        ClientConn *cc = &conns[ci];
+        if (cc->udpAddrLen != (int)slen || memcmp(&cc->udpAddr, &ss, slen) != 0) continue;
+        cc->udpHeardMs = srv_now_ms();
+        if (type == 'A') { udp_on_ack(cc->udp, num, cc->udpHeardMs); continue; }
+        if (type == 'R') {
+            int fresh = udp_accept(cc->udp, num);
+            udp_send_ack(cc->udp, udp_send_datagram, cc);
+            if (!fresh) continue;
         }
+        client_handle_lines(ci, pkt + off);
     }
 }
 
-static void step_enemies(void) {
-    for (int wy = 0; wy < WORLD_H; ++wy) {
-        for (int wx = 0; wx < WORLD_W; ++wx) {
-            if (!is_map_active(wx, wy)) continue; // optimize: only simulate maps with players
-            for (int i = 0; i < MAX_ENEMIES; ++i) {
-                SrvEnemy *e = &enemies[wy][wx][i];
-                if (!e->active) continue;
-                int dir = rand() % 4;
-                int dx = 0, dy = 0;
-                switch (dir) { case 0: dy = -1; break; case 1: dy = 1; break; case 2: dx = -1; break; case 3: dx = 1; break; }
-                int nx = e->pos.x + dx;
-                int ny = e->pos.y + dy;
-                if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT) continue;
-                if (!is_open(&world[wy][wx], nx, ny)) continue;
-                int occ = 0;
-                for (int j = 0; j < MAX_ENEMIES; ++j) {
-                    if (j == i) continue;
-                    SrvEnemy *o = &enemies[wy][wx][j];
-                    if (!o->active) continue;
-                    if (o->pos.x == nx && o->pos.y == ny) { occ = 1; break; }
-                }
-                if (occ) continue;
-                e->pos.x = nx; e->pos.y = ny;
-            }
+// Send what the reliable channels have queued, retransmit what timed out, and drop clients that
+// went silent (they PING every second) or fell UDP_BACKLOG_MAX behind
+static void udp_service(void) {
+    if (g_numUdp == 0) return;
+    double now = srv_now_ms();
+    for (int i = 0; i < g_clientHigh; ++i) {
+        if (!clients[i].connected || !clients[i].isUdp) continue;
+        ClientConn *cc = &conns[i];
+        if (cc->udpLost || now - cc->udpHeardMs > UDP_TIMEOUT_MS) {
+            printf("[srv] Client %d (cid=%llu) disconnected (%s) %s:%s\n", i, cc->connId, cc->udpLost ? "backlog" : "timeout", cc->addr, cc->port);
+            fflush(stdout);
+            disconnect_client(i);
+            continue;
         }
+        udp_pump(cc->udp, now, udp_send_datagram, cc);
     }
 }
 
-static void apply_enemy_contact_damage(void) {
-    for (int ci = 0; ci < MAX_CLIENTS; ++ci) {
-        if (!clients[ci].connected) continue;
-        int wx = clients[ci].worldX;
-        int wy = clients[ci].worldY;
-        // Skip damage on spawn map
-        if (map_has_spawn(wx, wy)) continue;
-        // Check enemy collision on this map
-        for (int ei = 0; ei < MAX_ENEMIES; ++ei) {
-            SrvEnemy *e = &enemies[wy][wx][ei];
-            if (!e->active) continue;
-            if (e->pos.x == clients[ci].pos.x && e->pos.y == clients[ci].pos.y) {
-                if (clients[ci].invincibleTicks <= 0 && clients[ci].hp > 0) {
-                    clients[ci].hp--;
-                    clients[ci].invincibleTicks = 60; // ~3s at 50ms tick
-                    if (clients[ci].hp <= 0) {
-                        place_near_spawn(&clients[ci]);
-                        clients[ci].hp = 3;
-                        clients[ci].superTicks = 0;
-                        clients[ci].shootCooldown = 0;
-                        clients[ci].invincibleTicks = 60;
-                    }
-                }
-                break; // only one enemy contact per tick
-            }
-        }
-    }
+// Default worker count: online cores, clamped to SIM_MAX_WORKERS
+static int sim_default_workers(void) {
+#if defined(SIM_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > SIM_MAX_WORKERS ? SIM_MAX_WORKERS : (int)n;
+#else
+    return 1;
+#endif
 }
 
 int main(int argc, char **argv) {
-    srand((unsigned int)time(NULL));
 #ifdef _WIN32
     WSADATA wsa; WSAStartup(MAKEWORD(2,2), &wsa);
 #endif
-    const char *port = (argc > 1) ? argv[1] : "5555";
-    const char *wsport = (argc > 2) ? argv[2] : "5556"; // secondary port for WebSocket
-
-    for (int y = 0; y < WORLD_H; ++y) for (int x = 0; x < WORLD_W; ++x) load_map_file(x, y);
-    memset(clients, 0, sizeof(clients));
-    memset(bullets, 0, sizeof(bullets));
-    for (int y = 0; y < WORLD_H; ++y) for (int x = 0; x < WORLD_W; ++x) spawn_enemies_for_map(x, y, 4);
+    // Positional: [tcp port] [ws port]; options may appear anywhere
+    const char *port = "5555";
+    const char *wsport = "5556"; // secondary port for WebSocket
+    int npos = 0, bench = 0, haveSeed = 0, forcedW = 0, forcedH = 0;
+    int workers = sim_default_workers();
+    for (int a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--bench-enemies") == 0) bench = 1;
+        else if (strcmp(argv[a], "--bench-world") == 0) bench = 2;
+        else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) { g_worldSeed = strtoull(argv[++a], NULL, 0); haveSeed = 1; }
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) { workers = atoi(argv[++a]); if (workers < 1) workers = 1; }
+        else if (strcmp(argv[a], "--instances") == 0 && a + 1 < argc) { g_maxInstances = atoi(argv[++a]); if (g_maxInstances < 1) g_maxInstances = 1; }
+        else if (strcmp(argv[a], "--regions") == 0 && a + 1 < argc) { g_numRegions = atoi(argv[++a]); if (g_numRegions < 1) g_numRegions = 1; }
+        else if (strcmp(argv[a], "--world") == 0 && a + 2 < argc) {
+            forcedW = atoi(argv[a + 1]); forcedH = atoi(argv[a + 2]); a += 2;
+            if (forcedW < 1 || forcedH < 1 || forcedW > WORLD_MAX || forcedH > WORLD_MAX) { fprintf(stderr, "--world takes 1 to %d maps per side\n", WORLD_MAX); return 1; }
+        }
+        else if (strcmp(argv[a], "--lobby-size") == 0 && a + 1 < argc) { g_lobbySize = atoi(argv[++a]); if (g_lobbySize < 1) g_lobbySize = 1; }
+        else if (strcmp(argv[a], "--spectator-key") == 0 && a + 1 < argc) g_spectatorKey = argv[++a];
+        else if (strcmp(argv[a], "--shm") == 0 && a + 1 < argc) g_shmPath = argv[++a];
+        else if (strcmp(argv[a], "--tick-budget") == 0 && a + 1 < argc) { g_load.budgetMs = atof(argv[++a]); if (g_load.budgetMs <= 0) g_load.budgetMs = TICK_MS; }
+        else if (strcmp(argv[a], "--rewind") == 0 && a + 1 < argc) {
+            g_rewindCap = atoi(argv[++a]);
+            if (g_rewindCap < 0) g_rewindCap = 0;
+            if (g_rewindCap > REWIND_MAX_TICKS - 1) g_rewindCap = REWIND_MAX_TICKS - 1;
+        }
+        else if (npos == 0) { port = argv[a]; npos++; }
+        else if (npos == 1) { wsport = argv[a]; npos++; }
+    }
+    if (!haveSeed) g_worldSeed = bench ? 1 : (uint64_t)time(NULL);
+#ifndef _WIN32
+    // A peer that vanished mid-send must not take every instance down with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    g_instances = (Instance**)calloc((size_t)g_maxInstances, sizeof(Instance*));
+    g_running = (Instance**)calloc((size_t)g_maxInstances, sizeof(Instance*));
+    if (!g_instances || !g_running) { fprintf(stderr, "out of memory\n"); return 1; }
+    if (!world_open(forcedW, forcedH)) { fprintf(stderr, "out of memory\n"); return 1; }
+    world_find_spawn();
+    g_regionX1 = g_worldW;
+    if (g_numRegions > g_worldW) g_numRegions = g_worldW;
+    if (bench) {
+        sim_start(workers);
+        g_inst = instance_create(NULL);
+        if (!g_inst) { fprintf(stderr, "out of memory\n"); return 1; }
+        return bench == 1 ? run_enemy_benchmark() : run_world_benchmark();
+    }
 
     struct addrinfo hints; memset(&hints, 0, sizeof(hints)); hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM; hints.ai_flags = AI_PASSIVE;
     struct addrinfo *res = NULL; if (getaddrinfo(NULL, port, &hints, &res) != 0) { fprintf(stderr, "getaddrinfo failed\n"); return 1; }
     sock_t lsock = (sock_t)socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     int yes = 1; setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
     if (bind(lsock, res->ai_addr, (int)res->ai_addrlen) != 0) { fprintf(stderr, "bind failed\n"); return 1; }
-    if (listen(lsock, 16) != 0) { fprintf(stderr, "listen failed\n"); return 1; }
+    if (listen(lsock, SOMAXCONN) != 0) { fprintf(stderr, "listen failed\n"); return 1; }
     freeaddrinfo(res);
 
     // Second listening socket for WebSocket clients
@@ -866,79 +3471,114 @@ int main(int argc, char **argv) {
     sock_t wslsock = (sock_t)socket(res2->ai_family, res2->ai_socktype, res2->ai_protocol);
     setsockopt(wslsock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
     if (bind(wslsock, res2->ai_addr, (int)res2->ai_addrlen) != 0) { fprintf(stderr, "bind failed (ws)\n"); return 1; }
-    if (listen(wslsock, 16) != 0) { fprintf(stderr, "listen failed (ws)\n"); return 1; }
+    if (listen(wslsock, SOMAXCONN) != 0) { fprintf(stderr, "listen failed (ws)\n"); return 1; }
     freeaddrinfo(res2);
 
-    printf("[srv] Listening on port %s (TCP) and %s (WebSocket)\n", port, wsport);
+    // Regions fork here, before the worker threads: each process continues below as one region
+    if (g_numRegions > 1 && !region_start()) return 1;
+    sim_start(workers);
+    template_prefetch_start();
+    client_table_grow();
+    tw_init(&g_timers, (uint32_t)g_tick_counter);
+    // Instance 0 is ready before the first connection; the rest open as lobbies fill up
+    g_inst = instance_create(NULL);
+    if (!g_inst) { fprintf(stderr, "out of memory\n"); return 1; }
+    // New players start at the spawn, so only its region listens; the others get players by handoff
+    if (g_inst->spawnCandidatesDirty) rebuild_spawn_candidates();
+    g_regionAccepts = region_owns(g_inst->spawnMX);
+    if (!g_regionAccepts) {
+#ifdef _WIN32
+        closesocket(lsock); closesocket(wslsock);
+#else
+        close(lsock); close(wslsock);
+#endif
+        lsock = wslsock = (sock_t)-1;
+    }
+    // UDP clients share the TCP port's number
+    if (g_regionAccepts) {
+        hints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo *res3 = NULL; if (getaddrinfo(NULL, port, &hints, &res3) != 0) { fprintf(stderr, "getaddrinfo failed (udp)\n"); return 1; }
+        g_udpSock = (sock_t)socket(res3->ai_family, res3->ai_socktype, res3->ai_protocol);
+        if (bind(g_udpSock, res3->ai_addr, (int)res3->ai_addrlen) != 0) { fprintf(stderr, "bind failed (udp)\n"); return 1; }
+        freeaddrinfo(res3);
+#ifdef _WIN32
+        u_long nb = 1; ioctlsocket(g_udpSock, FIONBIO, &nb);
+#else
+        fcntl(g_udpSock, F_SETFL, fcntl(g_udpSock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        udp_keys_rotate();
+    }
+    sock_t shmlsock = (sock_t)-1;
+    if (g_shmPath && g_regionAccepts) {
+#ifdef SHM_TRANSPORT
+        shmlsock = shm_listen(g_shmPath);
+        g_shmBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shmlsock < 0 || g_shmBell < 0) { fprintf(stderr, "shm listen failed (%s)\n", g_shmPath); return 1; }
+#else
+        fprintf(stderr, "--shm needs Linux; ignored\n");
+#endif
+    }
+
+    printf("[srv] Listening on port %s (TCP, UDP) and %s (WebSocket), world seed %llu, %d sim worker(s), rewind cap %d tick(s), up to %d instance(s) of %d player(s)\n", port, wsport, (unsigned long long)g_worldSeed, g_simWorkers, g_rewindCap, g_maxInstances, g_lobbySize);
+    if (shmlsock >= 0) printf("[srv] Shared-memory clients on %s\n", g_shmPath);
+    if (g_numRegions > 1) printf("[srv] Region %d of %d: map columns %d-%d%s\n", g_region, g_numRegions, g_regionX0, g_regionX1 - 1, g_regionAccepts ? ", takes new connections" : "");
     fflush(stdout);
 
-    fd_set readfds;
+    // poll() set: both listeners, the links to the left and right region, the --shm listener and
+    // doorbell, the UDP socket, then client slot i at index i + 7 (fd -1 while the slot is free or
+    // absent, and for UDP clients; the control socket for shared-memory clients). Unlike select()
+    // it has no FD_SETSIZE ceiling on socket numbers.
+    struct pollfd *pfds = NULL; int pfdCap = 0;
+    double nextTickMs = srv_now_ms(), ioMs = 0.0;
     while (1) {
-        FD_ZERO(&readfds); FD_SET(lsock, &readfds); FD_SET(wslsock, &readfds); sock_t maxfd = lsock; if (wslsock > maxfd) maxfd = wslsock;
-        for (int i = 0; i < MAX_CLIENTS; ++i) { if (clients[i].connected) { FD_SET(clients[i].sock, &readfds); if (clients[i].sock > maxfd) maxfd = clients[i].sock; } }
-        struct timeval tv; tv.tv_sec = 0; tv.tv_usec = 50000; // 50ms tick
-        select((int)(maxfd+1), &readfds, NULL, NULL, &tv);
+        if (pfdCap < g_clientCap + 7) {
+            struct pollfd *np = (struct pollfd*)realloc(pfds, (size_t)(g_clientCap + 7) * sizeof(*pfds));
+            if (!np) { fprintf(stderr, "out of memory\n"); return 1; }
+            pfds = np; pfdCap = g_clientCap + 7;
+        }
+        int npfd = g_clientHigh + 7;
+        pfds[0].fd = lsock; pfds[1].fd = wslsock;
+        pfds[2].fd = g_links[0].fd; pfds[3].fd = g_links[1].fd;
+        pfds[4].fd = shmlsock; pfds[5].fd = (sock_t)g_shmBell;
+        pfds[6].fd = g_udpSock;
+        for (int i = 0; i < g_clientHigh; ++i) pfds[i + 7].fd = clients[i].connected ? clients[i].sock : (sock_t)-1;
+        for (int k = 0; k < npfd; ++k) { pfds[k].events = POLLIN; pfds[k].revents = 0; }
+        double waitMs = nextTickMs - srv_now_ms();
+        poll(pfds, npfd, waitMs > 0 ? (int)(waitMs + 0.999) : 0); // until the next tick
+        double wakeMs = srv_now_ms();
 
-        if (FD_ISSET(lsock, &readfds)) {
+        if (pfds[0].revents & POLLIN) {
             struct sockaddr_storage ss; socklen_t slen = sizeof(ss);
             sock_t cs = accept(lsock, (struct sockaddr*)&ss, &slen);
             if (cs >= 0) {
                 // Set socket options to reduce latency and detect dead peers
                 int one = 1; setsockopt(cs, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
                 setsockopt(cs, SOL_SOCKET, SO_KEEPALIVE, (const char*)&one, sizeof(one));
-                int idx = -1; for (int i = 0; i < MAX_CLIENTS; ++i) if (!clients[i].connected) { idx = i; break; }
-                if (idx >= 0) {
-                    clients[idx].connected = 1; clients[idx].sock = cs; clients[idx].color = idx; clients[idx].isWebSocket = 0; clients[idx].wsHandshakeDone = 0; clients[idx].wsBufLen = 0;
-                    place_near_spawn(&clients[idx]);
-                    clients[idx].facing = DIR_RIGHT;
-                    clients[idx].hp = 3;
-                    clients[idx].invincibleTicks = 0;
-                    clients[idx].superTicks = 0;
-                    clients[idx].shootCooldown = 0;
-                    clients[idx].score = 0;
-                    clients[idx].lastActive = time(NULL);
-                    clients[idx].tokens = 10; // start with some burst allowance
-                    clients[idx].maxTokens = 20;
-                    clients[idx].refillTicks = 2; // every 2 server ticks (~100ms)
-                    clients[idx].refillAmount = 1; // add 1 token
-                    clients[idx].tickSinceRefill = 0;
+                int idx = client_alloc(cs, 0);
+                Instance *in = idx >= 0 ? instance_match() : NULL;
+                if (in) {
+                    instance_join(idx, in);
+                    client_reset_player(idx);
                     char host[64] = {0}, serv[16] = {0};
                     if (getnameinfo((struct sockaddr*)&ss, slen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
                         strncpy(host, "?", sizeof(host)-1); strncpy(serv, "?", sizeof(serv)-1);
                     }
-                    strncpy(clients[idx].addr, host, sizeof(clients[idx].addr)-1);
-                    strncpy(clients[idx].port, serv, sizeof(clients[idx].port)-1);
-                    clients[idx].connId = g_nextConnId++;
-                    printf("[srv] Client %d (cid=%llu) connected from %s:%s, color=%d, spawn=(%d,%d)@(%d,%d)\n",
-                           idx, clients[idx].connId, clients[idx].addr, clients[idx].port, clients[idx].color,
+                    strncpy(conns[idx].addr, host, sizeof(conns[idx].addr)-1);
+                    strncpy(conns[idx].port, serv, sizeof(conns[idx].port)-1);
+                    conns[idx].connId = g_nextConnId++;
+                    printf("[srv] Client %d (cid=%llu) connected from %s:%s, color=%d, instance %s, spawn=(%d,%d)@(%d,%d)\n",
+                           idx, conns[idx].connId, conns[idx].addr, conns[idx].port, clients[idx].color, in->name,
                            clients[idx].worldX, clients[idx].worldY, clients[idx].pos.x, clients[idx].pos.y);
                     fflush(stdout);
-                    char you[32]; int n = snprintf(you, sizeof(you), "YOU %d\n", idx);
-                    send_text_to_client(idx, you, n);
+                    send_you_line(idx);
+                    send_lobby_line(idx);
                     // send an immediate state frame so clients can show themselves without waiting a tick
-                    char line[128];
-                    char buf[4096]; int off = 0;
-                    int n0 = snprintf(line, sizeof(line), "TICK %d\n", g_tick_counter);
-                    if (n0 > 0 && off + n0 < (int)sizeof(buf)) { memcpy(buf + off, line, n0); off += n0; }
-                    for (int i = 0; i < MAX_CLIENTS; ++i) {
-                        int active = clients[i].connected ? 1 : 0;
-                        int pn = snprintf(line, sizeof(line), "PLAYER %d %d %d %d %d %d %d %d %d %d %d\n", i, clients[i].worldX, clients[i].worldY, clients[i].pos.x, clients[i].pos.y, clients[i].color, active, clients[i].hp, clients[i].invincibleTicks, clients[i].superTicks, clients[i].score);
-                        if (off + pn < (int)sizeof(buf)) { memcpy(buf + off, line, pn); off += pn; }
-                    }
-                    for (int b = 0; b < MAX_REMOTE_BULLETS; ++b) {
-                        if (!bullets[b].active) continue;
-                        int bn = snprintf(line, sizeof(line), "BULLET %d %d %d %d %d %d\n", bullets[b].worldX, bullets[b].worldY, bullets[b].pos.x, bullets[b].pos.y, 1, bullets[b].ownerId);
-                        if (off + bn < (int)sizeof(buf)) { memcpy(buf + off, line, bn); off += bn; }
-                    }
-                    send_text_to_client(idx, buf, off);
-                    // send only the current map snapshot to reduce initial burst
-                    send_map_to(idx, clients[idx].worldX, clients[idx].worldY);
-                    // signal client it can start accepting input/rendering
-                    {
-                        const char *ready = "READY\n";
-                        send_text_to_client(idx, ready, (int)strlen(ready));
-                    }
+                    send_state_frame(idx, 1);
+                    // send only the current map snapshot to reduce initial burst, then READY so the
+                    // client can start accepting input/rendering
+                    client_stream_map(idx, 1);
                 } else {
+                    if (idx >= 0) clients[idx].connected = 0;
                     const char *full = "FULL\n"; send(cs, full, (int)strlen(full), 0);
 #ifdef _WIN32
                     closesocket(cs);
@@ -956,13 +3596,13 @@ int main(int argc, char **argv) {
         }
 
         // Accept WebSocket clients
-        if (FD_ISSET(wslsock, &readfds)) {
+        if (pfds[1].revents & POLLIN) {
             struct sockaddr_storage ss; socklen_t slen = sizeof(ss);
             sock_t cs = accept(wslsock, (struct sockaddr*)&ss, &slen);
             if (cs >= 0) {
                 int one = 1; setsockopt(cs, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
                 setsockopt(cs, SOL_SOCKET, SO_KEEPALIVE, (const char*)&one, sizeof(one));
-                int idx = -1; for (int i = 0; i < MAX_CLIENTS; ++i) if (!clients[i].connected) { idx = i; break; }
+                int idx = client_alloc(cs, 1);
                 if (idx >= 0) {
                     // Determine client IP (for limits)
                     char host[64] = {0}, serv[16] = {0};
@@ -972,6 +3612,7 @@ int main(int argc, char **argv) {
                     // Per-IP concurrent limit (disabled)
                     // if (ws_count_active_for_ip(host) >= MAX_WS_PER_IP || !ws_rate_allow(host)) {
                     if (0) {
+                        clients[idx].connected = 0;
 #ifdef _WIN32
                         closesocket(cs);
 #else
@@ -979,73 +3620,43 @@ int main(int argc, char **argv) {
 #endif
                         continue;
                     }
-                    clients[idx].connected = 1; clients[idx].sock = cs; clients[idx].color = idx; clients[idx].isWebSocket = 1; clients[idx].wsHandshakeDone = 0; clients[idx].wsBufLen = 0;
+                    conns[idx].wsBuf = ws_buf_take();
                     // Read HTTP headers synchronously (short timeout) and complete WS handshake
                     {
                         // Set a short recv timeout so we don't block the loop too long
                         struct timeval rtv; rtv.tv_sec = 0; rtv.tv_usec = 200000; // 200 ms
                         setsockopt(cs, SOL_SOCKET, SO_RCVTIMEO, (const char*)&rtv, sizeof(rtv));
                         int total = 0;
-                        while (total < (int)sizeof(clients[idx].wsBuf) - 1) {
+                        while (conns[idx].wsBuf && total < WS_BUF_SIZE - 1) {
                             char tmp[1024]; int cap = (int)sizeof(tmp) - 1;
                             int rn = (int)recv(cs, tmp, cap, 0);
                             if (rn <= 0) break;
-                            int room = (int)sizeof(clients[idx].wsBuf) - 1 - total;
+                            int room = WS_BUF_SIZE - 1 - total;
                             if (rn > room) rn = room;
-                            memcpy(clients[idx].wsBuf + total, tmp, rn);
-                            total += rn; clients[idx].wsBuf[total] = '\0';
-                            if (strstr(clients[idx].wsBuf, "\r\n\r\n") || strstr(clients[idx].wsBuf, "\n\n")) break;
+                            memcpy(conns[idx].wsBuf + total, tmp, rn);
+                            total += rn; conns[idx].wsBuf[total] = '\0';
+                            if (strstr(conns[idx].wsBuf, "\r\n\r\n") || strstr(conns[idx].wsBuf, "\n\n")) break;
                         }
-                        clients[idx].wsBufLen = total;
-                        int hs = ws_handshake(&clients[idx]);
-                        if (hs <= 0) {
-                            // Bad handshake; close
-                            clients[idx].connected = 0;
-#ifdef _WIN32
-                            closesocket(cs);
-#else
-                            close(cs);
-#endif
-                            clients[idx].sock = 0;
+                        conns[idx].wsBufLen = total;
+                        int hs = ws_handshake(idx);
+                        Instance *in = hs > 0 ? instance_match() : NULL;
+                        if (hs > 0 && !in) send_text_to_client(idx, "FULL\n", 5);
+                        if (!in) {
+                            // Bad handshake (or no instance has room); close
+                            disconnect_client(idx);
                         } else {
                             // Initialize player state and send YOU + full map
-                            clients[idx].facing = DIR_RIGHT;
-                            clients[idx].hp = 3;
-                            clients[idx].invincibleTicks = 0;
-                            clients[idx].superTicks = 0;
-                            clients[idx].shootCooldown = 0;
-                            clients[idx].score = 0;
-                            clients[idx].lastActive = time(NULL);
-                            clients[idx].tokens = 10; clients[idx].maxTokens = 20; clients[idx].refillTicks = 2; clients[idx].refillAmount = 1; clients[idx].tickSinceRefill = 0;
-                            strncpy(clients[idx].addr, host, sizeof(clients[idx].addr)-1);
-                            strncpy(clients[idx].port, serv, sizeof(clients[idx].port)-1);
-                            clients[idx].connId = g_nextConnId++;
-                            place_near_spawn(&clients[idx]);
-                            char you[32]; int yn = snprintf(you, sizeof(you), "YOU %d\n", idx);
-                            send_text_to_client(idx, you, yn);
+                            instance_join(idx, in);
+                            client_reset_player(idx);
+                            strncpy(conns[idx].addr, host, sizeof(conns[idx].addr)-1);
+                            strncpy(conns[idx].port, serv, sizeof(conns[idx].port)-1);
+                            conns[idx].connId = g_nextConnId++;
+                            send_you_line(idx);
+                            send_lobby_line(idx);
                             // immediate state frame for WS client (before tile snapshot)
-                            char line[128];
-                            char buf[4096]; int off = 0;
-                            int n0 = snprintf(line, sizeof(line), "TICK %d\n", g_tick_counter);
-                            if (n0 > 0 && off + n0 < (int)sizeof(buf)) { memcpy(buf + off, line, n0); off += n0; }
-                            for (int i = 0; i < MAX_CLIENTS; ++i) {
-                                int active = clients[i].connected ? 1 : 0;
-                                int pn = snprintf(line, sizeof(line), "PLAYER %d %d %d %d %d %d %d %d %d %d %d\n", i, clients[i].worldX, clients[i].worldY, clients[i].pos.x, clients[i].pos.y, clients[i].color, active, clients[i].hp, clients[i].invincibleTicks, clients[i].superTicks, clients[i].score);
-                                if (off + pn < (int)sizeof(buf)) { memcpy(buf + off, line, pn); off += pn; }
-                            }
-                            for (int b = 0; b < MAX_REMOTE_BULLETS; ++b) {
-                                if (!bullets[b].active) continue;
-                                int bn = snprintf(line, sizeof(line), "BULLET %d %d %d %d %d %d\n", bullets[b].worldX, bullets[b].worldY, bullets[b].pos.x, bullets[b].pos.y, 1, bullets[b].ownerId);
-                                if (off + bn < (int)sizeof(buf)) { memcpy(buf + off, line, bn); off += bn; }
-                            }
-                            send_text_to_client(idx, buf, off);
-                    // now send only the current map snapshot (for WS clients)
-                    send_map_to(idx, clients[idx].worldX, clients[idx].worldY);
-                    // and signal READY
-                    {
-                        const char *ready = "READY\n";
-                        send_text_to_client(idx, ready, (int)strlen(ready));
-                    }
+                            send_state_frame(idx, 1);
+                    // now send only the current map snapshot (for WS clients), then READY
+                    client_stream_map(idx, 1);
                         }
                     }
                 } else {
@@ -1059,23 +3670,53 @@ int main(int argc, char **argv) {
             }
         }
 
+        // Shared-memory clients; the doorbell says at least one of them wrote to its ring
+        int bell = 0;
+#ifdef SHM_TRANSPORT
+        if (pfds[4].revents & POLLIN) shm_accept(shmlsock);
+        if (pfds[5].revents & POLLIN) { eventfd_t v; eventfd_read(g_shmBell, &v); bell = 1; }
+#endif
+
+        if (pfds[6].revents & POLLIN) udp_receive();
+
+        // Players handed over by a neighbor, and its edge tiles. A region is one part of a world
+        // that cannot run without the others, so a lost link shuts it down.
+        for (int side = 0; side < 2; ++side) {
+            if (!(pfds[2 + side].revents & (POLLIN | POLLHUP | POLLERR)) || region_read(side)) continue;
+            printf("[srv] Region %d: link to region %d closed, shutting down\n", g_region, g_region + (side ? 1 : -1));
+            fflush(stdout);
+            return 1;
+        }
+
         // Read inputs / WS handshake/frames
         char buf[2048];
-        for (int i = 0; i < MAX_CLIENTS; ++i) {
-            if (!clients[i].connected) continue;
-            if (!FD_ISSET(clients[i].sock, &readfds)) continue; // only read if socket is ready
-            int n = (int)recv(clients[i].sock, buf, sizeof(buf)-1, 0);
+        for (int i = 0; i + 7 < npfd; ++i) {
+            if (!clients[i].connected || clients[i].isUdp) continue;
+            // only read if socket is ready (and still the one polled; slots taken since have fd -1 there)
+            int ready = pfds[i + 7].fd == clients[i].sock && (pfds[i + 7].revents & (POLLIN | POLLHUP | POLLERR));
+            int n;
+#ifdef SHM_TRANSPORT
+            if (clients[i].isShm) {
+                // Whole lines from the ring first, so a BYE right before the hangup still counts;
+                // the control socket only ever reports the hangup
+                ShmLink *l = conns[i].shm;
+                n = bell || ready ? shm_ring_read(&l->up, l->upData, SHM_UP_SIZE, buf, sizeof(buf)-1, 1) : 0;
+                if (n > 0) {
+                    if (shm_ring_pending(&l->up)) eventfd_write(g_shmBell, 1); // more than buf holds: next pass
+                } else if (!ready || recv(clients[i].sock, buf, sizeof(buf)-1, MSG_DONTWAIT) > 0) {
+                    continue;
+                }
+            } else
+#endif
+            {
+                if (!ready) continue;
+                n = (int)recv(clients[i].sock, buf, sizeof(buf)-1, 0);
+            }
             if (n == 0) {
                 // orderly disconnect
-                printf("[srv] Client %d (cid=%llu) disconnected (socket closed) %s:%s\n", i, clients[i].connId, clients[i].addr, clients[i].port);
+                printf("[srv] Client %d (cid=%llu) disconnected (socket closed) %s:%s\n", i, conns[i].connId, conns[i].addr, conns[i].port);
                 fflush(stdout);
-                clients[i].connected = 0;
-#ifdef _WIN32
-                closesocket(clients[i].sock);
-#else
-                close(clients[i].sock);
-#endif
-                clients[i].sock = 0;
+                disconnect_client(i);
                 continue;
             }
             if (n < 0) {
@@ -1085,30 +3726,22 @@ int main(int argc, char **argv) {
             buf[n] = '\0';
             // If WS client and not handshaken, accumulate and do handshake
             if (clients[i].isWebSocket && !clients[i].wsHandshakeDone) {
-                if (clients[i].wsBufLen + n > (int)sizeof(clients[i].wsBuf)-1) clients[i].wsBufLen = 0; // reset on overflow
-                memcpy(clients[i].wsBuf + clients[i].wsBufLen, buf, n);
-                clients[i].wsBufLen += n;
-                int hs = ws_handshake(&clients[i]);
-                if (hs < 0) { // bad handshake
-                    clients[i].connected = 0;
-#ifdef _WIN32
-                    closesocket(clients[i].sock);
-#else
-                    close(clients[i].sock);
-#endif
-                    clients[i].sock = 0;
+                if (!conns[i].wsBuf) { disconnect_client(i); continue; }
+                if (conns[i].wsBufLen + n > WS_BUF_SIZE - 1) conns[i].wsBufLen = 0; // reset on overflow
+                memcpy(conns[i].wsBuf + conns[i].wsBufLen, buf, n);
+                conns[i].wsBufLen += n;
+                int hs = ws_handshake(i);
+                Instance *in = hs > 0 ? instance_match() : NULL;
+                if (hs > 0 && !in) send_text_to_client(i, "FULL\n", 5);
+                if (hs < 0 || (hs > 0 && !in)) { // bad handshake, or no instance has room
+                    disconnect_client(i);
                 } else if (hs > 0) {
                     // complete: now send YOU and current map only, then READY
-                    place_near_spawn(&clients[i]);
-                    clients[i].facing = DIR_RIGHT; clients[i].hp = 3; clients[i].invincibleTicks=0; clients[i].superTicks=0; clients[i].shootCooldown=0; clients[i].score=0; clients[i].lastActive=time(NULL);
-                    clients[i].tokens=10; clients[i].maxTokens=20; clients[i].refillTicks=2; clients[i].refillAmount=1; clients[i].tickSinceRefill=0;
-                    char you[32]; int yn = snprintf(you, sizeof(you), "YOU %d\n", i);
-                    send_text_to_client(i, you, yn);
-                    send_map_to(i, clients[i].worldX, clients[i].worldY);
-                    {
-                        const char *ready = "READY\n";
-                        send_text_to_client(i, ready, (int)strlen(ready));
-                    }
+                    instance_join(i, in);
+                    client_reset_player(i);
+                    send_you_line(i);
+                    send_lobby_line(i);
+                    client_stream_map(i, 1);
                 }
                 continue;
             }
@@ -1130,221 +3763,38 @@ int main(int argc, char **argv) {
                 memmove(buf, payload, n + 1);
             }
 
-            // parse simple commands: INPUT dx dy shoot | PING t
-            char *p = buf;
-            while (*p) {
-                char *eol = strchr(p, '\n'); if (eol) *eol = '\0';
-                int dx, dy, shoot;
-                if (strcmp(p, "BYE") == 0) {
-                    printf("[srv] Client %d (cid=%llu) disconnected (BYE) %s:%s\n", i, clients[i].connId, clients[i].addr, clients[i].port);
-                    fflush(stdout);
-                    clients[i].connected = 0;
-#ifdef _WIN32
-                    closesocket(clients[i].sock);
-#else
-                    close(clients[i].sock);
-#endif
-                    clients[i].sock = 0;
-                } else if (strncmp(p, "PING ", 5) == 0) {
-                    // Reflect back the timestamp/token for RTT measurement
-                    char line[128]; int rn = snprintf(line, sizeof(line), "PONG %s\n", p + 5);
-                    send_text_to_client(i, line, rn);
-                } else if (sscanf(p, "INPUT %d %d %d", &dx, &dy, &shoot) == 3) {
-                    clients[i].lastActive = time(NULL);
-                    // Rate limit: consume one token per INPUT; if none, drop and optionally warn
-                    if (clients[i].tokens <= 0) {
-                        // send minimal soft warning once in a while
-                        // (not strictly necessary for gameplay; keeps bandwidth tiny)
-                        // char warn[] = "WARN slow down\n"; send(clients[i].sock, warn, (int)strlen(warn), 0);
-                        goto parsed_continue;
-                    } else {
-                        clients[i].tokens--;
-                    }
-                    // update facing if a directional input was provided, even if movement is blocked
-                    if (dx < 0) clients[i].facing = DIR_LEFT; else if (dx > 0) clients[i].facing = DIR_RIGHT; else if (dy < 0) clients[i].facing = DIR_UP; else if (dy > 0) clients[i].facing = DIR_DOWN;
-                    int oldWX = clients[i].worldX;
-                    int oldWY = clients[i].worldY;
-                    int curx = clients[i].pos.x;
-                    int cury = clients[i].pos.y;
-                    int nx = curx + dx;
-                    int ny = cury + dy;
-                    // Preserve orthogonal axis on world transitions and avoid double-crossing on diagonals
-                    int crossedX = 0;
-                    if (nx < 0) {
-                        int entryY = cury;
-                        if (clients[i].worldX > 0 && is_open(&world[clients[i].worldY][clients[i].worldX-1], MAP_WIDTH-1, entryY)) {
-                            clients[i].worldX--;
-                            nx = MAP_WIDTH - 1;
-                            ny = entryY;
-                            crossedX = 1;
-                        }
-                    } else if (nx >= MAP_WIDTH) {
-                        int entryY = cury;
-                        if (clients[i].worldX < WORLD_W - 1 && is_open(&world[clients[i].worldY][clients[i].worldX+1], 0, entryY)) {
-                            clients[i].worldX++;
-                            nx = 0;
-                            ny = entryY;
-                            crossedX = 1;
-                        }
-                    }
-                    if (!crossedX) {
-                        if (ny < 0) {
-                            int entryX = curx;
-                            if (clients[i].worldY > 0 && is_open(&world[clients[i].worldY-1][clients[i].worldX], entryX, MAP_HEIGHT-1)) {
-                                clients[i].worldY--;
-                                ny = MAP_HEIGHT - 1;
-                                nx = entryX;
-                            }
-                        } else if (ny >= MAP_HEIGHT) {
-                            int entryX = curx;
-                            if (clients[i].worldY < WORLD_H - 1 && is_open(&world[clients[i].worldY+1][clients[i].worldX], entryX, 0)) {
-                                clients[i].worldY++;
-                                ny = 0;
-                                nx = entryX;
-                            }
-                        }
-                    }
-                    if (nx >= 0 && nx < MAP_WIDTH && ny >= 0 && ny < MAP_HEIGHT && is_open(&world[clients[i].worldY][clients[i].worldX], nx, ny)) {
-                        // Disallow stepping into a tile occupied by another player in the same map
-                        int occupied = 0;
-                        for (int pj = 0; pj < MAX_CLIENTS; ++pj) {
-                            if (pj == i) continue;
-                            if (!clients[pj].connected) continue;
-                            if (clients[pj].worldX == clients[i].worldX && clients[pj].worldY == clients[i].worldY && clients[pj].pos.x == nx && clients[pj].pos.y == ny) {
-                                occupied = 1; break;
-                            }
-                        }
-                        if (!occupied) {
-                            clients[i].pos.x = nx; clients[i].pos.y = ny;
-                        }
-                    }
-                    // If world tile changed, send the new map snapshot to this client
-                    if (clients[i].worldX != oldWX || clients[i].worldY != oldWY) {
-                        // send state first so client can show entities immediately
-                        char line[128]; char buf[4096]; int off = 0;
-                        int n0 = snprintf(line, sizeof(line), "TICK %d\n", g_tick_counter);
-                        if (n0 > 0 && off + n0 < (int)sizeof(buf)) { memcpy(buf + off, line, n0); off += n0; }
-                        for (int pj = 0; pj < MAX_CLIENTS; ++pj) {
-                            int active = clients[pj].connected ? 1 : 0;
-                            int pn = snprintf(line, sizeof(line), "PLAYER %d %d %d %d %d %d %d %d %d %d %d\n", pj, clients[pj].worldX, clients[pj].worldY, clients[pj].pos.x, clients[pj].pos.y, clients[pj].color, active, clients[pj].hp, clients[pj].invincibleTicks, clients[pj].superTicks, clients[pj].score);
-                            if (off + pn < (int)sizeof(buf)) { memcpy(buf + off, line, pn); off += pn; }
-                        }
-                        for (int b = 0; b < MAX_REMOTE_BULLETS; ++b) {
-                            if (!bullets[b].active) continue;
-                            int bn = snprintf(line, sizeof(line), "BULLET %d %d %d %d %d\n", bullets[b].worldX, bullets[b].worldY, bullets[b].pos.x, bullets[b].pos.y, 1);
-                            if (off + bn < (int)sizeof(buf)) { memcpy(buf + off, line, bn); off += bn; }
-                        }
-                        send_text_to_client(i, buf, off);
-                        send_map_to(i, clients[i].worldX, clients[i].worldY);
-                    }
-                    if (shoot) {
-                        // spawn a server bullet in player's facing; if dx/dy provided, infer and override
-                        int allow = 0;
-                        if (clients[i].superTicks > 0) {
-                            allow = 1; // spammable during super
-                        } else if (clients[i].shootCooldown <= 0) {
-                            allow = 1;
-                            clients[i].shootCooldown = 8; // ~400ms at 50ms tick (reduced fire rate)
-                        }
-                        if (allow) {
-                            Direction dir = clients[i].facing;
-                            if (dx < 0) dir = DIR_LEFT; else if (dx > 0) dir = DIR_RIGHT; else if (dy < 0) dir = DIR_UP; else if (dy > 0) dir = DIR_DOWN;
-                            int slot = -1; for (int bi = 0; bi < MAX_REMOTE_BULLETS; ++bi) if (!bullets[bi].active) { slot = bi; break; }
-                            if (slot >= 0) { bullets[slot].active = 1; bullets[slot].worldX = clients[i].worldX; bullets[slot].worldY = clients[i].worldY; bullets[slot].pos = clients[i].pos; bullets[slot].dir = dir; bullets[slot].ownerId = i; }
-                        }
-                    }
-                } else if (strncmp(p, "BUILD", 5) == 0) {
-                    // Player requests to build a wall in front of them
-                    clients[i].lastActive = time(NULL);
-                    int wx = clients[i].worldX;
-                    int wy = clients[i].worldY;
-                    int x = clients[i].pos.x;
-                    int y = clients[i].pos.y;
-                    int fdx = 0, fdy = 0;
-                    switch (clients[i].facing) {
-                        case DIR_LEFT: fdx = -1; break; case DIR_RIGHT: fdx = 1; break; case DIR_UP: fdy = -1; break; case DIR_DOWN: fdy = 1; break;
-                    }
-                    int tx = x + fdx;
-                    int ty = y + fdy;
-                    if (tx >= 0 && tx < MAP_WIDTH && ty >= 0 && ty < MAP_HEIGHT) {
-                        Map *m = &world[wy][wx];
-                        char cur = m->tiles[ty][tx];
-                        if (cur == '.') {
-                            // avoid building on players or enemies
-                            int occupied = 0;
-                            for (int pj = 0; pj < MAX_CLIENTS; ++pj) {
-                                if (!clients[pj].connected) continue;
-                                if (clients[pj].worldX == wx && clients[pj].worldY == wy && clients[pj].pos.x == tx && clients[pj].pos.y == ty) { occupied = 1; break; }
-                            }
-                            if (!occupied) {
-                                for (int ei = 0; ei < MAX_ENEMIES && !occupied; ++ei) {
-                                    if (enemies[wy][wx][ei].active && enemies[wy][wx][ei].pos.x == tx && enemies[wy][wx][ei].pos.y == ty) { occupied = 1; }
-                                }
-                            }
-                            if (!occupied) {
-                                m->tiles[ty][tx] = '#';
-                                m->wallDmg[ty][tx] = 0;
-                                broadcast_tile(wx, wy, tx, ty, '#');
-                            }
-                        }
-                    }
-                }
-parsed_continue:
-                if (!eol) break; p = eol + 1;
-            }
+            client_handle_lines(i, buf);
         }
+        udp_service(); // replies and greetings go out now, not at the next tick
 
-        // Inactivity timeout (3 minutes)
-        time_t now = time(NULL);
-        for (int i = 0; i < MAX_CLIENTS; ++i) {
-            if (!clients[i].connected) continue;
-            if (now - clients[i].lastActive > 180) {
-                printf("[srv] Client %d (cid=%llu) disconnected (timeout) %s:%s\n", i, clients[i].connId, clients[i].addr, clients[i].port);
-                fflush(stdout);
-                clients[i].connected = 0;
-#ifdef _WIN32
-                closesocket(clients[i].sock);
-#else
-                close(clients[i].sock);
-#endif
-                clients[i].sock = 0;
-            }
-        }
+        // Ticks run every TICK_MS; wakeups in between only accept and read. A tick that starts a
+        // whole period late does not build up a backlog of ticks to catch up on.
+        double tickMs = srv_now_ms();
+        if (tickMs < nextTickMs) { ioMs += tickMs - wakeMs; continue; }
+        nextTickMs += TICK_MS;
+        if (nextTickMs <= tickMs) { g_load.lateTicks++; nextTickMs = tickMs + TICK_MS; }
 
-        if ((g_tick_counter % 2) == 0) step_bullets(); // ~10 steps/sec
-        if ((g_tick_counter % 3) == 0) step_enemies(); // ~6-7 steps/sec
-        apply_enemy_contact_damage();
-        // handle pickups like 'X'
-        for (int ci = 0; ci < MAX_CLIENTS; ++ci) {
-            if (!clients[ci].connected) continue;
-            int wx = clients[ci].worldX;
-            int wy = clients[ci].worldY;
-            Map *m = &world[wy][wx];
-            int x = clients[ci].pos.x;
-            int y = clients[ci].pos.y;
-            if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) continue;
-            if (m->tiles[y][x] == 'X') {
-                if (clients[ci].hp < 3) clients[ci].hp = 3;
-                clients[ci].superTicks = 100; // 5s at 20 ticks/sec
-                clients[ci].invincibleTicks = 60; // 3s at 20 ticks/sec
-                m->tiles[y][x] = '.';
-                broadcast_tile(wx, wy, x, y, '.');
-            }
-        }
-        // tick down timers and refill input tokens
-        for (int i = 0; i < MAX_CLIENTS; ++i) {
-            if (!clients[i].connected) continue;
-            if (clients[i].invincibleTicks > 0) clients[i].invincibleTicks--;
-            if (clients[i].superTicks > 0) clients[i].superTicks--;
-            if (clients[i].shootCooldown > 0) clients[i].shootCooldown--;
-            clients[i].tickSinceRefill++;
-            if (clients[i].tickSinceRefill >= clients[i].refillTicks) {
-                clients[i].tickSinceRefill = 0;
-                clients[i].tokens += clients[i].refillAmount;
-                if (clients[i].tokens > clients[i].maxTokens) clients[i].tokens = clients[i].maxTokens;
-            }
-        }
+        // Due timers (inactivity timeouts); cost scales with timers firing, not with clients
+        tw_advance(&g_timers, (uint32_t)g_tick_counter);
+
+        // Templates the prefetch thread finished, before inputs move anyone onto their maps
+        template_prefetch_collect();
+
+        // queued INPUT actions, then bullets ~10 steps/sec, enemies ~6-7 steps/sec; contact damage and pickups every tick
+        drain_inputs();
+        step_world((g_tick_counter % 2) == 0, (g_tick_counter % ENEMY_STEP_TICKS) == 0);
+        for (int k = 0; k < g_numInstances; ++k) map_evict_idle(g_instances[k]);
+        if (g_tick_counter % TICKS_PER_SEC == 0) instance_reclaim_idle();
+        double sendMs = srv_now_ms();
+        send_input_acks();
+        drain_map_streams();
         broadcast_state();
+        udp_service();
+        double endMs = srv_now_ms();
+        g_load.simMs = sendMs - tickMs;
+        g_load.sendMs = endMs - sendMs;
+        load_update(ioMs + (endMs - wakeMs));
+        ioMs = 0.0;
         g_tick_counter++;
     }
 
@@ -0,0 +1,186 @@
+#ifndef SHM_H
+#define SHM_H
+
+// Shared-memory transport for clients and bots on the server's own host (Linux). The server
+// listens on an AF_UNIX socket (--shm PATH); a client connects and gets back, over SCM_RIGHTS, a
+// memfd holding one ShmLink, an eventfd the server signals when it wrote output the client asked
+// to be woken for, and the server's doorbell eventfd. The text protocol is unchanged; it travels
+// through two single-producer single-consumer byte rings instead of a socket. The socket stays
+// open only as the liveness signal: either side closing it ends the session.
+
+#if defined(__linux__)
+#define SHM_TRANSPORT 1
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define SHM_MAGIC 0x4D485344u // "DSHM", checked by the client after mapping
+#define SHM_UP_SIZE (1u << 16) // client -> server ring bytes (power of two)
+#define SHM_DOWN_SIZE (1u << 20) // server -> client ring bytes; several full map snapshots
+
+// Byte ring with one writer and one reader. head and tail are free-running offsets (the used
+// part is head - tail), each on its own cache line so the two sides never share one.
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head; // advanced by the producer only
+    _Alignas(64) _Atomic uint32_t tail; // advanced by the consumer only
+    _Atomic uint32_t wake; // set by a consumer about to block on its eventfd (see shm_ring_wait)
+} ShmRing;
+
+// The shared segment: upstream lines (INPUT, PING, ...) and downstream server output
+typedef struct {
+    uint32_t magic;
+    ShmRing up, down;
+    unsigned char upData[SHM_UP_SIZE];
+    unsigned char downData[SHM_DOWN_SIZE];
+} ShmLink;
+
+// Client end of a session (see shm_connect)
+typedef struct {
+    int sock; // control socket, -1 if closed
+    ShmLink *link;
+    int wakeFd; // signaled by the server for a waiting consumer
+    int bellFd; // rung after every upstream write
+} ShmSession;
+
+// Append len bytes, all or nothing. Returns 0 when the ring lacks room.
+static inline int shm_ring_write(ShmRing *r, unsigned char *data, uint32_t size, const void *src, int len) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if ((uint32_t)len > size - (head - tail)) return 0;
+    uint32_t at = head & (size - 1), first = size - at;
+    if (first > (uint32_t)len) first = (uint32_t)len;
+    memcpy(data + at, src, first);
+    memcpy(data, (const unsigned char*)src + first, (size_t)len - first);
+    atomic_store_explicit(&r->head, head + (uint32_t)len, memory_order_release);
+    return 1;
+}
+
+// After a write: whether the consumer asked to be woken (the request is consumed). The fence
+// pairs with the one in shm_ring_wait, so a consumer either sees the new head or gets a signal.
+static inline int shm_ring_take_wake(ShmRing *r) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&r->wake, memory_order_relaxed)) return 0;
+    return atomic_exchange(&r->wake, 0) != 0;
+}
+
+// Whether unread bytes are waiting
+static inline int shm_ring_pending(ShmRing *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) != atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+// Copy up to cap bytes out. With lines set, only complete lines are taken (a single line longer
+// than cap is cut). The producer may be untrusted: offsets are masked and the count clamped, so
+// a corrupt head costs garbage input, never an access outside the ring.
+static inline int shm_ring_read(ShmRing *r, const unsigned char *data, uint32_t size, void *dst, int cap, int lines) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t n = head - tail;
+    if (n > size) n = size;
+    if (n > (uint32_t)cap) n = (uint32_t)cap;
+    if (n == 0) return 0;
+    uint32_t at = tail & (size - 1), first = size - at;
+    if (first > n) first = n;
+    memcpy(dst, data + at, first);
+    memcpy((unsigned char*)dst + first, data, n - first);
+    if (lines) {
+        uint32_t k = n;
+        while (k > 0 && ((unsigned char*)dst)[k - 1] != '\n') k--;
+        if (k > 0) n = k;
+        else if (n < (uint32_t)cap) return 0; // partial line; the rest is still being written
+    }
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return (int)n;
+}
+
+// Block until the ring has data, timeoutMs passes (-1: forever) or efd is signaled. Returns 1 if
+// data is waiting. For bots that sleep between messages; the game client polls every frame.
+static inline int shm_ring_wait(ShmRing *r, int efd, int timeoutMs) {
+    atomic_store(&r->wake, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!shm_ring_pending(r)) {
+        struct pollfd p = { efd, POLLIN, 0 };
+        if (poll(&p, 1, timeoutMs) > 0) { eventfd_t v; eventfd_read(efd, &v); }
+    }
+    atomic_store(&r->wake, 0);
+    return shm_ring_pending(r);
+}
+
+// Send one line with the memfd, the client's wake eventfd and the doorbell attached
+static inline int shm_send_fds(int sock, const char *line, const int fds[3]) {
+    struct iovec iov = { (void*)line, strlen(line) };
+    struct msghdr msg; memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov; msg.msg_iovlen = 1;
+    union { struct cmsghdr h; char b[CMSG_SPACE(3 * sizeof(int))]; } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_control = ctl.b; msg.msg_controllen = sizeof(ctl.b);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET; cm->cmsg_type = SCM_RIGHTS; cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, 3 * sizeof(int));
+    return sendmsg(sock, &msg, 0) == (ssize_t)iov.iov_len;
+}
+
+// Client side: connect to the server's --shm socket and map the session. Returns 0 on success;
+// -1 if the server is unreachable, full (it answers FULL without descriptors) or not compatible.
+static inline int shm_connect(const char *path, ShmSession *s) {
+    s->sock = s->wakeFd = s->bellFd = -1; s->link = NULL;
+    struct sockaddr_un sa; memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+    strcpy(sa.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr*)&sa, sizeof(sa)) != 0) { close(sock); return -1; }
+    char line[64];
+    struct iovec iov = { line, sizeof(line) - 1 };
+    struct msghdr msg; memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov; msg.msg_iovlen = 1;
+    union { struct cmsghdr h; char b[CMSG_SPACE(3 * sizeof(int))]; } ctl;
+    msg.msg_control = ctl.b; msg.msg_controllen = sizeof(ctl.b);
+    ssize_t n = recvmsg(sock, &msg, 0);
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cm || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) { close(sock); return -1; }
+    int fds[3]; memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    ShmLink *l = (ShmLink*)mmap(NULL, sizeof(ShmLink), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]); // the mapping keeps the segment
+    if (l == MAP_FAILED || l->magic != SHM_MAGIC) {
+        if (l != MAP_FAILED) munmap(l, sizeof(ShmLink));
+        close(fds[1]); close(fds[2]); close(sock);
+        return -1;
+    }
+    s->sock = sock; s->link = l; s->wakeFd = fds[1]; s->bellFd = fds[2];
+    return 0;
+}
+
+// Queue one or more complete lines for the server and ring its doorbell. Returns 0 when the
+// upstream ring is full (the server stopped reading).
+static inline int shm_session_send(ShmSession *s, const void *data, int len) {
+    if (!s->link || !shm_ring_write(&s->link->up, s->link->upData, SHM_UP_SIZE, data, len)) return 0;
+    eventfd_write(s->bellFd, 1);
+    return len;
+}
+
+// Take pending server output without blocking; 0 if there is none
+static inline int shm_session_recv(ShmSession *s, void *buf, int cap) {
+    if (!s->link) return 0;
+    return shm_ring_read(&s->link->down, s->link->downData, SHM_DOWN_SIZE, buf, cap, 0);
+}
+
+static inline void shm_session_close(ShmSession *s) {
+    if (s->link) munmap(s->link, sizeof(ShmLink));
+    if (s->wakeFd >= 0) close(s->wakeFd);
+    if (s->bellFd >= 0) close(s->bellFd);
+    if (s->sock >= 0) close(s->sock);
+    s->sock = s->wakeFd = s->bellFd = -1; s->link = NULL;
+}
+
+#endif // __linux__
+
+#endif // SHM_H
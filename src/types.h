@@ -5,7 +5,7 @@
 #define MAP_HEIGHT 18
 #define MAX_ENEMIES 5
 #define MAX_PROJECTILES 32
-#define MAX_REMOTE_PLAYERS 16
+#define MAX_REMOTE_PLAYERS 4096 // player ids are server client slots (below its CLIENT_TABLE_MAX)
 #define MAX_REMOTE_BULLETS 64
 #define MAX_REMOTE_ENEMIES 128
 
@@ -0,0 +1,213 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// UDP transport for the text protocol: the server's UDP port (same number as TCP) and udp:
+// addresses in client_connect. Every datagram starts with one header line, then whole lines:
+//   U <n>     unreliable. From the server n is the tick; a snapshot too big for one datagram
+//             continues in more with the same n, and clients drop every n older than the newest
+//             they have seen, so a lost snapshot only costs that tick. Clients send INPUT and
+//             PING this way (n 0).
+//   R <seq>   reliable: delivered once and in order (go-back-N), answered with A
+//   A <next>  every reliable packet before next has arrived
+// Client datagrams end the header with the session reference from WELCOME (R <seq> <ref>).
+// Setup: CONNECT, padded to UDP_CONNECT_LEN, gets CHALLENGE <token>; CONNECT <token> gets
+// WELCOME <ref>, and the reliable stream (YOU, LOBBY, maps, READY) follows. The token is bound
+// to the sender's address, so a spoofed source only ever gets one small CHALLENGE. It is a keyed
+// MAC (udp_siphash) of the address under a random key, so knowing tokens for some addresses
+// does not help forge one for another.
+
+#define UDP_MTU 1200 // datagram cap, header included; clear of IP fragmentation
+#define UDP_CONNECT_LEN 64 // CONNECT is padded to at least this, more than CHALLENGE takes
+#define UDP_WINDOW 32 // reliable packets in flight
+#define UDP_BACKLOG_MAX (1 << 20) // queued reliable bytes before the peer counts as gone
+#define UDP_RTO_INIT_MS 200.0
+#define UDP_RTO_MIN_MS 50.0
+#define UDP_RTO_MAX_MS 1000.0
+#define UDP_TIMEOUT_MS 10000.0 // silence before a peer is dropped (clients PING every second)
+
+typedef void (*UdpSendFn)(void *ctx, const char *pkt, int len);
+
+// SipHash-2-4 (Aumasson and Bernstein, https://cr.yp.to/siphash/siphash-20120918.pdf) of
+// data under a 128-bit key: the server's CONNECT tokens
+#define UDP_SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define UDP_SIP_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = UDP_SIP_ROTL(v1, 13); v1 ^= v0; v0 = UDP_SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = UDP_SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = UDP_SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = UDP_SIP_ROTL(v1, 17); v1 ^= v2; v2 = UDP_SIP_ROTL(v2, 32); \
+} while (0)
+static inline uint64_t udp_siphash(const uint64_t key[2], const void *data, size_t len) {
+    const unsigned char *in = (const unsigned char*)data;
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL, v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL, v3 = key[1] ^ 0x7465646279746573ULL;
+    size_t whole = len & ~(size_t)7;
+    for (size_t off = 0; off < whole; off += 8) {
+        uint64_t m = 0;
+        for (int i = 0; i < 8; ++i) m |= (uint64_t)in[off + i] << (8 * i);
+        v3 ^= m;
+        UDP_SIP_ROUND(v0, v1, v2, v3); UDP_SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < (len & 7); ++i) b |= (uint64_t)in[whole + i] << (8 * i);
+    v3 ^= b;
+    UDP_SIP_ROUND(v0, v1, v2, v3); UDP_SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    UDP_SIP_ROUND(v0, v1, v2, v3); UDP_SIP_ROUND(v0, v1, v2, v3);
+    UDP_SIP_ROUND(v0, v1, v2, v3); UDP_SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+#undef UDP_SIP_ROUND
+#undef UDP_SIP_ROTL
+
+typedef struct {
+    int len;
+    int resent; // retransmitted at least once: no RTT sample from its ack (Karn)
+    double sentMs;
+    char data[UDP_MTU];
+} UdpPacket;
+
+// One direction's reliable sender plus the other direction's receive state
+typedef struct {
+    uint32_t ref; // appended to every header when nonzero (the client's side)
+    uint32_t sendNext; // sequence number of the next new packet
+    uint32_t sendUna; // oldest packet not yet acknowledged
+    UdpPacket win[UDP_WINDOW]; // packets in flight, by seq % UDP_WINDOW
+    char *pend; // queued bytes not yet in a packet: [pendOff, pendLen)
+    int pendOff, pendLen, pendCap;
+    uint32_t recvNext; // next reliable sequence number expected from the peer
+    double srttMs, rtoMs;
+} UdpChannel;
+
+static inline void udp_channel_init(UdpChannel *ch, uint32_t ref) {
+    memset(ch, 0, sizeof(*ch));
+    ch->ref = ref;
+    ch->rtoMs = UDP_RTO_INIT_MS;
+}
+
+static inline void udp_channel_free(UdpChannel *ch) {
+    free(ch->pend);
+    ch->pend = NULL;
+    ch->pendOff = ch->pendLen = ch->pendCap = 0;
+}
+
+static inline int udp_header(const UdpChannel *ch, char *out, char type, uint32_t n) {
+    return ch->ref ? sprintf(out, "%c %u %u\n", type, (unsigned)n, (unsigned)ch->ref) : sprintf(out, "%c %u\n", type, (unsigned)n);
+}
+
+// Parse the header of a U, R or A datagram. Returns the type letter (0 for anything else) and
+// sets the number, the reference (0 if absent) and the offset of the payload.
+static inline char udp_parse_header(const char *pkt, int len, uint32_t *n, uint32_t *ref, int *off) {
+    const char *eol = (const char*)memchr(pkt, '\n', (size_t)len);
+    if (!eol || len < 3 || pkt[1] != ' ' || (pkt[0] != 'U' && pkt[0] != 'R' && pkt[0] != 'A')) return 0;
+    char line[48];
+    int hl = (int)(eol - pkt);
+    if (hl >= (int)sizeof(line)) return 0;
+    memcpy(line, pkt, (size_t)hl); line[hl] = '\0';
+    unsigned a = 0, b = 0;
+    int k = sscanf(line + 2, "%u %u", &a, &b);
+    if (k < 1) return 0;
+    *n = a; *ref = k == 2 ? b : 0; *off = hl + 1;
+    return pkt[0];
+}
+
+// Queue bytes (whole lines) for reliable delivery. Returns 0 once UDP_BACKLOG_MAX is exceeded.
+static inline int udp_queue(UdpChannel *ch, const char *data, int len) {
+    if (ch->pendOff > 0 && ch->pendOff >= ch->pendLen / 2) {
+        memmove(ch->pend, ch->pend + ch->pendOff, (size_t)(ch->pendLen - ch->pendOff));
+        ch->pendLen -= ch->pendOff; ch->pendOff = 0;
+    }
+    if (ch->pendLen - ch->pendOff + len > UDP_BACKLOG_MAX) return 0;
+    if (ch->pendLen + len > ch->pendCap) {
+        int ncap = ch->pendCap ? ch->pendCap : 4096;
+        while (ncap < ch->pendLen + len) ncap *= 2;
+        char *np = (char*)realloc(ch->pend, (size_t)ncap);
+        if (!np) return 0;
+        ch->pend = np; ch->pendCap = ncap;
+    }
+    memcpy(ch->pend + ch->pendLen, data, (size_t)len);
+    ch->pendLen += len;
+    return 1;
+}
+
+// Retransmit on timeout (everything in flight, go-back-N), then packetize queued bytes while the
+// window has room. Packets end on a line boundary so receivers never see half a line.
+static inline void udp_pump(UdpChannel *ch, double nowMs, UdpSendFn send, void *ctx) {
+    if (ch->sendUna != ch->sendNext && nowMs - ch->win[ch->sendUna % UDP_WINDOW].sentMs >= ch->rtoMs) {
+        for (uint32_t s = ch->sendUna; s != ch->sendNext; ++s) {
+            UdpPacket *p = &ch->win[s % UDP_WINDOW];
+            p->resent = 1; p->sentMs = nowMs;
+            send(ctx, p->data, p->len);
+        }
+        ch->rtoMs = ch->rtoMs * 2 > UDP_RTO_MAX_MS ? UDP_RTO_MAX_MS : ch->rtoMs * 2;
+    }
+    while (ch->pendOff < ch->pendLen && ch->sendNext - ch->sendUna < UDP_WINDOW) {
+        UdpPacket *p = &ch->win[ch->sendNext % UDP_WINDOW];
+        int hl = udp_header(ch, p->data, 'R', ch->sendNext);
+        int take = ch->pendLen - ch->pendOff;
+        if (take > UDP_MTU - hl) {
+            take = UDP_MTU - hl;
+            const char *src = ch->pend + ch->pendOff;
+            int cut = take;
+            while (cut > 0 && src[cut - 1] != '\n') cut--;
+            if (cut > 0) take = cut; // else a line longer than a packet: cut anyway
+        }
+        memcpy(p->data + hl, ch->pend + ch->pendOff, (size_t)take);
+        p->len = hl + take; p->resent = 0; p->sentMs = nowMs;
+        ch->pendOff += take;
+        ch->sendNext++;
+        send(ctx, p->data, p->len);
+    }
+}
+
+// A <next> from the peer: drop acknowledged packets and take an RTT sample
+static inline void udp_on_ack(UdpChannel *ch, uint32_t next, double nowMs) {
+    if ((int32_t)(next - ch->sendUna) <= 0 || (int32_t)(next - ch->sendNext) > 0) return;
+    const UdpPacket *last = &ch->win[(next - 1) % UDP_WINDOW];
+    if (!last->resent) {
+        double rtt = nowMs - last->sentMs;
+        ch->srttMs = ch->srttMs > 0 ? 0.875 * ch->srttMs + 0.125 * rtt : rtt;
+    }
+    double rto = ch->srttMs > 0 ? 2 * ch->srttMs : UDP_RTO_INIT_MS;
+    ch->rtoMs = rto < UDP_RTO_MIN_MS ? UDP_RTO_MIN_MS : rto > UDP_RTO_MAX_MS ? UDP_RTO_MAX_MS : rto;
+    ch->sendUna = next;
+}
+
+// R <seq> arrived: 1 if it is the next one in order (deliver it), 0 for a duplicate or a packet
+// after a gap (dropped; go-back-N resends it). Answer with udp_send_ack either way.
+static inline int udp_accept(UdpChannel *ch, uint32_t seq) {
+    if (seq != ch->recvNext) return 0;
+    ch->recvNext++;
+    return 1;
+}
+
+static inline void udp_send_ack(const UdpChannel *ch, UdpSendFn send, void *ctx) {
+    char pkt[48];
+    send(ctx, pkt, udp_header(ch, pkt, 'A', ch->recvNext));
+}
+
+// Unreliable lines under number n, split on line boundaries across as many datagrams as needed
+static inline void udp_send_unreliable(const UdpChannel *ch, uint32_t n, const char *data, int len, UdpSendFn send, void *ctx) {
+    char pkt[UDP_MTU];
+    int hl = udp_header(ch, pkt, 'U', n);
+    while (len > 0) {
+        int take = len;
+        if (take > UDP_MTU - hl) {
+            take = UDP_MTU - hl;
+            int cut = take;
+            while (cut > 0 && data[cut - 1] != '\n') cut--;
+            if (cut > 0) take = cut;
+        }
+        memcpy(pkt + hl, data, (size_t)take);
+        send(ctx, pkt, hl + take);
+        data += take; len -= take;
+    }
+}
+
+#endif // UDP_H
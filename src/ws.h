@@ -0,0 +1,190 @@
+#ifndef WS_H
+#define WS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// The server side of WebSocket (RFC 6455): the handshake reply, the header of the unmasked text
+// frames we send and a parser for masked client frames. Shared by the game server, the
+// spectator relay and the WebSocket gateway.
+
+// --- Minimal Base64 encoding ---
+static const char ws_b64tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static inline int base64_encode(const uint8_t *in, int inlen, char *out, int outcap) {
+    int o = 0;
+    int i = 0;
+    while (i + 2 < inlen) {
+        if (o + 4 > outcap) return o;
+        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8) | in[i+2];
+        out[o++] = ws_b64tab[(v >> 18) & 63];
+        out[o++] = ws_b64tab[(v >> 12) & 63];
+        out[o++] = ws_b64tab[(v >> 6) & 63];
+        out[o++] = ws_b64tab[v & 63];
+        i += 3;
+    }
+    int rem = inlen - i;
+    if (rem == 1) {
+        if (o + 4 > outcap) return o;
+        uint32_t v = ((uint32_t)in[i]) << 16;
+        out[o++] = ws_b64tab[(v >> 18) & 63];
+        out[o++] = ws_b64tab[(v >> 12) & 63];
+        out[o++] = '=';
+        out[o++] = '=';
+    } else if (rem == 2) {
+        if (o + 4 > outcap) return o;
+        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8);
+        out[o++] = ws_b64tab[(v >> 18) & 63];
+        out[o++] = ws_b64tab[(v >> 12) & 63];
+        out[o++] = ws_b64tab[(v >> 6) & 63];
+        out[o++] = '=';
+    }
+    if (o < outcap) out[o] = '\0';
+    return o;
+}
+
+// --- Minimal SHA1 implementation ---
+static inline uint32_t rol32(uint32_t v, int r) { return (v << r) | (v >> (32 - r)); }
+static inline void sha1_block(uint32_t h[5], const uint8_t *blk) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)blk[i*4 + 0] << 24) |
+               ((uint32_t)blk[i*4 + 1] << 16) |
+               ((uint32_t)blk[i*4 + 2] << 8)  |
+               ((uint32_t)blk[i*4 + 3]);
+    }
+    for (int i = 16; i < 80; i++) w[i] = rol32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) { f = (b & c) | ((~b) & d); k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+        uint32_t temp = rol32(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = rol32(b, 30); b = a; a = temp;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+// Whole blocks are hashed in place; the rest, the 0x80 marker and the bit length go through one
+// or two blocks on the stack, so there is nothing to allocate and nothing that can fail
+static inline void sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    size_t off = 0;
+    for (; off + 64 <= len; off += 64) sha1_block(h, data + off);
+    uint8_t tail[128];
+    size_t rem = len - off, tlen = rem + 1 + 8 <= 64 ? 64 : 128;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + off, rem);
+    tail[rem] = 0x80;
+    uint64_t bits = (uint64_t)len * 8ULL;
+    for (int i = 0; i < 8; i++) tail[tlen - 1 - i] = (uint8_t)((bits >> (8 * i)) & 0xFF);
+    sha1_block(h, tail);
+    if (tlen == 128) sha1_block(h, tail + 64);
+    for (int i = 0; i < 5; i++) {
+        out[i*4 + 0] = (uint8_t)((h[i] >> 24) & 0xFF);
+        out[i*4 + 1] = (uint8_t)((h[i] >> 16) & 0xFF);
+        out[i*4 + 2] = (uint8_t)((h[i] >> 8) & 0xFF);
+        out[i*4 + 3] = (uint8_t)(h[i] & 0xFF);
+    }
+}
+
+// Build the 101 reply for the upgrade request in req (NUL-terminated) into resp. Returns its
+// length, 0 while the request headers are incomplete, or -1 if there is no Sec-WebSocket-Key.
+static inline int ws_handshake_reply(const char *req, char *resp, int cap) {
+    const char *end = strstr(req, "\r\n\r\n");
+    if (!end) end = strstr(req, "\n\n"); // be tolerant
+    if (!end) return 0; // need more
+    // Robust header parse: find Sec-WebSocket-Key case-insensitively, ignoring whitespace
+    char key[128] = {0};
+    const char *p = req;
+    while (p < end) {
+        const char *ln = p;
+        const char *nl = strstr(ln, "\n");
+        if (!nl || nl > end) nl = end;
+        // Trim CRLF
+        const char *lineEnd = nl;
+        if (lineEnd > ln && *(lineEnd-1) == '\r') lineEnd--;
+        // Find colon
+        const char *colon = NULL;
+        for (const char *q = ln; q < lineEnd; ++q) { if (*q == ':') { colon = q; break; } }
+        if (colon) {
+            // Header name
+            int nameMatch = 1;
+            const char *name = "sec-websocket-key";
+            const char *q = ln; int idx = 0;
+            while (q < colon && name[idx]) {
+                char a = tolower((unsigned char)*q);
+                char b = name[idx];
+                if (a != b) { nameMatch = 0; break; }
+                q++; idx++;
+            }
+            if (name[idx] != '\0') nameMatch = 0; // not full name
+            if (nameMatch) {
+                const char *val = colon + 1;
+                while (val < lineEnd && (*val==' '||*val=='\t')) val++;
+                int ki = 0;
+                while (val < lineEnd && ki < (int)sizeof(key)-1) key[ki++] = *val++;
+                key[ki] = '\0';
+                break;
+            }
+        }
+        p = nl + 1;
+    }
+    if (key[0] == '\0') { return -1; }
+    const char *GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char concat[256]; snprintf(concat, sizeof(concat), "%s%s", key, GUID);
+    uint8_t digest[20]; sha1((const uint8_t*)concat, strlen(concat), digest);
+    char accept[64]; base64_encode(digest, 20, accept, sizeof(accept));
+    int rn = snprintf(resp, cap,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    return (rn > 0 && rn < cap) ? rn : -1;
+}
+
+// Header of a server-to-client unmasked text frame carrying len bytes; returns its size
+static inline int ws_frame_header(uint8_t hdr[10], int len) {
+    hdr[0] = 0x81; // FIN + text
+    if (len < 126) { hdr[1] = (uint8_t)len; return 2; }
+    if (len <= 0xFFFF) { hdr[1] = 126; hdr[2] = (len >> 8) & 0xFF; hdr[3] = len & 0xFF; return 4; }
+    hdr[1] = 127; // 64-bit length
+    hdr[2]=hdr[3]=hdr[4]=hdr[5]=0; hdr[6]=(len>>24)&0xFF; hdr[7]=(len>>16)&0xFF; hdr[8]=(len>>8)&0xFF; hdr[9]=len&0xFF;
+    return 10;
+}
+
+// Parse one masked client frame at the start of buf[0, len) and unmask its payload in place.
+// Returns the bytes it takes (payload at buf + *off, *plen long), 0 if it is not complete yet, or
+// -1 for an unmasked frame or a payload over max.
+static inline int ws_parse_frame(uint8_t *buf, int len, int max, int *opcode, int *off, int *plen) {
+    if (len < 2) return 0;
+    uint64_t n = buf[1] & 0x7F;
+    int o = 2;
+    if (n == 126) { if (len < 4) return 0; n = ((uint64_t)buf[2] << 8) | buf[3]; o = 4; }
+    else if (n == 127) { if (len < 10) return 0; n = 0; for (int i = 2; i < 10; ++i) n = (n << 8) | buf[i]; o = 10; }
+    if (!(buf[1] & 0x80) || n > (uint64_t)max) return -1;
+    if (len < o + 4 + (int)n) return 0;
+    const uint8_t *mask = buf + o;
+    o += 4;
+    for (int i = 0; i < (int)n; ++i) buf[o + i] ^= mask[i & 3];
+    *opcode = buf[0] & 0x0F;
+    *off = o;
+    *plen = (int)n;
+    return o + (int)n;
+}
+
+// Length of the first message in data[0, len) (complete lines): everything before the second TICK
+// line. The web client takes each message as one snapshot and clears its enemies per message, so
+// whoever frames the line stream cuts it at tick boundaries.
+static inline int ws_message_span(const char *data, int len) {
+    for (int i = 0; i + 6 <= len; ++i) {
+        if (data[i] == '\n' && memcmp(data + i + 1, "TICK ", 5) == 0) return i + 1;
+    }
+    return len;
+}
+
+#endif // WS_H